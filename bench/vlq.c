@@ -0,0 +1,173 @@
+// (c) Copyright 2018, Sean Connelly (@voidqk), http://sean.cm
+// MIT License
+// Project Home: https://github.com/voidqk/basicmidi
+
+// times read_dt's byte-by-byte loop against a branch-free decode that loads 4 bytes at once and
+// masks out the length, on a note-dense track where most timestamps are a single byte, and on
+// sparse controller data where 1 to 3 byte timestamps are mixed unpredictably; also times
+// bm_readmidi as a whole on the note-dense track
+//
+// The masked load wins on mixed lengths, where the byte loop mispredicts, but loses badly on dense
+// tracks, where the byte loop's branch is predictable and each load doesn't wait on the previous
+// length, so read_dt keeps the byte loop
+
+#define _POSIX_C_SOURCE 200809L
+#include "../src/basicmidi.c"
+#include <time.h>
+
+#define EVENTS  4000000
+#define ROUNDS  20
+
+static double now(){
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int put_vlq(uint8_t *out, uint32_t v){
+	uint8_t tmp[4];
+	int n = 0;
+	do{
+		tmp[n++] = v & 0x7F;
+		v >>= 7;
+	} while (v);
+	for (int i = 0; i < n; i++)
+		out[i] = tmp[n - 1 - i] | (i < n - 1 ? 0x80 : 0);
+	return n;
+}
+
+static uint32_t rand32(uint32_t *rng){
+	*rng ^= *rng << 13;
+	*rng ^= *rng >> 17;
+	*rng ^= *rng << 5;
+	return *rng;
+}
+
+// mostly 0 or small, with the occasional 2 or 3 byte gap
+static uint32_t dense_dt(uint32_t *rng){
+	uint32_t r = rand32(rng) % 100;
+	return r < 60 ? 0 : r < 95 ? r : r < 99 ? 200 + r * 10 : 20000 + r;
+}
+
+// gaps spread over several orders of magnitude
+static uint32_t mixed_dt(uint32_t *rng){
+	uint32_t r = rand32(rng);
+	return (r & 0xFFFFF) >> (r % 20);
+}
+
+// a candidate for read_dt, which falls back to it near the end of the chunk or for invalid data
+static inline bool masked_dt(chunk_st *chunk, const uint8_t *data){
+	if (chunk->end - chunk->start < 4)
+		return read_dt(chunk, data, 0, NULL, NULL, NULL);
+	const uint8_t *d = &data[chunk->start];
+	uint32_t w = (uint32_t)d[0] | ((uint32_t)d[1] << 8) | ((uint32_t)d[2] << 16) |
+		((uint32_t)d[3] << 24);
+	uint32_t stop = ~w & 0x80808080; // top bit of the bytes that end the quantity
+	if (stop == 0)
+		return read_dt(chunk, data, 0, NULL, NULL, NULL);
+	int len = (__builtin_ctz(stop) >> 3) + 1;
+	// put the used bytes in big-endian order at the bottom, then squeeze out their top bits
+	uint32_t v = __builtin_bswap32(w & 0x7F7F7F7F) >> (32 - 8 * len);
+	chunk->dt = (v & 0x7F) | ((v >> 1) & 0x3F80) | ((v >> 2) & 0x1FC000) | ((v >> 3) & 0xFE00000);
+	chunk->start += len;
+	return true;
+}
+
+static void count_event(bm_delta_ev_st ev, void *user){
+	(*(int64_t *)user) += ev.delta + 1;
+}
+
+// times both decodes over the timestamps in dts, returning false if they disagree
+static bool bench_dts(const char *name, const uint8_t *dts, int dts_size){
+	double best_ref = 1e9, best_mask = 1e9;
+	int64_t sum_ref = 0, sum_mask = 0;
+	for (int r = 0; r < ROUNDS; r++){
+		chunk_st c = { .start = 0, .end = dts_size };
+		double t = now();
+		sum_ref = 0;
+		while (c.start < c.end && read_dt(&c, dts, 0, NULL, NULL, NULL))
+			sum_ref += c.dt;
+		t = now() - t;
+		if (t < best_ref)
+			best_ref = t;
+
+		c = (chunk_st){ .start = 0, .end = dts_size };
+		t = now();
+		sum_mask = 0;
+		while (c.start < c.end && masked_dt(&c, dts))
+			sum_mask += c.dt;
+		t = now() - t;
+		if (t < best_mask)
+			best_mask = t;
+	}
+	if (sum_ref != sum_mask){
+		fprintf(stderr, "%s: timestamp sums differ: %lld vs %lld\n", name, (long long)sum_ref,
+			(long long)sum_mask);
+		return false;
+	}
+	printf("%s: %d timestamps, %d bytes\n", name, EVENTS, dts_size);
+	printf("  read_dt      %8.2f ms  %6.2f ns/timestamp\n", best_ref * 1e3,
+		best_ref * 1e9 / EVENTS);
+	printf("  masked load  %8.2f ms  %6.2f ns/timestamp\n", best_mask * 1e3,
+		best_mask * 1e9 / EVENTS);
+	return true;
+}
+
+int main(){
+	// timestamps on their own, so the loops measure just the decode
+	uint8_t *dts = malloc(EVENTS * 4);
+	int dts_size = 0;
+	// the dense timestamps with note on/off events between them, as a format 0 file
+	uint8_t *mid = malloc(EVENTS * 7 + 100);
+	int mid_size = 0;
+	static const uint8_t head[] = {
+		'M', 'T', 'h', 'd', 0, 0, 0, 6, 0, 0, 0, 1, 0, 96,
+		'M', 'T', 'r', 'k', 0, 0, 0, 0
+	};
+	memcpy(mid, head, sizeof(head));
+	mid_size = sizeof(head);
+	uint32_t rng = 1;
+	for (int i = 0; i < EVENTS; i++){
+		uint32_t dt = dense_dt(&rng);
+		dts_size += put_vlq(&dts[dts_size], dt);
+		mid_size += put_vlq(&mid[mid_size], dt);
+		mid[mid_size++] = (i & 1) ? 0x80 : 0x90;
+		mid[mid_size++] = 36 + (i >> 1) % 48;
+		mid[mid_size++] = 100;
+	}
+	static const uint8_t tail[] = { 0, 0xFF, 0x2F, 0 };
+	memcpy(&mid[mid_size], tail, sizeof(tail));
+	mid_size += sizeof(tail);
+	int trk_size = mid_size - (int)sizeof(head);
+	mid[18] = trk_size >> 24;
+	mid[19] = (trk_size >> 16) & 0xFF;
+	mid[20] = (trk_size >> 8) & 0xFF;
+	mid[21] = trk_size & 0xFF;
+
+	printf("best of %d rounds\n", ROUNDS);
+	if (!bench_dts("dense", dts, dts_size))
+		return 1;
+
+	double best_read = 1e9;
+	int64_t sum_read = 0;
+	for (int r = 0; r < ROUNDS; r++){
+		double t = now();
+		sum_read = 0;
+		bm_readmidi(mid, mid_size, count_event, NULL, &sum_read);
+		t = now() - t;
+		if (t < best_read)
+			best_read = t;
+	}
+	printf("  bm_readmidi  %8.2f ms  %6.2f ns/event (%lld)\n", best_read * 1e3,
+		best_read * 1e9 / EVENTS, (long long)sum_read);
+
+	dts_size = 0;
+	for (int i = 0; i < EVENTS; i++)
+		dts_size += put_vlq(&dts[dts_size], mixed_dt(&rng));
+	if (!bench_dts("mixed", dts, dts_size))
+		return 1;
+
+	free(dts);
+	free(mid);
+	return 0;
+}
@@ -2,48 +2,21 @@
 // MIT License
 // Project Home: https://github.com/voidqk/basicmidi
 
+#define _POSIX_C_SOURCE 200809L
 #include "basicmidi.h"
+#include "basicmidi_decode.h"
+#include <limits.h>
 #include <stdarg.h>
 #include <stdio.h>
-
-// index < 256 for melody, index >= 256 for percussion
-// 0xQQRR   QQ = Program Change code, RR = Bank code
-static uint16_t patch_midi[265] = {
-	0x0000, 0x0001, 0x0002, 0x0100, 0x0101, 0x0200, 0x0201, 0x0300,
-	0x0301, 0x0400, 0x0401, 0x0402, 0x0403, 0x0500, 0x0501, 0x0502,
-	0x0503, 0x0504, 0x0600, 0x0601, 0x0602, 0x0603, 0x0700, 0x0701,
-	0x0800, 0x0900, 0x0A00, 0x0B00, 0x0B01, 0x0C00, 0x0C01, 0x0D00,
-	0x0E00, 0x0E01, 0x0E02, 0x0F00, 0x1000, 0x1001, 0x1002, 0x1003,
-	0x1100, 0x1101, 0x1102, 0x1200, 0x1300, 0x1301, 0x1302, 0x1400,
-	0x1401, 0x1500, 0x1501, 0x1600, 0x1700, 0x1800, 0x1801, 0x1802,
-	0x1803, 0x1900, 0x1901, 0x1902, 0x1903, 0x1A00, 0x1A01, 0x1B00,
-	0x1B01, 0x1B02, 0x1C00, 0x1C01, 0x1C02, 0x1C03, 0x1D00, 0x1D01,
-	0x1E00, 0x1E01, 0x1E02, 0x1F00, 0x1F01, 0x2000, 0x2100, 0x2101,
-	0x2200, 0x2300, 0x2400, 0x2500, 0x2600, 0x2601, 0x2602, 0x2603,
-	0x2604, 0x2700, 0x2701, 0x2702, 0x2703, 0x2800, 0x2801, 0x2900,
-	0x2A00, 0x2B00, 0x2C00, 0x2D00, 0x2E00, 0x2E01, 0x2F00, 0x3000,
-	0x3001, 0x3002, 0x3100, 0x3200, 0x3201, 0x3300, 0x3400, 0x3401,
-	0x3500, 0x3501, 0x3600, 0x3601, 0x3700, 0x3701, 0x3702, 0x3703,
-	0x3800, 0x3801, 0x3900, 0x3901, 0x3902, 0x3A00, 0x3B00, 0x3B01,
-	0x3C00, 0x3C01, 0x3D00, 0x3D01, 0x3E00, 0x3E01, 0x3E02, 0x3E03,
-	0x3F00, 0x3F01, 0x3F02, 0x4000, 0x4100, 0x4200, 0x4300, 0x4400,
-	0x4500, 0x4600, 0x4700, 0x4800, 0x4900, 0x4A00, 0x4B00, 0x4C00,
-	0x4D00, 0x4E00, 0x4F00, 0x5000, 0x5001, 0x5002, 0x5100, 0x5101,
-	0x5102, 0x5103, 0x5104, 0x5200, 0x5300, 0x5400, 0x5401, 0x5500,
-	0x5600, 0x5700, 0x5701, 0x5800, 0x5900, 0x5901, 0x5A00, 0x5B00,
-	0x5B01, 0x5C00, 0x5D00, 0x5E00, 0x5F00, 0x6000, 0x6100, 0x6200,
-	0x6201, 0x6300, 0x6400, 0x6500, 0x6600, 0x6601, 0x6602, 0x6700,
-	0x6000, 0x6001, 0x6100, 0x6200, 0x6300, 0x6301, 0x6400, 0x6500,
-	0x6600, 0x6700, 0x7000, 0x7100, 0x7200, 0x7300, 0x7301, 0x7400,
-	0x7401, 0x7500, 0x7501, 0x7600, 0x7601, 0x7602, 0x7700, 0x7800,
-	0x7801, 0x7802, 0x7900, 0x7901, 0x7A00, 0x7A01, 0x7A02, 0x7A03,
-	0x7A04, 0x7A05, 0x7B00, 0x7B01, 0x7B02, 0x7B03, 0x7C00, 0x7C01,
-	0x7C02, 0x7C03, 0x7C04, 0x7C05, 0x7D00, 0x7D01, 0x7D02, 0x7D03,
-	0x7D04, 0x7D05, 0x7D06, 0x7D07, 0x7D08, 0x7D09, 0x7E00, 0x7E01,
-	0x7E02, 0x7E03, 0x7E04, 0x7E05, 0x7F00, 0x7F01, 0x7F02, 0x7F03,
-	0x0000, 0x0800, 0x1000, 0x1800, 0x1900, 0x2000, 0x2800, 0x3000,
-	0x3800
-};
+#include <string.h>
+#if BM_PLAYBACK
+#	include <errno.h>
+#	include <time.h>
+#	include <unistd.h> // _POSIX_TIMERS
+#endif
+#if defined(__SSE2__)
+#	include <emmintrin.h>
+#endif
 
 const char *bm_patchstr(uint16_t patch){
 	switch (patch){
@@ -394,11 +367,15 @@ void bm_update(bm_state_st *state, bm_ev_st *events, int events_size){
 			case BM_EV_MOD:
 				state->channels[events[i].u.mod.channel].mod = events[i].u.mod.mod;
 				break;
+			case BM_EV_META:
+			case BM_EV_SYSEX:
+				break; // slices don't change the state
 		}
 	}
 }
 
 void bm_deviceinit(bm_device_st *device){
+	device->slices = 0;
 	device->running_status = -1;
 	for (int i = 0; i < 16; i++){
 		device->ctrls[i].bank = i == 9 ? 0x117800 : 0x117900;
@@ -407,379 +384,8 @@ void bm_deviceinit(bm_device_st *device){
 	}
 }
 
-static void warn(bm_warn_f f_warn, void *user, const char *fmt, ...){
-	if (f_warn == NULL)
-		return;
-	va_list args;
-	va_start(args, fmt);
-	char buf[100];
-	vsnprintf(buf, sizeof(buf), fmt, args);
-	va_end(args);
-	f_warn(buf, user);
-}
-
-static inline const char *ss(int num){
-	return num == 1 ? "" : "s";
-}
-
-static int midi_single(const uint8_t *data, int data_size, bm_device_st *device, bm_warn_f f_warn,
-	void *user, bm_ev_st *event_out, bool *end_of_track){
-	// read msg
-	int p = 0;
-	int msg = data[p++];
-	if (msg < 0x80){
-		// use running status
-		if (device->running_status < 0){
-			warn(f_warn, user, "Invalid message %02X", msg);
-			return p; // consume the bad data
-		}
-		else{
-			msg = device->running_status;
-			p--;
-		}
-	}
-
-	// interpret msg
-	if (msg >= 0x80 && msg < 0x90){ // Note-Off
-		if (p + 1 >= data_size){
-			warn(f_warn, user, "Bad Note-Off message (out of data)");
-			return data_size;
-		}
-		device->running_status = msg;
-		int note = data[p++];
-		int vel = data[p++];
-		if (note >= 0x80){
-			warn(f_warn, user, "Bad Note-Off message (invalid note %02X)", note);
-			note ^= 0x80;
-		}
-		if (vel >= 0x80){
-			warn(f_warn, user, "Bad Note-Off message (invalid velocity %02X)", vel);
-			vel ^= 0x80;
-		}
-		*event_out = (bm_ev_st){
-			.type = BM_EV_NOTEOFF,
-			.u.noteoff.channel = msg & 0x0F,
-			.u.noteoff.note = note
-		};
-		return p;
-	}
-	else if (msg >= 0x90 && msg < 0xA0){ // Note On
-		if (p + 1 >= data_size){
-			warn(f_warn, user, "Bad Note-On message (out of data)");
-			return data_size;
-		}
-		device->running_status = msg;
-		int note = data[p++];
-		int vel = data[p++];
-		if (note >= 0x80){
-			warn(f_warn, user, "Bad Note-On message (invalid note %02X)", note);
-			note ^= 0x80;
-		}
-		if (vel >= 0x80){
-			warn(f_warn, user, "Bad Note-On message (invalid velocity %02X)", vel);
-			vel ^= 0x80;
-		}
-		if (vel == 0){
-			*event_out = (bm_ev_st){
-				.type = BM_EV_NOTEOFF,
-				.u.noteoff.channel = msg & 0x0F,
-				.u.noteoff.note = note
-			};
-			return p;
-		}
-		*event_out = (bm_ev_st){
-			.type = BM_EV_NOTEON,
-			.u.noteon.channel = msg & 0x0F,
-			.u.noteon.note = note,
-			.u.noteon.velocity = vel
-		};
-		return p;
-	}
-	else if (msg >= 0xA0 && msg < 0xB0){ // Note Pressure
-		if (p + 1 >= data_size){
-			warn(f_warn, user, "Bad Note Pressure message (out of data)");
-			return data_size;
-		}
-		device->running_status = msg;
-		int note = data[p++];
-		int pressure = data[p++];
-		if (note >= 0x80){
-			warn(f_warn, user, "Bad Note Pressure message (invalid note %02X)", note);
-			note ^= 0x80;
-		}
-		if (pressure >= 0x80){
-			warn(f_warn, user, "Bad Note Pressure message (invalid pressure %02X)", pressure);
-			pressure ^= 0x80;
-		}
-		return p;
-	}
-	else if (msg >= 0xB0 && msg < 0xC0){ // Control Change
-		if (p + 1 >= data_size){
-			warn(f_warn, user, "Bad Control Change message (out of data)");
-			return data_size;
-		}
-		device->running_status = msg;
-		int ctrl = data[p++];
-		int val = data[p++];
-		if (ctrl >= 0x80){
-			warn(f_warn, user, "Bad Control Change message (invalid control %02X)", ctrl);
-			ctrl ^= 0x80;
-		}
-		if (val >= 0x80){
-			warn(f_warn, user, "Bad Control Change message (invalid value %02X)", val);
-			val ^= 0x80;
-		}
-
-		int chan = msg & 0xF;
-		if (ctrl == 0x00) // Bank Select MSB
-			device->ctrls[chan].bank = 0x100000 | (val << 8);
-		else if (ctrl == 0x20) // Bank Select LSB
-			device->ctrls[chan].bank = (device->ctrls[chan].bank & 0xF0FF00) | 0x010000 | val;
-		else if (ctrl == 0x07 || ctrl == 0x27){ // Channel Volume
-			if (ctrl == 0x07) // MSB
-				device->ctrls[chan].vol = val << 7;
-			else // LSB
-				device->ctrls[chan].vol = (device->ctrls[chan].vol & 0x3F80) | val;
-			*event_out = (bm_ev_st){
-				.type = BM_EV_CHANVOL,
-				.u.chanvol.channel = chan,
-				.u.chanvol.vol = device->ctrls[chan].vol
-			};
-		}
-		else if (ctrl == 0x0A || ctrl == 0x2A){ // Channel Pan
-			if (ctrl == 0x0A) // MSB
-				device->ctrls[chan].pan = val << 7;
-			else // LSB
-				device->ctrls[chan].pan = (device->ctrls[chan].pan & 0x3F80) | val;
-			*event_out = (bm_ev_st){
-				.type = BM_EV_CHANPAN,
-				.u.chanpan.channel = chan,
-				.u.chanpan.pan = device->ctrls[chan].pan - 0x2000
-			};
-		}
-		return p;
-	}
-	else if (msg >= 0xC0 && msg < 0xD0){ // Program Change
-		if (p >= data_size){
-			warn(f_warn, user, "Bad Program Change message (out of data)");
-			return data_size;
-		}
-		device->running_status = msg;
-		int patch = data[p++];
-		if (patch >= 0x80){
-			warn(f_warn, user, "Bad Program Change message (invalid patch %02X)", patch);
-			patch ^= 0x80;
-		}
-		int chan = msg & 0xF;
-		int bank = device->ctrls[chan].bank;
-		bool incomplete = (bank & 0x110000) != 0x110000;
-		bank &= 0xFFFF; // remove MSB/LSB flags
-		bool melody = (bank & 0xFF00) == 0x7900;
-		bool percussion = (bank & 0xFF00) == 0x7800;
-
-		if (bank == 0){
-			if (chan == 9){
-				warn(f_warn, user, "%s bank; assuming GM percussion",
-					incomplete ? "Incomplete" : "Empty");
-				percussion = true;
-			}
-			else{
-				warn(f_warn, user, "%s bank; assuming GM melody",
-					incomplete ? "Incomplete" : "Empty");
-				melody = true;
-			}
-			incomplete = false; // already warned, don't warn twice
-		}
-
-		if (melody || percussion){
-			if (incomplete)
-				warn(f_warn, user, "Incomplete bank");
-
-			// calculate patch based on format of patch_midi
-			patch = (patch << 8) | (bank & 0xFF);
-			int start = melody ? 0 : 256;
-			int end = melody ? 256 : 265;
-			for (int i = start; i < end; i++){
-				if (patch_midi[i] == patch){
-					*event_out = (bm_ev_st){
-						.type = BM_EV_PATCH,
-						.u.patch.channel = chan,
-						.u.patch.patch = i
-					};
-					return p;
-				}
-			}
-			patch >>= 8; // restore patch to old value
-
-			// unknown patch
-			if (percussion){
-				if (chan != 9){
-					// unknown percussion patch on melody channel, so use standard kit
-					*event_out = (bm_ev_st){
-						.type = BM_EV_PATCH,
-						.u.patch.channel = chan,
-						.u.patch.patch = BM_PATCH_PERSND_STAN
-					};
-					warn(f_warn, user, "Unknown percussion patch %02X for bank %04X; "
-						"defaulting to standard kit", patch, bank);
-				}
-				else{
-					// unknown percussion patch on percussion channel, so ignore
-					warn(f_warn, user, "Unknown percussion patch %02X for bank %04X; ignoring",
-						patch, bank);
-				}
-			}
-			else{
-				if (chan == 9){
-					// unknown melody patch on percussion channel, so use piano
-					*event_out = (bm_ev_st){
-						.type = BM_EV_PATCH,
-						.u.patch.channel = chan,
-						.u.patch.patch = BM_PATCH_PIANO_ACGR
-					};
-					warn(f_warn, user, "Unknown melody patch %02X for bank %04X; "
-						"defaulting to acoustic piano", patch, bank);
-				}
-				else{
-					// unknown melody patch on melody channel, so ignore
-					warn(f_warn, user, "Unknown melody patch %02X for bank %04X; ignoring",
-						patch, bank);
-				}
-			}
-		}
-		else{
-			warn(f_warn, user, "Unknown %sbank %04X for patch %02X",
-				incomplete ? "incomplete " : "", bank, patch);
-		}
-		return p;
-	}
-	else if (msg >= 0xD0 && msg < 0xE0){ // Channel Pressure
-		if (p >= data_size){
-			warn(f_warn, user, "Bad Channel Pressure message (out of data)");
-			return data_size;
-		}
-		device->running_status = msg;
-		int pressure = data[p++];
-		if (pressure >= 0x80)
-			warn(f_warn, user, "Bad Channel Pressure message (invalid pressure %02X)", pressure);
-		return p;
-	}
-	else if (msg >= 0xE0 && msg < 0xF0){ // Pitch Bend
-		if (p + 1 >= data_size){
-			warn(f_warn, user, "Bad Pitch Bend message (out of data)");
-			return data_size;
-		}
-		device->running_status = msg;
-		int p1 = data[p++];
-		int p2 = data[p++];
-		if (p1 >= 0x80){
-			warn(f_warn, user, "Bad Pitch Bend message (invalid lower bits %02X)", p1);
-			p1 ^= 0x80;
-		}
-		if (p2 >= 0x80){
-			warn(f_warn, user, "Bad Pitch Bend message (invalid higher bits %02X)", p2);
-			p2 ^= 0x80;
-		}
-		int chan = msg & 0xF;
-		int bend = p1 | (p2 << 7);
-		*event_out = (bm_ev_st){
-			.type = BM_EV_BEND,
-			.u.bend.channel = chan,
-			.u.bend.bend = bend - 0x1000
-		};
-		return p;
-	}
-	else if (msg == 0xF0 || msg == 0xF7){ // SysEx Event
-		device->running_status = -1; // TODO: validate we should clear this
-		// read length as a variable int
-		int dl = 0;
-		int len = 0;
-		while (true){
-			if (p >= data_size){
-				warn(f_warn, user, "Bad SysEx Event (out of data)");
-				return data_size;
-			}
-			len++;
-			if (len >= 5){
-				warn(f_warn, user, "Bad SysEx Event (invalid data length)");
-				return 1; // consume the message
-			}
-			int t = data[p++];
-			dl = (dl << 7) | (t & 0x7F);
-			if ((t & 0x80) == 0)
-				break;
-		}
-		if (p + dl > data_size){
-			warn(f_warn, user, "Bad SysEx Event (data length too large)");
-			return data_size;
-		}
-		if (dl == 7 &&
-			data[p + 0] == 0x7F &&
-			data[p + 2] == 0x04 &&
-			data[p + 7] == 0xF7){ // SysEx Real Time Device Control
-			if (data[p + 3] == 0x01){ // Master Volume
-				int v = (((int)(data[p + 5] & 0x7F)) << 7) | (data[p + 4] & 0x7F);
-				*event_out = (bm_ev_st){
-					.type = BM_EV_MASTVOL,
-					.u.mastvol = v
-				};
-			}
-			else if (data[p + 3] == 0x02){ // Master Balance
-				int v = (((int)(data[p + 5] & 0x7F)) << 7) | (data[p + 4] & 0x7F);
-				*event_out = (bm_ev_st){
-					.type = BM_EV_MASTPAN,
-					.u.mastpan = v - 0x1000
-				};
-			}
-		}
-		return p + dl;
-	}
-	else if (msg == 0xFF){ // Meta Event
-		device->running_status = -1; // TODO: validate we should clear this
-		if (p + 1 >= data_size){
-			warn(f_warn, user, "Bad Meta Event (out of data)");
-			return data_size;
-		}
-		int type = data[p++];
-		int len = data[p++];
-		if (p + len > data_size){
-			warn(f_warn, user, "Bad Meta Event (data length too large)");
-			return data_size;
-		}
-		if (type == 0x2F){ // 00  End of Track
-			if (len != 0)
-				warn(f_warn, user, "Expecting zero-length data for End of Track message");
-			if (p < data_size){
-				uint64_t pd = data_size - p;
-				warn(f_warn, user, "Extra data at end of track: %llu byte%s", pd, ss(pd));
-			}
-			if (end_of_track)
-				*end_of_track = true;
-			return data_size;
-		}
-		else if (type == 0x51){ // 03 TT TT TT  Set Tempo
-			if (len < 3)
-				warn(f_warn, user, "Missing data for Set Tempo event");
-			else{
-				if (len > 3)
-					warn(f_warn, user, "Extra %d byte%s for Set Tempo event", len - 3, ss(len - 3));
-				int tempo = ((int)data[p + 0] << 16) | ((int)data[p + 1] << 8) | data[p + 2];
-				if (tempo == 0)
-					warn(f_warn, user, "Invalid tempo (0)");
-				else{
-					*event_out = (bm_ev_st){
-						.type = BM_EV_TEMPO,
-						.u.tempo = tempo
-					};
-				}
-			}
-		}
-		return p + len;
-	}
-
-	device->running_status = -1;
-	warn(f_warn, user, "Unknown message type %02X", msg);
-	return 1; // consume the message
+void bm_stats_init(bm_stats_st *stats){
+	memset(stats, 0, sizeof(bm_stats_st));
 }
 
 int bm_devicebytes(bm_device_st *device, const uint8_t *data, int size, bm_ev_st *events_out,
@@ -789,21 +395,16 @@ int bm_devicebytes(bm_device_st *device, const uint8_t *data, int size, bm_ev_st
 	bm_ev_st ev;
 	while (e < max_events_size && p < size){
 		ev.type = 99; // set event type to something invalid to detect if one is written
-		p += midi_single(data, size, device, f_warn, user, &ev, NULL);
-		if ((int)ev.type != 99)
+		int at = p;
+		p += midi_single(&data[p], size - p, device, f_warn, user, NULL, &ev, NULL);
+		if ((int)ev.type != 99){
+			slice_at(&ev, at);
 			events_out[e++] = ev;
+		}
 	}
 	return e;
 }
 
-typedef struct {
-	bm_device_st device;
-	int type;
-	int start;
-	int end;
-	int dt;
-} chunk_st;
-
 static inline int chunk_type(uint8_t b1, uint8_t b2, uint8_t b3, uint8_t b4){
 	if (b1 == 'M' && b2 == 'T'){
 		if (b3 == 'h' && b4 == 'd')
@@ -814,6 +415,37 @@ static inline int chunk_type(uint8_t b1, uint8_t b2, uint8_t b3, uint8_t b4){
 	return -1; // invalid
 }
 
+// returns the position of the first "MT" in data[p..end), where data[end] must be readable, or -1
+static int find_mt(const uint8_t *data, int p, int end){
+#if defined(__SSE2__)
+	// compare 16 positions at a time against 'M', and the positions one byte later against 'T'
+	const __m128i m = _mm_set1_epi8('M');
+	const __m128i t = _mm_set1_epi8('T');
+	while (p + 16 <= end){
+		__m128i b0 = _mm_loadu_si128((const __m128i *)&data[p]);
+		__m128i b1 = _mm_loadu_si128((const __m128i *)&data[p + 1]);
+		int mask = _mm_movemask_epi8(_mm_and_si128(_mm_cmpeq_epi8(b0, m), _mm_cmpeq_epi8(b1, t)));
+		if (mask)
+			return p + __builtin_ctz(mask);
+		p += 16;
+	}
+#endif
+	while (p < end){
+		const uint8_t *q = memchr(&data[p], 'M', end - p);
+		if (q == NULL)
+			return -1;
+		p = q - data;
+		if (data[p + 1] == 'T')
+			return p;
+		p++;
+	}
+	return -1;
+}
+
+static inline int chunk_length(const uint8_t *data, int p){
+	return ((int)data[p + 5] << 16) | ((int)data[p + 6] << 8) | data[p + 7];
+}
+
 static bool read_chunk(int p, int size, const uint8_t *data, chunk_st *chk, int *alignment){
 	if (p + 8 > size)
 		return false;
@@ -821,259 +453,3997 @@ static bool read_chunk(int p, int size, const uint8_t *data, chunk_st *chk, int
 	*alignment = 0;
 	if (type < 0){
 		int p_orig = p;
-		// rewind 7 bytes and search forward until end of data
+		// rewind 7 bytes and search forward until end of data, for a chunk header whose length is
+		// believable; junk can easily contain "MThd" or "MTrk", but it's unlikely to be followed by
+		// a length that fits in the file
+		// if the only candidates run past the end of the file, use the first one, since the file
+		// might just be truncated
+		int truncated_p = -1;
+		int truncated_type = -1;
 		p = p < 7 ? 0 : p - 7;
-		while (p + 4 <= size){
-			type = chunk_type(data[p + 0], data[p + 1], data[p + 2], data[p + 3]);
-			if (type >= 0)
+		while (true){
+			p = find_mt(data, p, size - 7); // only look where a full chunk header fits
+			if (p < 0)
 				break;
+			type = chunk_type(data[p + 0], data[p + 1], data[p + 2], data[p + 3]);
+			if (type >= 0 && data[p + 4] == 0){
+				int len = chunk_length(data, p);
+				if (type == 0 && len < 6)
+					; // header chunks need at least format, tracks, and division
+				else if (p + 8 + len <= size)
+					break;
+				else if (truncated_p < 0){
+					truncated_p = p;
+					truncated_type = type;
+				}
+			}
+			type = -1;
 			p++;
 		}
+		if (type < 0 && truncated_p >= 0){
+			p = truncated_p;
+			type = truncated_type;
+		}
 		if (type >= 0)
 			*alignment = p - p_orig;
 	}
 	if (type < 0 || p + 8 > size)
 		return false;
-	if (data[p + 4] > 0) // if size is claiming something more than 16 megs, just bail
-		return false;
+	int len = chunk_length(data, p);
+	if (data[p + 4] > 0){
+		// a length over 16 megs is only believable if the whole chunk is there, since writers
+		// rarely produce chunks that big, but damaged data often looks like they did
+		uint32_t full = ((uint32_t)data[p + 4] << 24) | (uint32_t)len;
+		if (full > (uint32_t)(size - p - 8))
+			return false;
+		len = (int)full;
+	}
 	chk->type = type;
 	chk->start = p + 8;
-	chk->end = chk->start + (
-		((int)data[p + 5] << 16) |
-		((int)data[p + 6] <<  8) |
-		((int)data[p + 7])
-	);
+	chk->end = chk->start + len;
+	chk->limit = chk->end;
 	return true;
 }
 
-static inline bool read_dt(chunk_st *chunk, const uint8_t *data, int track_i, bm_warn_f f_warn,
+static void reader_scan(bm_reader_st *rd, int pos, int size);
+
+static void reader_init(bm_reader_st *rd, const uint8_t *data, int size, bm_warn_f f_warn,
+	void *user, bm_stats_st *stats){
+	bool count_cycles = STATS(stats) && stats->count_cycles;
+	uint64_t c0 = count_cycles ? stats_cycles() : 0;
+
+	rd->slices = 0;
+	rd->data = data;
+	rd->f_warn = f_warn;
+	rd->user = user;
+	rd->stats = stats;
+	rd->chunks_size = 0;
+	rd->ch = 0;
+	rd->track_base = 0;
+	rd->track_count = 0;
+	rd->tracks_left = 0;
+	rd->pending_dt = 0;
+	rd->hd_format = -1;
+	rd->hd_tracks = -1;
+	rd->divisor = 1;
+	rd->dt_track = -1;
+	rd->patterns_left = 0;
+	rd->pattern_pending = false;
+	rd->pattern = -1;
+	rd->single = false;
+	rd->found_header = false;
+	rd->follow = false;
+	rd->complete = true;
+	rd->size = size;
+	rd->scan = -1;
+
+	if (size < 14 ||
+		data[0] != 'M' || data[1] != 'T' || data[2] != 'h' || data[3] != 'd' ||
+		data[4] !=  0  || data[5] !=  0  || data[6] !=  0  || data[7] < 6){
+		warn(f_warn, user, stats, BM_WARN_HEADER, "Invalid header");
+		return;
+	}
+
+	reader_scan(rd, 0, size);
+	if (count_cycles)
+		stats->cycles[BM_PHASE_SCAN] += stats_cycles() - c0;
+}
+
+// reads in the locations of all the chunks in data[pos..size)
+static void reader_scan(bm_reader_st *rd, int pos, int size){
+	const uint8_t *data = rd->data;
+	bm_warn_f f_warn = rd->f_warn;
+	void *user = rd->user;
+	bm_stats_st *stats = STATS(rd->stats);
+	chunk_st *chunks = rd->chunks;
+	int chunks_size = rd->chunks_size;
+	chunk_st chk;
+	while (pos < size && chunks_size < 300){
+		int alignment = 0;
+		if (!read_chunk(pos, size, data, &chk, &alignment)){
+			int dif = size - pos;
+			if (dif > 0){
+				warn(f_warn, user, stats, BM_WARN_CHUNK,
+					"Unrecognized data (%d byte%s) at end of file",
+					dif, ss(dif));
+			}
+			break;
+		}
+		if (alignment != 0 && STATS(stats)){
+			stats->resyncs++;
+			stats->resync_bytes += alignment > 0 ? alignment : -alignment;
+		}
+		if (alignment != 0)
+			warn(f_warn, user, stats, BM_WARN_CHUNK, "Chunk misaligned by %d byte%s",
+				alignment, ss(alignment));
+		int chk_size = chk.end - chk.start;
+		if (chk.type == 0 && chk_size != 6){
+			warn(f_warn, user, stats, BM_WARN_CHUNK,
+				"Header chunk has non-standard size %d byte%s (expecting 6 bytes)",
+				chk_size, ss(chk_size));
+		}
+		if (chk.end > size){
+			int offset = chk.end - size;
+			chk.end = size;
+			warn(f_warn, user, stats, BM_WARN_CHUNK, "Chunk ends %d byte%s too early",
+				offset, ss(offset));
+		}
+		pos = chk.end;
+		if (chk.type == 1 && STATS(stats)){
+			if (stats->tracks < 300)
+				stats->track_bytes[stats->tracks] = chk.end - chk.start;
+			stats->tracks++;
+		}
+		chunks[chunks_size++] = chk;
+	}
+	rd->chunks_size = chunks_size;
+}
+
+void bm_reader_init(bm_reader_st *reader, const uint8_t *data, int size, bm_warn_f f_warn,
 	void *user){
-	if (chunk->start >= chunk->end)
-		return false;
-	// read delta as variable int
-	int dt = 0;
-	int len = 0;
-	while (true){
-		len++;
-		if (len >= 5){
-			warn(f_warn, user, "Invalid timestamp in track %d", track_i);
-			return false;
+	reader_init(reader, data, size, f_warn, user, NULL);
+}
+
+void bm_reader_init_stats(bm_reader_st *reader, const uint8_t *data, int size, bm_warn_f f_warn,
+	void *user, bm_stats_st *stats){
+	reader_init(reader, data, size, f_warn, user, STATS(stats));
+}
+
+// decodes the header at the current chunk, returning the RESET event that starts its tracks
+static bm_delta_ev_st reader_header(bm_reader_st *rd){
+	bm_warn_f f_warn = rd->f_warn;
+	void *user = rd->user;
+	bm_stats_st *stats = STATS(rd->stats);
+	const uint8_t *data = rd->data;
+	chunk_st chk = rd->chunks[rd->ch++];
+	int chk_size = chk.end - chk.start;
+	if (rd->found_header)
+		warn(f_warn, user, stats, BM_WARN_HEADER, "Multiple header chunks present");
+	rd->found_header = true;
+	if (chk_size >= 2){
+		rd->hd_format = ((int)data[chk.start + 0] << 8) | data[chk.start + 1];
+		if (rd->hd_format != 0 && rd->hd_format != 1 && rd->hd_format != 2){
+			warn(f_warn, user, stats, BM_WARN_HEADER, "Header reports bad format (%d)",
+				rd->hd_format);
+			rd->hd_format = 1;
 		}
-		int t = data[chunk->start++];
-		if (t & 0x80){
-			if (chunk->start >= chunk->end){
-				warn(f_warn, user, "Invalid timestamp in track %d", track_i);
-				return false;
-			}
-			dt = (dt << 7) | (t & 0x7F);
+	}
+	else{
+		warn(f_warn, user, stats, BM_WARN_HEADER, "Header missing format");
+		rd->hd_format = 1;
+	}
+	if (chk_size >= 4){
+		rd->hd_tracks = ((int)data[chk.start + 2] << 8) | data[chk.start + 3];
+		if (rd->hd_format == 0 && rd->hd_tracks != 1){
+			warn(f_warn, user, stats, BM_WARN_HEADER,
+				"Format 0 expecting 1 track chunk, header is reporting %d chunks",
+				rd->hd_tracks);
 		}
-		else{
-			dt = (dt << 7) | t;
-			break;
+	}
+	else{
+		warn(f_warn, user, stats, BM_WARN_HEADER, "Header missing track chunk count");
+		rd->hd_tracks = -1;
+	}
+	int division = 1;
+	if (chk_size >= 6){
+		division = ((int)data[chk.start + 4] << 8) | data[chk.start + 5];
+		if (division & 0x8000){
+			warn(f_warn, user, stats, BM_WARN_HEADER, "Unsupported timing format (SMPTE)");
+			division = 1;
 		}
 	}
-	chunk->dt = dt;
-	return true;
+	else
+		warn(f_warn, user, stats, BM_WARN_HEADER, "Header missing division");
+	rd->divisor = division;
+	return (bm_delta_ev_st){
+		.delta = 0,
+		.ev = (bm_ev_st){
+			.type = BM_EV_RESET,
+			.u.reset = division
+		}
+	};
 }
 
-void bm_readmidi(const uint8_t *data, int size, bm_event_f f_event, bm_warn_f f_warn, void *user){
-	if (size < 14 ||
-		data[0] != 'M' || data[1] != 'T' || data[2] != 'h' || data[3] != 'd' ||
-		data[4] !=  0  || data[5] !=  0  || data[6] !=  0  || data[7] < 6){
-		warn(f_warn, user, "Invalid header");
-		return;
+// reads the first dt of every track being merged
+static void reader_open(bm_reader_st *rd){
+	bm_stats_st *stats = STATS(rd->stats);
+	chunk_st *chunks = &rd->chunks[rd->track_base];
+	int tracks_left = rd->track_count;
+	for (int i = 0; i < rd->track_count; i++){
+		if (rd->follow)
+			chunks[i].dt = -1; // read once it arrives
+		else if (!read_dt(&chunks[i], rd->data, i, rd->f_warn, rd->user, stats)){
+			// failed to read dt, so disable track
+			chunks[i].type = -1;
+			tracks_left--;
+		}
 	}
+	rd->tracks_left = tracks_left;
+	if (STATS(stats) && tracks_left > stats->max_open_tracks)
+		stats->max_open_tracks = tracks_left;
+}
 
-	// read in all the chunk locations
-	chunk_st chunks[300]; // max number of chunks seen in the wild is 254
-	int chunks_size = 0;
-	{
-		int pos = 0;
-		chunk_st chk;
-		while (pos < size && chunks_size < 300){
-			int alignment = 0;
-			if (!read_chunk(pos, size, data, &chk, &alignment)){
-				int dif = size - pos;
-				if (dif > 0){
-					warn(f_warn, user, "Unrecognized data (%d byte%s) at end of file",
-						dif, ss(dif));
-				}
-				break;
-			}
-			if (alignment != 0)
-				warn(f_warn, user, "Chunk misaligned by %d byte%s", alignment, ss(alignment));
-			int chk_size = chk.end - chk.start;
-			if (chk.type == 0 && chk_size != 6){
-				warn(f_warn, user,
-					"Header chunk has non-standard size %d byte%s (expecting 6 bytes)",
-					chk_size, ss(chk_size));
-			}
-			if (chk.end > size){
-				int offset = chk.end - size;
-				chk.end = size;
-				warn(f_warn, user, "Chunk ends %d byte%s too early", offset, ss(offset));
+// finds the MTrk that follow the header and prepares them for merging
+static void reader_tracks(bm_reader_st *rd){
+	int hd_format = rd->hd_format;
+	int hd_tracks = rd->hd_tracks;
+	rd->hd_format = -1;
+	bm_warn_f f_warn = rd->f_warn;
+	void *user = rd->user;
+	bm_stats_st *stats = STATS(rd->stats);
+	chunk_st *chunks = &rd->chunks[rd->ch];
+	int track_count = 0;
+	while (rd->ch + track_count < rd->chunks_size && chunks[track_count].type == 1){
+		bm_deviceinit(&chunks[track_count].device);
+		chunks[track_count].device.slices = rd->slices;
+		track_count++;
+	}
+	if (hd_tracks >= 0 && track_count != hd_tracks){
+		warn(f_warn, user, stats, BM_WARN_HEADER,
+			"Mismatch between reported track count (%d) and actual track "
+			"count (%d)", hd_tracks, track_count);
+	}
+	if (hd_format == 0 && track_count > 1)
+		warn(f_warn, user, stats, BM_WARN_HEADER,
+			"Format 0 expecting 1 track chunk, found more than one");
+	rd->track_base = rd->ch;
+	rd->track_count = track_count;
+	rd->tracks_left = 0;
+	rd->pending_dt = 0;
+	rd->patterns_left = 0;
+	rd->ch += track_count;
+	if (hd_format == 2){
+		// every track is a separate pattern, so they're played one at a time
+		if (rd->pattern >= 0){
+			if (rd->pattern >= track_count){
+				rd->track_count = 0;
+				return;
 			}
-			pos = chk.end;
-			chunks[chunks_size++] = chk;
+			rd->track_base += rd->pattern;
 		}
+		else if (track_count > 1)
+			rd->patterns_left = track_count - 1;
+		rd->track_count = track_count > 0 ? 1 : 0;
 	}
+	reader_open(rd);
+}
 
-	// the first chunk *must* be a MThd, since we validated that at the start
-	int ch = 0;
-	bool found_header = false;
-	while (ch < chunks_size){
-		// decode the header
-		int hd_format = 1;
-		int hd_tracks = -1;
-		{
-			chunk_st chk = chunks[ch++];
-			int chk_size = chk.end - chk.start;
-			if (found_header)
-				warn(f_warn, user, "Multiple header chunks present");
-			found_header = true;
-			if (chk_size >= 2){
-				hd_format = ((int)data[chk.start + 0] << 8) | data[chk.start + 1];
-				if (hd_format != 0 && hd_format != 1 && hd_format != 2){
-					warn(f_warn, user, "Header reports bad format (%d)", hd_format);
-					hd_format = 1;
-				}
-			}
-			else{
-				warn(f_warn, user, "Header missing format");
-				hd_format = 1;
-			}
-			if (chk_size >= 4){
-				hd_tracks = ((int)data[chk.start + 2] << 8) | data[chk.start + 3];
-				if (hd_format == 0 && hd_tracks != 1){
-					warn(f_warn, user,
-						"Format 0 expecting 1 track chunk, header is reporting %d chunks",
-						hd_tracks);
-				}
-			}
-			else{
-				warn(f_warn, user, "Header missing track chunk count");
-				hd_tracks = -1;
-			}
-			int division = 1;
-			if (chk_size >= 6){
-				division = ((int)data[chk.start + 4] << 8) | data[chk.start + 5];
-				if (division & 0x8000){
-					warn(f_warn, user, "Unsupported timing format (SMPTE)");
-					division = 1;
-				}
-			}
-			else
-				warn(f_warn, user, "Header missing division");
-			f_event((bm_delta_ev_st){
-				.delta = 0,
-				.ev = (bm_ev_st){
-					.type = BM_EV_RESET,
-					.u.reset = division
-				}
-			}, user);
+// a followed chunk that's still being written, whose end is where the data runs out for now
+static inline bool follow_growing(const bm_reader_st *rd, const chunk_st *chk){
+	return !rd->complete && chk->end < chk->limit;
+}
+
+// the size of the message at data[p], or -1 if it continues past end; malformed messages count as
+// complete, so midi_single can warn about them
+static int message_size(const uint8_t *data, int p, int end, int running_status){
+	if (p >= end)
+		return -1;
+	int msg = data[p];
+	int n = 1;
+	if (msg < 0x80){
+		if (running_status < 0)
+			return 1;
+		msg = running_status;
+		n = 0;
+	}
+	if (msg < 0xC0 || (msg >= 0xE0 && msg < 0xF0))
+		n += 2;
+	else if (msg < 0xE0)
+		n += 1;
+	else if (msg == 0xF0 || msg == 0xF7 || msg == 0xFF){
+		if (msg == 0xFF)
+			n++; // meta event type
+		int dl = 0;
+		for (int i = 0; ; i++){
+			if (i >= 4)
+				return n; // invalid length
+			if (p + n >= end)
+				return -1;
+			int b = data[p + n++];
+			dl = (dl << 7) | (b & 0x7F);
+			if (b < 0x80)
+				break;
 		}
+		n += dl;
+	}
+	return n <= end - p ? n : -1;
+}
 
-		// search for the MTrk that follow the MThd and initialize their devices
-		int track_count = 0;
-		{
-			while (ch + track_count < chunks_size && chunks[ch + track_count].type == 1){
-				bm_deviceinit(&chunks[ch + track_count].device);
-				track_count++;
-			}
-			if (hd_tracks >= 0 && track_count != hd_tracks){
-				warn(f_warn, user, "Mismatch between reported track count (%d) and actual track "
-					"count (%d)", hd_tracks, track_count);
+// the size of the timestamp at data[p], or -1 if it continues past end; invalid timestamps count
+// as 4 bytes, so read_dt can warn about them
+static inline int dt_size(const uint8_t *data, int p, int end){
+	for (int i = 0; i < 4; i++){
+		if (p + i >= end)
+			return -1;
+		if (data[p + i] < 0x80)
+			return i + 1;
+	}
+	return 4;
+}
+
+// reads the dt of every track that needs one; returns false if one hasn't arrived yet
+static bool follow_dts(bm_reader_st *rd, chunk_st *chunks, int track_count){
+	for (int i = 0; i < track_count; i++){
+		if (chunks[i].type < 0 || chunks[i].dt >= 0)
+			continue;
+		if (follow_growing(rd, &chunks[i]) && dt_size(rd->data, chunks[i].start, chunks[i].end) < 0)
+			return false;
+		if (!read_dt(&chunks[i], rd->data, i, rd->f_warn, rd->user, STATS(rd->stats))){
+			// failed to read dt, so disable track
+			chunks[i].type = -1;
+			rd->tracks_left--;
+		}
+	}
+	return true;
+}
+
+// whether the tracks of the header just read have all begun, or no more can follow it
+static bool follow_tracks_ready(const bm_reader_st *rd){
+	if (rd->complete)
+		return true;
+	int want = rd->hd_tracks > 0 ? rd->hd_tracks : 1;
+	int n = 0;
+	while (rd->ch + n < rd->chunks_size && rd->chunks[rd->ch + n].type == 1)
+		n++;
+	return n >= want || rd->ch + n < rd->chunks_size || rd->scan < 0 || rd->chunks_size >= 300;
+}
+
+// walks the messages of a track of unknown length that have arrived, without decoding them, so
+// the chunks after it can be found before it's decoded
+static void follow_walk(bm_reader_st *rd){
+	const uint8_t *data = rd->data;
+	chunk_st *chk = &rd->chunks[rd->chunks_size - 1];
+	int p = rd->walk;
+	while (true){
+		int dt = dt_size(data, p, rd->size);
+		if (dt < 0 || (dt == 4 && data[p + 3] >= 0x80))
+			break; // waiting, or read_dt will end the track
+		int n = message_size(data, p + dt, rd->size, rd->walk_status);
+		if (n < 0)
+			break;
+		int msg = data[p + dt];
+		if (msg >= 0xF0)
+			rd->walk_status = -1;
+		else if (msg >= 0x80)
+			rd->walk_status = msg;
+		p += dt + n;
+		if (msg == 0xFF && data[p - n + 1] == 0x2F){
+			// End of Track
+			chk->limit = chk->end = p;
+			rd->scan = p;
+			break;
+		}
+	}
+	rd->walk = p;
+}
+
+// finds the chunks that have arrived since the last scan; chunks must be aligned, and each one is
+// only scanned once the one before it has ended, but once the data is complete, damaged data is
+// searched for misaligned chunks like in any other file
+static void follow_scan(bm_reader_st *rd){
+	bm_warn_f f_warn = rd->f_warn;
+	void *user = rd->user;
+	bm_stats_st *stats = STATS(rd->stats);
+	const uint8_t *data = rd->data;
+	int size = rd->size;
+	if (rd->scan == 0 && rd->chunks_size == 0){
+		if (size < 14 && !rd->complete)
+			return;
+		if (size < 14 ||
+			data[0] != 'M' || data[1] != 'T' || data[2] != 'h' || data[3] != 'd' ||
+			data[4] !=  0  || data[5] !=  0  || data[6] !=  0  || data[7] < 6){
+			warn(f_warn, user, stats, BM_WARN_HEADER, "Invalid header");
+			rd->scan = -1;
+			return;
+		}
+	}
+	if (rd->scan == INT_MAX)
+		follow_walk(rd);
+	while (rd->scan >= 0 && rd->scan < size && rd->chunks_size < 300){
+		int p = rd->scan;
+		if (p > size - 8){
+			if (rd->complete){
+				warn(f_warn, user, stats, BM_WARN_CHUNK,
+					"Unrecognized data (%d byte%s) at end of file", size - p, ss(size - p));
 			}
-			if (hd_format == 0 && track_count > 1)
-				warn(f_warn, user, "Format 0 expecting 1 track chunk, found more than one");
-			if (hd_format == 2){
-				warn(f_warn, user, "MIDI Format 2 not supported by basicmidi; "
-					"accounts for less than 1%% of MIDI files");
-				ch += track_count;
-				continue;
+			return;
+		}
+		int type = chunk_type(data[p + 0], data[p + 1], data[p + 2], data[p + 3]);
+		int len = chunk_length(data, p);
+		if (type < 0 || (type == 0 && (data[p + 4] > 0 || len < 6 || p + 8 + len > size))){
+			// damaged, or a header that hasn't all arrived
+			if (rd->complete){
+				reader_scan(rd, p, size);
+				rd->scan = -1;
 			}
+			return;
+		}
+		chunk_st chk = { .type = type, .start = p + 8, .limit = p + 8 + len };
+		if (type == 1 && (data[p + 4] > 0 || len == 0)){
+			// a placeholder until the track is done
+			chk.limit = INT_MAX;
+			rd->walk = chk.start;
+			rd->walk_status = -1;
+		}
+		else if (type == 0 && len != 6){
+			warn(f_warn, user, stats, BM_WARN_CHUNK,
+				"Header chunk has non-standard size %d byte%s (expecting 6 bytes)", len, ss(len));
 		}
+		chk.end = chk.limit < size ? chk.limit : size;
+		if (rd->complete && chk.limit != INT_MAX && chk.limit > size){
+			int offset = chk.limit - size;
+			warn(f_warn, user, stats, BM_WARN_CHUNK, "Chunk ends %d byte%s too early",
+				offset, ss(offset));
+		}
+		rd->chunks[rd->chunks_size++] = chk;
+		rd->scan = chk.limit;
+		if (chk.limit == INT_MAX)
+			follow_walk(rd);
+	}
+}
 
-		// read every track's dt
-		int tracks_left = track_count;
+// decodes the next event from the open tracks of a reader following a file, like reader_merge,
+// except that tracks can still be growing; returns 1 for an event, 0 if it's waiting for more data,
+// or -1 once the tracks have all finished
+static int follow_merge(bm_reader_st *rd, bm_delta_ev_st *event_out){
+	bm_warn_f f_warn = rd->f_warn;
+	void *user = rd->user;
+	bm_stats_st *stats = STATS(rd->stats);
+	bool count_cycles = STATS(stats) && stats->count_cycles;
+	uint64_t c0 = 0;
+	chunk_st *chunks = &rd->chunks[rd->track_base];
+	int track_count = rd->track_count;
+	if (rd->dt_track >= 0){
+		// the previous call returned this track's event, so its dt is read once it arrives
+		chunks[rd->dt_track].dt = -1;
+		rd->dt_track = -1;
+	}
+	while (rd->tracks_left > 0){
+		// every track needs its next dt before the earliest event is known
+		if (!follow_dts(rd, chunks, track_count))
+			return 0;
+		if (rd->tracks_left <= 0)
+			break;
+		if (count_cycles)
+			c0 = stats_cycles();
+		// search for the lowest dt
+		int best_i = 0;
+		int best_dt = -1;
 		for (int i = 0; i < track_count; i++){
-			if (!read_dt(&chunks[ch + i], data, i, f_warn, user)){
-				// failed to read dt, so disable track
-				chunks[ch + i].type = -1;
-				tracks_left--;
+			if (chunks[i].type < 0) // skip chunks that have finished
+				continue;
+			if (best_dt < 0 || chunks[i].dt < best_dt){
+				best_dt = chunks[i].dt;
+				best_i = i;
 			}
 		}
 
-		// loop around, grabbing the next event from all of the open tracks
-		while (tracks_left > 0){
-			// search for the lowest dt
-			int best_i = 0;
-			int best_dt = -1;
+		// a track that's still being written might not have the whole message yet
+		bool growing = follow_growing(rd, &chunks[best_i]);
+		int msg_size = 0;
+		if (growing){
+			msg_size = message_size(rd->data, chunks[best_i].start, chunks[best_i].end,
+				chunks[best_i].device.running_status);
+			if (msg_size < 0)
+				return 0;
+		}
+
+		// subtract the best_dt from every track
+		if (best_dt > 0){
 			for (int i = 0; i < track_count; i++){
-				if (chunks[ch + i].type < 0) // skip chunks that have finished
+				if (chunks[i].type < 0) // skip chunks that have finished
 					continue;
-				if (best_dt < 0 || chunks[ch + i].dt < best_dt){
-					best_dt = chunks[ch + i].dt;
-					best_i = i;
-				}
+				chunks[i].dt -= best_dt;
 			}
+		}
 
-			// subtract the best_dt from every track
-			if (best_dt > 0){
-				for (int i = 0; i < track_count; i++){
-					if (chunks[ch + i].type < 0) // skip chunks that have finished
-						continue;
-					chunks[ch + i].dt -= best_dt;
-				}
-			}
+		if (count_cycles)
+			stats->cycles[BM_PHASE_MERGE] += stats_cycles() - c0;
 
-			// read the event from the track
-			int chk_size = chunks[ch + best_i].end - chunks[ch + best_i].start;
-			if (chk_size <= 0){
-				// track is empty, so disable it
-				warn(f_warn, user, "Missing message from track %d", best_i);
-				chunks[ch + best_i].type = -1;
-				tracks_left--;
-			}
-			else{
-				// create an event with an invalid type, in order to detect if midi_single writes
-				// out an event
-				bm_delta_ev_st dev = { .delta = best_dt, .ev = { .type = 99 } };
-				bool end_of_track = false;
-				int byte_size = midi_single(
-					&data[chunks[ch + best_i].start],
-					chk_size,
-					&chunks[ch + best_i].device,
-					f_warn, user, &dev.ev,
-					&end_of_track
-				);
-				if ((int)dev.ev.type != 99)
-					f_event(dev, user);
-
-				// advance this track
-				chunks[ch + best_i].start += byte_size;
-				chk_size -= byte_size;
-				if (end_of_track || chk_size <= 0){
-					// track finished, so disable it
-					chunks[ch + best_i].type = -1;
-					tracks_left--;
-				}
-				else{
-					// track hasn't finished, so read in the next dt for it
-					if (!read_dt(&chunks[ch + best_i], data, best_i, f_warn, user)){
-						// failed to read dt, so disable track
-						chunks[ch + best_i].type = -1;
-						tracks_left--;
-					}
-				}
-			}
+		// read the event from the track
+		chunk_st *best = &chunks[best_i];
+		int chk_size = best->end - best->start;
+		rd->pending_dt += best_dt; // kept even if the track turns out to be empty
+		if (chk_size <= 0){
+			// track is empty, so disable it
+			warn(f_warn, user, stats, BM_WARN_TRACK, "Missing message from track %d", best_i);
+			best->type = -1;
+			rd->tracks_left--;
+			continue;
+		}
+
+		bm_delta_ev_st dev = { .delta = rd->pending_dt, .ev = { .type = 99 } };
+		bool end_of_track = false;
+		int byte_size = midi_counted(&rd->data[best->start], growing ? msg_size : chk_size,
+			&best->device, f_warn, user, stats, &dev.ev, &end_of_track);
+		slice_at(&dev.ev, best->start);
+
+		// advance this track
+		best->start += byte_size;
+		chk_size -= byte_size;
+		bool finished = end_of_track || (chk_size <= 0 && !growing);
+		if (finished){
+			// track finished, so disable it
+			best->type = -1;
+			rd->tracks_left--;
+		}
+
+		if ((int)dev.ev.type != 99){
+			if (!finished)
+				rd->dt_track = best_i;
+			rd->pending_dt = 0;
+			*event_out = dev;
+			return 1;
+		}
+
+		// track hasn't finished, so its next dt is read once it arrives
+		if (!finished)
+			best->dt = -1;
+	}
+	return -1;
+}
+
+bool bm_reader_next(bm_reader_st *rd, bm_delta_ev_st *event_out){
+	while (true){
+		// the previous call returned a header's RESET event, so set up its tracks now, which keeps
+		// their warnings after that event
+		if (rd->hd_format >= 0){
+			if (rd->follow && !follow_tracks_ready(rd))
+				return false;
+			reader_tracks(rd);
+		}
+		else if (rd->pattern_pending){
+			// the previous call returned the RESET between format 2 patterns
+			rd->pattern_pending = false;
+			rd->track_base++;
+			reader_open(rd);
+		}
+
+		if (rd->follow){
+			int res = follow_merge(rd, event_out);
+			if (res >= 0)
+				return res > 0;
+		}
+		else if (reader_merge(rd, event_out))
+			return true;
+
+		if (rd->patterns_left > 0){
+			// the next format 2 pattern starts when this one ends, and with nothing left over
+			rd->patterns_left--;
+			rd->pattern_pending = true;
+			event_out->delta = rd->pending_dt;
+			event_out->ev = bm_ev_reset(rd->divisor);
+			rd->pending_dt = 0;
+			return true;
 		}
 
 		// go to next grouping of chunks, which will start with a MThd (if it exists)
-		ch += track_count;
+		if (rd->ch >= rd->chunks_size || (rd->single && rd->found_header))
+			return false;
+		if (rd->chunks[rd->ch].type != 0){
+			// only in a followed file, where a track can begin after its sequence started
+			warn(rd->f_warn, rd->user, STATS(rd->stats), BM_WARN_HEADER,
+				"Track chunk began after its sequence started, skipping it");
+			rd->ch++;
+			continue;
+		}
+		*event_out = reader_header(rd);
+		return true;
+	}
+}
+
+// the format a header reports, without warnings, which reader_header sends later
+static int header_format(const uint8_t *data, const chunk_st *chk){
+	if (chk->end - chk->start < 2)
+		return 1;
+	int format = ((int)data[chk->start + 0] << 8) | data[chk->start + 1];
+	return format == 0 || format == 2 ? format : 1;
+}
+
+int bm_sequences(const uint8_t *data, int size, bm_sequence_st *sequences_out,
+	int max_sequences_size, bm_warn_f f_warn, void *user){
+	bm_reader_st rd;
+	reader_init(&rd, data, size, f_warn, user, NULL);
+	int total = 0;
+	int ch = 0;
+	// mirrors bm_reader_next: a header, followed by the tracks up to the next header
+	while (ch < rd.chunks_size){
+		int header = ch++;
+		if (header > 0)
+			warn(f_warn, user, NULL, BM_WARN_HEADER, "Multiple header chunks present");
+		int format = header_format(data, &rd.chunks[header]);
+		int tracks = 0;
+		while (ch < rd.chunks_size && rd.chunks[ch].type == 1){
+			tracks++;
+			ch++;
+		}
+		int patterns = format == 2 ? tracks : 0;
+		for (int i = 0; i < (patterns > 0 ? patterns : 1); i++){
+			if (total < max_sequences_size){
+				sequences_out[total] = (bm_sequence_st){
+					.chunk = header,
+					.pattern = patterns > 0 ? i : -1,
+					.format = format,
+					.tracks = patterns > 0 ? 1 : tracks
+				};
+			}
+			total++;
+		}
+	}
+	return total;
+}
+
+void bm_reader_init_sequence(bm_reader_st *reader, const uint8_t *data, int size,
+	const bm_sequence_st *sequence, bm_warn_f f_warn, void *user){
+	// bm_sequences already sent the chunk warnings
+	reader_init(reader, data, size, NULL, NULL, NULL);
+	reader->f_warn = f_warn;
+	reader->user = user;
+	reader->single = true;
+	reader->pattern = sequence->pattern;
+	if (sequence->chunk >= 0 && sequence->chunk < reader->chunks_size &&
+		reader->chunks[sequence->chunk].type == 0)
+		reader->ch = sequence->chunk;
+	else
+		reader->ch = reader->chunks_size; // nothing to read
+}
+
+static void readmidi(const uint8_t *data, int size, bm_event_f f_event, bm_warn_f f_warn,
+	void *user, bm_stats_st *stats){
+	bool count_cycles = STATS(stats) && stats->count_cycles;
+	bm_reader_st rd;
+	reader_init(&rd, data, size, f_warn, user, stats);
+	bm_delta_ev_st ev;
+	while (bm_reader_next(&rd, &ev)){
+		uint64_t c0 = count_cycles ? stats_cycles() : 0;
+		f_event(ev, user);
+		if (count_cycles)
+			stats->cycles[BM_PHASE_CALLBACK] += stats_cycles() - c0;
+	}
+}
+
+void bm_readmidi(const uint8_t *data, int size, bm_event_f f_event, bm_warn_f f_warn, void *user){
+	readmidi(data, size, f_event, f_warn, user, NULL);
+}
+
+void bm_readmidi_stats(const uint8_t *data, int size, bm_event_f f_event, bm_warn_f f_warn,
+	void *user, bm_stats_st *stats){
+	bool count_cycles = stats->count_cycles;
+	bm_stats_init(stats);
+	stats->count_cycles = count_cycles;
+	readmidi(data, size, f_event, f_warn, user, STATS(stats));
+}
+
+// whether a packed event read from outside, like from a cache or archive, is safe to apply: its type
+// has to exist, and any channel, note, pedal, or patch it holds has to be in range
+static bool packed_valid(bm_packed_ev_st pk){
+	if (pk.type >= BM_EV_TYPES)
+		return false;
+	if (pk.type >= BM_EV_NOTEON && pk.type <= BM_EV_MOD && pk.channel > 15)
+		return false;
+	switch (pk.type){
+		case BM_EV_NOTEON:
+			return (pk.data & 0xFF) < 128 && (pk.data >> 8) < 128;
+		case BM_EV_NOTEOFF:
+			return pk.data < 128;
+		case BM_EV_PEDALON:
+		case BM_EV_PEDALOFF:
+			return pk.data < 6;
+		case BM_EV_PATCH:
+			return pk.data < sizeof(patch_midi) / sizeof(patch_midi[0]);
 	}
+	return true;
 }
 
-void bm_writemidi(bm_delta_ev_st *events, int size, bm_dump_f f_dump, void *user){
-	// TODO: this
+void bm_update_packed(bm_state_st *state, const bm_packed_ev_st *events, int events_size){
+	for (int i = 0; i < events_size; i++){
+		const bm_packed_ev_st *ev = &events[i];
+		switch (ev->type){
+			case BM_EV_RESET:
+				if (ev->data > 0)
+					state->divisor = ev->data;
+				rest_init(state);
+				break;
+			case BM_EV_TEMPO:
+				state->tempo = ((uint32_t)ev->channel << 16) | ev->data;
+				break;
+			case BM_EV_MASTVOL:
+				state->mastvol = ev->data;
+				break;
+			case BM_EV_MASTPAN:
+				state->mastpan = ev->data;
+				break;
+			case BM_EV_NOTEON:
+				state->channels[ev->channel].notes[ev->data & 0x7F] =
+					(struct bm_state_note_struct){
+						.down = true,
+						.velocity = ev->data >> 8
+					};
+				break;
+			case BM_EV_NOTEOFF:
+				state->channels[ev->channel].notes[ev->data & 0x7F] =
+					(struct bm_state_note_struct){
+						.down = false,
+						.velocity = 0
+					};
+				break;
+			case BM_EV_PEDALON:
+				state->channels[ev->channel].pedals[ev->data] = true;
+				break;
+			case BM_EV_PEDALOFF:
+				state->channels[ev->channel].pedals[ev->data] = false;
+				break;
+			case BM_EV_CHANVOL:
+				state->channels[ev->channel].vol = ev->data;
+				break;
+			case BM_EV_CHANPAN:
+				state->channels[ev->channel].pan = (int16_t)ev->data;
+				break;
+			case BM_EV_PATCH:
+				state->channels[ev->channel].patch = ev->data;
+				break;
+			case BM_EV_BEND:
+				state->channels[ev->channel].bend = (int16_t)ev->data;
+				break;
+			case BM_EV_MOD:
+				state->channels[ev->channel].mod = ev->data;
+				break;
+		}
+	}
+}
+
+int bm_devicebytes_packed(bm_device_st *device, const uint8_t *data, int size,
+	bm_packed_ev_st *events_out, int max_events_size, bm_warn_f f_warn, void *user){
+	int e = 0;
+	int p = 0;
+	bm_delta_ev_st dev = { .delta = 0 };
+	while (e < max_events_size && p < size){
+		dev.ev.type = 99; // set event type to something invalid to detect if one is written
+		int at = p;
+		p += midi_single(&data[p], size - p, device, f_warn, user, NULL, &dev.ev, NULL);
+		if ((int)dev.ev.type != 99){
+			slice_at(&dev.ev, at);
+			events_out[e++] = bm_pack(dev);
+		}
+	}
+	return e;
+}
+
+// bm_readmidi shares `user` between both callbacks, so internal consumers that need their own
+// context put this first in their struct and pass fwd_warn as the warning callback
+typedef struct {
+	bm_warn_f f_warn;
+	void *user;
+} warn_fwd_st;
+
+static void fwd_warn(const char *msg, void *user){
+	warn_fwd_st *fwd = user;
+	fwd->f_warn(msg, fwd->user);
+}
+
+typedef struct {
+	warn_fwd_st fwd;
+	bm_packed_ev_st *events;
+	int max_events_size;
+	int size;
+} packed_out_st;
+
+static void packed_event(bm_delta_ev_st event, void *user){
+	packed_out_st *out = user;
+	if (out->size < out->max_events_size)
+		out->events[out->size] = bm_pack(event);
+	out->size++;
+}
+
+int bm_readmidi_packed(const uint8_t *data, int size, bm_packed_ev_st *events_out,
+	int max_events_size, bm_warn_f f_warn, void *user){
+	packed_out_st out = {
+		.fwd = { .f_warn = f_warn, .user = user },
+		.events = events_out,
+		.max_events_size = max_events_size,
+		.size = 0
+	};
+	bm_readmidi(data, size, packed_event, f_warn ? fwd_warn : NULL, &out);
+	return out.size;
+}
+
+//
+// allocators
+//
+
+static void *sys_alloc(size_t size, void *user){
+	return malloc(size);
+}
+
+static void *sys_realloc(void *ptr, size_t old_size, size_t new_size, void *user){
+	return realloc(ptr, new_size);
+}
+
+static void sys_free(void *ptr, size_t size, void *user){
+	free(ptr);
+}
+
+// copies the allocator, or the system allocator if it's NULL
+static inline bm_allocator_st allocator(const bm_allocator_st *alloc){
+	if (alloc)
+		return *alloc;
+	return (bm_allocator_st){
+		.f_alloc = sys_alloc,
+		.f_realloc = sys_realloc,
+		.f_free = sys_free,
+		.user = NULL
+	};
+}
+
+struct bm_arena_block_struct {
+	struct bm_arena_block_struct *next;
+	size_t size;              // bytes available after the header
+};
+
+// allocations are aligned to 16 bytes, and the header is padded to keep them that way
+#define ARENA_ALIGN(n) (((n) + 15) & ~(size_t)15)
+#define ARENA_HEADER   ARENA_ALIGN(sizeof(struct bm_arena_block_struct))
+
+static inline uint8_t *arena_data(struct bm_arena_block_struct *block){
+	return (uint8_t *)block + ARENA_HEADER;
+}
+
+void bm_arena_init(bm_arena_st *arena, size_t block_size){
+	arena->head = NULL;
+	arena->current = NULL;
+	arena->used = 0;
+	arena->last = 0;
+	arena->block_size = block_size > 0 ? ARENA_ALIGN(block_size) : BM_ARENA_BLOCK;
+}
+
+static void *arena_alloc(size_t size, void *user){
+	bm_arena_st *arena = user;
+	if (size > SIZE_MAX - ARENA_HEADER - 15)
+		return NULL;
+	size = ARENA_ALIGN(size);
+	// move through the blocks kept from before the last reset, then add new ones at the end
+	while (arena->current == NULL || arena->used + size > arena->current->size){
+		struct bm_arena_block_struct *next = arena->current ? arena->current->next : arena->head;
+		if (next == NULL){
+			size_t block_size = size > arena->block_size ? size : arena->block_size;
+			next = malloc(ARENA_HEADER + block_size);
+			if (next == NULL)
+				return NULL;
+			next->next = NULL;
+			next->size = block_size;
+			if (arena->current)
+				arena->current->next = next;
+			else
+				arena->head = next;
+		}
+		arena->current = next;
+		arena->used = 0;
+	}
+	arena->last = arena->used;
+	arena->used += size;
+	return arena_data(arena->current) + arena->last;
+}
+
+static inline bool arena_is_last(bm_arena_st *arena, void *ptr){
+	return arena->current && ptr == arena_data(arena->current) + arena->last;
+}
+
+static void *arena_realloc(void *ptr, size_t old_size, size_t new_size, void *user){
+	bm_arena_st *arena = user;
+	if (ptr == NULL)
+		return arena_alloc(new_size, arena);
+	if (arena_is_last(arena, ptr) && new_size <= SIZE_MAX - 15 &&
+		arena->last + ARENA_ALIGN(new_size) <= arena->current->size){
+		arena->used = arena->last + ARENA_ALIGN(new_size);
+		return ptr;
+	}
+	if (new_size <= old_size)
+		return ptr;
+	void *p = arena_alloc(new_size, arena);
+	if (p)
+		memcpy(p, ptr, old_size);
+	return p;
+}
+
+static void arena_free(void *ptr, size_t size, void *user){
+	bm_arena_st *arena = user;
+	if (ptr && arena_is_last(arena, ptr))
+		arena->used = arena->last;
+}
+
+bm_allocator_st bm_arena_allocator(bm_arena_st *arena){
+	return (bm_allocator_st){
+		.f_alloc = arena_alloc,
+		.f_realloc = arena_realloc,
+		.f_free = arena_free,
+		.user = arena
+	};
+}
+
+void bm_arena_reset(bm_arena_st *arena){
+	arena->current = NULL;
+	arena->used = 0;
+	arena->last = 0;
+}
+
+void bm_arena_free(bm_arena_st *arena){
+	struct bm_arena_block_struct *block = arena->head;
+	while (block){
+		struct bm_arena_block_struct *next = block->next;
+		free(block);
+		block = next;
+	}
+	bm_arena_init(arena, arena->block_size);
+}
+
+//
+// struct-of-arrays event store
+//
+
+void bm_soa_init(bm_soa_st *soa, const bm_allocator_st *alloc){
+	memset(soa, 0, sizeof(bm_soa_st));
+	soa->alloc = allocator(alloc);
+}
+
+void bm_soa_clear(bm_soa_st *soa){
+	soa->size = 0;
+	for (int t = 0; t < BM_EV_TYPES; t++)
+		soa->types[t].size = 0;
+	soa->oom = false;
+}
+
+void bm_soa_free(bm_soa_st *soa){
+	bm_allocator_st a = soa->alloc;
+	a.f_free(soa->tick, sizeof(*soa->tick) * (size_t)soa->count, a.user);
+	a.f_free(soa->type, sizeof(*soa->type) * (size_t)soa->count, a.user);
+	a.f_free(soa->channel, sizeof(*soa->channel) * (size_t)soa->count, a.user);
+	a.f_free(soa->value, sizeof(*soa->value) * (size_t)soa->count, a.user);
+	a.f_free(soa->velocity, sizeof(*soa->velocity) * (size_t)soa->count, a.user);
+	for (int t = 0; t < BM_EV_TYPES; t++){
+		a.f_free(soa->types[t].index, sizeof(int32_t) * (size_t)soa->types[t].count,
+			a.user);
+	}
+	bm_soa_init(soa, &a);
+}
+
+static inline bool grow(const bm_allocator_st *a, void **ptr, int *count, int size, int elem_size){
+	if (size < *count)
+		return true;
+	int new_count = *count < 1024 ? 1024 : *count * 2;
+	void *p = a->f_realloc(*ptr, (size_t)*count * elem_size, (size_t)new_count * elem_size,
+		a->user);
+	if (p == NULL)
+		return false;
+	*ptr = p;
+	*count = new_count;
+	return true;
+}
+
+bool bm_soa_push(bm_soa_st *soa, uint32_t tick, bm_ev_st ev){
+	if (soa->oom || (unsigned)ev.type >= BM_EV_TYPES)
+		return false;
+	if (soa->size >= soa->count){
+		// grow every column to the same size
+		int new_count = soa->count < 1024 ? 1024 : soa->count * 2;
+		void *p;
+		#define SOA_GROW(col) \
+			p = soa->alloc.f_realloc(soa->col, sizeof(*soa->col) * (size_t)soa->count, \
+				sizeof(*soa->col) * (size_t)new_count, soa->alloc.user); \
+			if (p == NULL) \
+				goto oom; \
+			soa->col = p;
+		SOA_GROW(tick)
+		SOA_GROW(type)
+		SOA_GROW(channel)
+		SOA_GROW(value)
+		SOA_GROW(velocity)
+		#undef SOA_GROW
+		soa->count = new_count;
+	}
+	if (!grow(&soa->alloc, (void **)&soa->types[ev.type].index, &soa->types[ev.type].count,
+		soa->types[ev.type].size, sizeof(int32_t)))
+		goto oom;
+
+	int i = soa->size++;
+	int channel = 0;
+	int value = 0;
+	int velocity = 0;
+	switch (ev.type){
+		case BM_EV_RESET   : value = ev.u.reset;                                          break;
+		case BM_EV_TEMPO   : value = ev.u.tempo;                                          break;
+		case BM_EV_MASTVOL : value = ev.u.mastvol;                                        break;
+		case BM_EV_MASTPAN : value = ev.u.mastpan;                                        break;
+		case BM_EV_NOTEON  : channel = ev.u.noteon.channel; value = ev.u.noteon.note;
+		                     velocity = ev.u.noteon.velocity;                             break;
+		case BM_EV_NOTEOFF : channel = ev.u.noteoff.channel; value = ev.u.noteoff.note;   break;
+		case BM_EV_PEDALON : channel = ev.u.pedalon.channel; value = ev.u.pedalon.pedal;  break;
+		case BM_EV_PEDALOFF: channel = ev.u.pedaloff.channel; value = ev.u.pedaloff.pedal;break;
+		case BM_EV_CHANVOL : channel = ev.u.chanvol.channel; value = ev.u.chanvol.vol;    break;
+		case BM_EV_CHANPAN : channel = ev.u.chanpan.channel; value = ev.u.chanpan.pan;    break;
+		case BM_EV_PATCH   : channel = ev.u.patch.channel; value = ev.u.patch.patch;      break;
+		case BM_EV_BEND    : channel = ev.u.bend.channel; value = ev.u.bend.bend;         break;
+		case BM_EV_MOD     : channel = ev.u.mod.channel; value = ev.u.mod.mod;            break;
+		case BM_EV_META    :
+		case BM_EV_SYSEX   : value = ev.u.slice;                                          break;
+	}
+	soa->tick[i] = tick;
+	soa->type[i] = ev.type;
+	soa->channel[i] = channel;
+	soa->value[i] = value;
+	soa->velocity[i] = velocity;
+	soa->types[ev.type].index[soa->types[ev.type].size++] = i;
+	return true;
+oom:
+	soa->oom = true;
+	return false;
+}
+
+bm_delta_ev_st bm_soa_event(const bm_soa_st *soa, int i){
+	int delta = i > 0 ? soa->tick[i] - soa->tick[i - 1] : soa->tick[i];
+	int channel = soa->channel[i];
+	int value = soa->value[i];
+	bm_ev_st ev;
+	switch ((bm_ev_type)soa->type[i]){
+		case BM_EV_RESET   : ev = bm_ev_reset(value);                           break;
+		case BM_EV_TEMPO   : ev = bm_ev_tempo(value);                           break;
+		case BM_EV_MASTVOL : ev = bm_ev_mastvol(value);                         break;
+		case BM_EV_MASTPAN : ev = bm_ev_mastpan(value);                         break;
+		case BM_EV_NOTEON  : ev = bm_ev_noteon(channel, value, soa->velocity[i]); break;
+		case BM_EV_NOTEOFF : ev = bm_ev_noteoff(channel, value);                break;
+		case BM_EV_PEDALON : ev = bm_ev_pedalon(channel, value);                break;
+		case BM_EV_PEDALOFF: ev = bm_ev_pedaloff(channel, value);               break;
+		case BM_EV_CHANVOL : ev = bm_ev_chanvol(channel, value);                break;
+		case BM_EV_CHANPAN : ev = bm_ev_chanpan(channel, value);                break;
+		case BM_EV_PATCH   : ev = bm_ev_patch(channel, value);                  break;
+		case BM_EV_BEND    : ev = bm_ev_bend(channel, value);                   break;
+		case BM_EV_META    :
+		case BM_EV_SYSEX   : ev = (bm_ev_st){ soa->type[i], { .slice = value } }; break;
+		default            : ev = bm_ev_mod(channel, value);                    break;
+	}
+	return (bm_delta_ev_st){ .delta = delta, .ev = ev };
+}
+
+typedef struct {
+	warn_fwd_st fwd;
+	bm_soa_st *soa;
+	uint32_t tick;
+} soa_out_st;
+
+static void soa_event(bm_delta_ev_st event, void *user){
+	soa_out_st *out = user;
+	out->tick += event.delta;
+	bm_soa_push(out->soa, out->tick, event.ev);
+}
+
+bool bm_readmidi_soa(const uint8_t *data, int size, bm_soa_st *soa, bm_warn_f f_warn, void *user){
+	bm_soa_clear(soa);
+	soa_out_st out = { .fwd = { .f_warn = f_warn, .user = user }, .soa = soa, .tick = 0 };
+	bm_readmidi(data, size, soa_event, f_warn ? fwd_warn : NULL, &out);
+	return !soa->oom;
+}
+
+void bm_soa_notehist(const bm_soa_st *soa, int hist[128]){
+	for (int n = 0; n < 128; n++)
+		hist[n] = 0;
+	const int32_t *index = soa->types[BM_EV_NOTEON].index;
+	for (int i = 0; i < soa->types[BM_EV_NOTEON].size; i++)
+		hist[soa->value[index[i]] & 0x7F]++;
+}
+
+void bm_soa_velhist(const bm_soa_st *soa, int hist[128]){
+	for (int n = 0; n < 128; n++)
+		hist[n] = 0;
+	const int32_t *index = soa->types[BM_EV_NOTEON].index;
+	for (int i = 0; i < soa->types[BM_EV_NOTEON].size; i++)
+		hist[soa->velocity[index[i]] & 0x7F]++;
+}
+
+void bm_soa_transpose(bm_soa_st *soa, int semitones){
+	// branchless over the whole column so the compiler can vectorize it
+	const uint8_t *type = soa->type;
+	int32_t *value = soa->value;
+	for (int i = 0; i < soa->size; i++){
+		int is_note = (type[i] == BM_EV_NOTEON) | (type[i] == BM_EV_NOTEOFF);
+		int v = value[i] + semitones;
+		v = v < 0 ? 0 : v > 127 ? 127 : v;
+		value[i] = is_note ? v : value[i];
+	}
+}
+
+void bm_soa_scalevel(bm_soa_st *soa, int numerator, int denominator){
+	if (denominator <= 0)
+		return;
+	// velocity is 0 for everything except NOTEON, so it's safe to scale the whole column, as long
+	// as zero stays zero
+	uint8_t *velocity = soa->velocity;
+	for (int i = 0; i < soa->size; i++){
+		int v = velocity[i] * numerator / denominator;
+		v = v < 1 ? 1 : v > 127 ? 127 : v;
+		velocity[i] = velocity[i] == 0 ? 0 : v;
+	}
+}
+
+void bm_notepair_init(bm_notepair_st *np, bm_note_st *notes_out, int max_notes_size, int flags){
+	np->notes = notes_out;
+	np->max_notes_size = max_notes_size;
+	np->size = 0;
+	np->flags = flags;
+	np->tick = 0;
+	for (int i = 0; i < 16; i++){
+		np->channels[i].open_size = 0;
+		np->channels[i].damper = false;
+	}
+}
+
+static inline void notepair_close(bm_notepair_st *np, int chan, int o){
+	int index = np->channels[chan].open[o].index;
+	if (index < np->max_notes_size)
+		np->notes[index].duration = np->tick - np->channels[chan].open[o].start;
+	// remove from the open list, keeping it sorted oldest first
+	int last = --np->channels[chan].open_size;
+	for (int i = o; i < last; i++)
+		np->channels[chan].open[i] = np->channels[chan].open[i + 1];
+}
+
+static inline void notepair_closeall(bm_notepair_st *np, int chan, bool released_only){
+	int o = 0;
+	while (o < np->channels[chan].open_size){
+		if (!released_only || np->channels[chan].open[o].released)
+			notepair_close(np, chan, o);
+		else
+			o++;
+	}
+}
+
+void bm_notepair_event(bm_delta_ev_st event, void *user){
+	bm_notepair_st *np = user;
+	np->tick += event.delta;
+	bm_ev_st *ev = &event.ev;
+	switch (ev->type){
+		case BM_EV_RESET:
+			for (int chan = 0; chan < 16; chan++){
+				notepair_closeall(np, chan, false);
+				np->channels[chan].damper = false;
+			}
+			break;
+		case BM_EV_NOTEON: {
+			int chan = ev->u.noteon.channel;
+			int note = ev->u.noteon.note;
+			// striking a key that is only held by the damper cuts it off
+			for (int o = 0; o < np->channels[chan].open_size; o++){
+				if (np->channels[chan].open[o].note == note &&
+					np->channels[chan].open[o].released){
+					notepair_close(np, chan, o);
+					break;
+				}
+			}
+			if (np->channels[chan].open_size >= 128)
+				notepair_close(np, chan, 0);
+			int o = np->channels[chan].open_size++;
+			np->channels[chan].open[o].start = np->tick;
+			np->channels[chan].open[o].index = np->size;
+			np->channels[chan].open[o].note = note;
+			np->channels[chan].open[o].released = false;
+			if (np->size < np->max_notes_size){
+				np->notes[np->size] = (bm_note_st){
+					.start = np->tick,
+					.duration = 0,
+					.channel = chan,
+					.note = note,
+					.velocity = ev->u.noteon.velocity
+				};
+			}
+			np->size++;
+			break;
+		}
+		case BM_EV_NOTEOFF: {
+			int chan = ev->u.noteoff.channel;
+			int note = ev->u.noteoff.note;
+			for (int o = 0; o < np->channels[chan].open_size; o++){
+				if (np->channels[chan].open[o].note != note || np->channels[chan].open[o].released)
+					continue;
+				if (np->channels[chan].damper)
+					np->channels[chan].open[o].released = true;
+				else
+					notepair_close(np, chan, o);
+				break;
+			}
+			break;
+		}
+		case BM_EV_PEDALON:
+			if ((np->flags & BM_NOTEPAIR_DAMPER) && ev->u.pedalon.pedal == BM_PEDAL_DAMPER)
+				np->channels[ev->u.pedalon.channel].damper = true;
+			break;
+		case BM_EV_PEDALOFF:
+			if ((np->flags & BM_NOTEPAIR_DAMPER) && ev->u.pedaloff.pedal == BM_PEDAL_DAMPER){
+				np->channels[ev->u.pedaloff.channel].damper = false;
+				notepair_closeall(np, ev->u.pedaloff.channel, true);
+			}
+			break;
+		default:
+			break;
+	}
+}
+
+int bm_notepair_finish(bm_notepair_st *np){
+	for (int chan = 0; chan < 16; chan++){
+		notepair_closeall(np, chan, false);
+		np->channels[chan].damper = false;
+	}
+	return np->size;
+}
+
+int bm_notepairs(const bm_delta_ev_st *events, int size, bm_note_st *notes_out,
+	int max_notes_size, int flags){
+	bm_notepair_st np;
+	bm_notepair_init(&np, notes_out, max_notes_size, flags);
+	for (int i = 0; i < size; i++)
+		bm_notepair_event(events[i], &np);
+	return bm_notepair_finish(&np);
+}
+
+typedef struct {
+	warn_fwd_st fwd;
+	bm_notepair_st np;
+} notes_out_st;
+
+static void notes_event(bm_delta_ev_st event, void *user){
+	bm_notepair_event(event, &((notes_out_st *)user)->np);
+}
+
+int bm_readmidi_notes(const uint8_t *data, int size, bm_note_st *notes_out, int max_notes_size,
+	int flags, bm_warn_f f_warn, void *user){
+	notes_out_st out = { .fwd = { .f_warn = f_warn, .user = user } };
+	bm_notepair_init(&out.np, notes_out, max_notes_size, flags);
+	bm_readmidi(data, size, notes_event, f_warn ? fwd_warn : NULL, &out);
+	return bm_notepair_finish(&out.np);
+}
+
+static inline uint32_t note_end(const bm_note_st *note){
+	return note->start + (note->duration > 0 ? note->duration : 1);
+}
+
+static int note_cmp(const void *a, const void *b){
+	const bm_note_st *na = a;
+	const bm_note_st *nb = b;
+	if (na->start != nb->start)
+		return na->start < nb->start ? -1 : 1;
+	if (na->channel != nb->channel)
+		return na->channel < nb->channel ? -1 : 1;
+	return (int)na->note - (int)nb->note;
+}
+
+bool bm_noteindex_build(bm_noteindex_st *idx, const bm_note_st *notes, int size,
+	const bm_allocator_st *alloc){
+	idx->notes = NULL;
+	idx->max_end = NULL;
+	idx->size = 0;
+	idx->root_level = -1;
+	idx->alloc = allocator(alloc);
+	if (size <= 0)
+		return true;
+	// size is set first, so bm_noteindex_free knows the size of anything allocated
+	idx->size = size;
+	idx->notes = idx->alloc.f_alloc(sizeof(bm_note_st) * (size_t)size, idx->alloc.user);
+	idx->max_end = idx->alloc.f_alloc(sizeof(uint32_t) * (size_t)size, idx->alloc.user);
+	if (idx->notes == NULL || idx->max_end == NULL){
+		bm_noteindex_free(idx);
+		return false;
+	}
+	memcpy(idx->notes, notes, sizeof(bm_note_st) * (size_t)size);
+
+	// note pairing already produces notes in start order, so only sort if needed
+	for (int i = 1; i < size; i++){
+		if (notes[i].start < notes[i - 1].start){
+			qsort(idx->notes, size, sizeof(bm_note_st), note_cmp);
+			break;
+		}
+	}
+
+	// the tree is implicit: node i is at level k if its lowest k bits are set and bit k is clear,
+	// so leaves are the even indices, and the children of node i at level k are i -/+ 2^(k-1)
+	const bm_note_st *a = idx->notes;
+	uint32_t *m = idx->max_end;
+	int last_i = 0;     // rightmost node at the current level
+	uint32_t last = 0;  // max_end of last_i
+	for (int i = 0; i < size; i += 2){
+		last_i = i;
+		last = m[i] = note_end(&a[i]);
+	}
+	int k;
+	for (k = 1; (1 << k) <= size; k++){
+		int x = 1 << (k - 1);
+		int step = x << 2;
+		for (int i = (x << 1) - 1; i < size; i += step){
+			uint32_t el = m[i - x];
+			// the right child can be past the end of the array, in which case it stands in for the
+			// rightmost node
+			uint32_t er = i + x < size ? m[i + x] : last;
+			uint32_t e = note_end(&a[i]);
+			e = e > el ? e : el;
+			e = e > er ? e : er;
+			m[i] = e;
+		}
+		last_i = (last_i >> k) & 1 ? last_i - x : last_i + x;
+		if (last_i < size && m[last_i] > last)
+			last = m[last_i];
+	}
+	idx->root_level = k - 1;
+	return true;
+}
+
+void bm_noteindex_free(bm_noteindex_st *idx){
+	// freed in reverse, so an arena can reclaim both
+	if (idx->max_end)
+		idx->alloc.f_free(idx->max_end, sizeof(uint32_t) * (size_t)idx->size, idx->alloc.user);
+	if (idx->notes)
+		idx->alloc.f_free(idx->notes, sizeof(bm_note_st) * (size_t)idx->size, idx->alloc.user);
+	idx->notes = NULL;
+	idx->max_end = NULL;
+	idx->size = 0;
+	idx->root_level = -1;
+}
+
+int bm_noteindex_range(const bm_noteindex_st *idx, uint32_t start, uint32_t end,
+	uint16_t channels, int *out, int max_out){
+	if (idx->size <= 0 || end <= start)
+		return 0;
+	const bm_note_st *a = idx->notes;
+	const uint32_t *m = idx->max_end;
+	int n = idx->size;
+	int total = 0;
+	#define NOTEINDEX_MATCH(i) \
+		if (start < note_end(&a[i]) && (channels & (1 << a[i].channel))){ \
+			if (total < max_out) \
+				out[total] = i; \
+			total++; \
+		}
+
+	// top-down traversal, visiting the left subtree, then the node, then the right subtree, so
+	// results come out in index order
+	struct {
+		int level;
+		int node;
+		bool left_done;
+	} stack[64];
+	int t = 0;
+	stack[t].level = idx->root_level;
+	stack[t].node = (1 << idx->root_level) - 1;
+	stack[t++].left_done = false;
+	while (t > 0){
+		int level = stack[--t].level;
+		int node = stack[t].node;
+		bool left_done = stack[t].left_done;
+		if (level <= 3){
+			// small subtree, so just scan it linearly
+			int i0 = node >> level << level;
+			int i1 = i0 + (1 << (level + 1)) - 1;
+			if (i1 > n)
+				i1 = n;
+			for (int i = i0; i < i1 && a[i].start < end; i++){
+				NOTEINDEX_MATCH(i)
+			}
+		}
+		else if (!left_done){
+			// revisit this node after its left child; the left child can be out of range, in which
+			// case it still needs visiting since its subtree may contain nodes in range
+			int y = node - (1 << (level - 1));
+			stack[t].level = level;
+			stack[t].node = node;
+			stack[t++].left_done = true;
+			if (y >= n || m[y] > start){
+				stack[t].level = level - 1;
+				stack[t].node = y;
+				stack[t++].left_done = false;
+			}
+		}
+		else if (node < n && a[node].start < end){
+			NOTEINDEX_MATCH(node)
+			stack[t].level = level - 1;
+			stack[t].node = node + (1 << (level - 1));
+			stack[t++].left_done = false;
+		}
+	}
+	#undef NOTEINDEX_MATCH
+	return total;
+}
+
+int bm_noteindex_at(const bm_noteindex_st *idx, uint32_t tick, uint16_t channels, int *out,
+	int max_out){
+	if (tick == UINT32_MAX)
+		return 0;
+	return bm_noteindex_range(idx, tick, tick + 1, channels, out, max_out);
+}
+
+static inline bool host_is_le(){
+	const uint16_t one = 1;
+	return *(const uint8_t *)&one == 1;
+}
+
+static inline bool dump_all(bm_dump_f f_dump, void *user, const void *ptr, size_t size,
+	size_t nitems){
+	return nitems == 0 || f_dump(ptr, size, nitems, user) == nitems;
+}
+
+bool bm_writecache(const bm_delta_ev_st *events, int size, bm_dump_f f_dump, void *user){
+	// the format stores native structs, so it's only defined for little-endian hosts
+	if (!host_is_le() || size < 0)
+		return false;
+
+	// first pass counts the tempo map entries, which start with the initial state from bm_init
+	int tempos_size = 1;
+	uint32_t total_ticks = 0;
+	for (int i = 0; i < size; i++){
+		total_ticks += events[i].delta;
+		if (events[i].ev.type == BM_EV_RESET || events[i].ev.type == BM_EV_TEMPO)
+			tempos_size++;
+	}
+	int seeks_size = (size + BM_CACHE_SEEK_INTERVAL - 1) / BM_CACHE_SEEK_INTERVAL;
+
+	bm_cache_hdr_st hdr = {
+		.magic = BM_CACHE_MAGIC,
+		.version = BM_CACHE_VERSION,
+		.header_size = sizeof(bm_cache_hdr_st),
+		.events_size = size,
+		.tempos_size = tempos_size,
+		.seeks_size = seeks_size,
+		.seek_interval = BM_CACHE_SEEK_INTERVAL,
+		.total_ticks = total_ticks,
+		.tempos_offset = sizeof(bm_cache_hdr_st),
+		.reserved = 0
+	};
+	hdr.seeks_offset = hdr.tempos_offset + sizeof(bm_cache_tempo_st) * tempos_size;
+	hdr.events_offset = hdr.seeks_offset + sizeof(bm_cache_seek_st) * seeks_size;
+	if (!dump_all(f_dump, user, &hdr, sizeof(hdr), 1))
+		return false;
+
+	// tempo map
+	bm_cache_tempo_st tmp = { .usec = 0, .tick = 0, .index = 0, .tempo = 500000, .divisor = 1 };
+	if (!dump_all(f_dump, user, &tmp, sizeof(tmp), 1))
+		return false;
+	uint32_t tick = 0;
+	for (int i = 0; i < size; i++){
+		tick += events[i].delta;
+		if (events[i].ev.type != BM_EV_RESET && events[i].ev.type != BM_EV_TEMPO)
+			continue;
+		tmp.usec += (uint64_t)(tick - tmp.tick) * tmp.tempo / tmp.divisor;
+		tmp.tick = tick;
+		tmp.index = i;
+		if (events[i].ev.type == BM_EV_RESET){
+			if (events[i].ev.u.reset > 0)
+				tmp.divisor = events[i].ev.u.reset;
+			tmp.tempo = 500000;
+		}
+		else
+			tmp.tempo = events[i].ev.u.tempo;
+		if (!dump_all(f_dump, user, &tmp, sizeof(tmp), 1))
+			return false;
+	}
+
+	// seek table
+	tick = 0;
+	for (int i = 0; i < size; i++){
+		tick += events[i].delta;
+		if (i % BM_CACHE_SEEK_INTERVAL == 0){
+			bm_cache_seek_st sk = { .tick = tick, .index = i };
+			if (!dump_all(f_dump, user, &sk, sizeof(sk), 1))
+				return false;
+		}
+	}
+
+	// events, packed in small batches to keep the number of dump calls down
+	bm_packed_ev_st buf[256];
+	int buf_size = 0;
+	for (int i = 0; i < size; i++){
+		buf[buf_size++] = bm_pack(events[i]);
+		if (buf_size >= 256){
+			if (!dump_all(f_dump, user, buf, sizeof(bm_packed_ev_st), buf_size))
+				return false;
+			buf_size = 0;
+		}
+	}
+	return dump_all(f_dump, user, buf, sizeof(bm_packed_ev_st), buf_size);
+}
+
+bool bm_cacheopen(bm_cache_st *cache, const void *data, int size){
+	const uint8_t *bytes = data;
+	if (!host_is_le() || size < (int)sizeof(bm_cache_hdr_st) || ((uintptr_t)bytes & 7) != 0)
+		return false;
+	const bm_cache_hdr_st *hdr = data;
+	if (hdr->magic != BM_CACHE_MAGIC || hdr->version != BM_CACHE_VERSION ||
+		hdr->header_size != sizeof(bm_cache_hdr_st) ||
+		hdr->seek_interval != BM_CACHE_SEEK_INTERVAL)
+		return false;
+
+	// validate that every section lives inside of the data, using 64-bit math to avoid overflow
+	uint64_t tempos_end = (uint64_t)hdr->tempos_offset +
+		(uint64_t)hdr->tempos_size * sizeof(bm_cache_tempo_st);
+	uint64_t seeks_end = (uint64_t)hdr->seeks_offset +
+		(uint64_t)hdr->seeks_size * sizeof(bm_cache_seek_st);
+	uint64_t events_end = (uint64_t)hdr->events_offset +
+		(uint64_t)hdr->events_size * sizeof(bm_packed_ev_st);
+	if (hdr->tempos_offset < sizeof(bm_cache_hdr_st) || hdr->seeks_offset < tempos_end ||
+		hdr->events_offset < seeks_end || events_end > (uint64_t)size ||
+		(hdr->tempos_offset & 7) != 0 || (hdr->seeks_offset & 7) != 0 ||
+		(hdr->events_offset & 7) != 0 || hdr->tempos_size < 1 ||
+		hdr->seeks_size != (hdr->events_size + BM_CACHE_SEEK_INTERVAL - 1) /
+			BM_CACHE_SEEK_INTERVAL)
+		return false;
+
+	// bm_cacheseek starts walking from a seek entry, so its index has to be the event it claims,
+	// and the binary search needs the ticks in order
+	const bm_cache_seek_st *seeks = (const bm_cache_seek_st *)&bytes[hdr->seeks_offset];
+	for (uint32_t k = 0; k < hdr->seeks_size; k++){
+		if (seeks[k].index != k * BM_CACHE_SEEK_INTERVAL ||
+			(k > 0 && seeks[k].tick < seeks[k - 1].tick))
+			return false;
+	}
+
+	// the events are applied to fixed size tables by bm_update_packed and friends
+	const bm_packed_ev_st *events = (const bm_packed_ev_st *)&bytes[hdr->events_offset];
+	for (uint32_t i = 0; i < hdr->events_size; i++){
+		if (!packed_valid(events[i]))
+			return false;
+	}
+
+	cache->hdr = hdr;
+	cache->tempos = (const bm_cache_tempo_st *)&bytes[hdr->tempos_offset];
+	cache->seeks = seeks;
+	cache->events = events;
+	cache->tempos_size = hdr->tempos_size;
+	cache->seeks_size = hdr->seeks_size;
+	cache->events_size = hdr->events_size;
+	return true;
+}
+
+bm_delta_ev_st bm_cacheevent(const bm_cache_st *cache, int index){
+	return bm_unpack(cache->events[index]);
+}
+
+int bm_cacheseek(const bm_cache_st *cache, uint32_t tick, uint32_t *tick_out){
+	if (cache->events_size <= 0){
+		if (tick_out)
+			*tick_out = 0;
+		return 0;
+	}
+
+	// binary search for the last seek entry at or before tick
+	int lo = 0;
+	int hi = cache->seeks_size - 1;
+	while (lo < hi){
+		int mid = (lo + hi + 1) / 2;
+		if (cache->seeks[mid].tick <= tick)
+			lo = mid;
+		else
+			hi = mid - 1;
+	}
+
+	// seek entries are taken *at* an event, and several events can share a tick, so if the entry
+	// lands exactly on tick, step backwards to make sure we find the first one
+	while (lo > 0 && cache->seeks[lo].tick >= tick)
+		lo--;
+
+	// walk forward from the seek entry
+	int i = cache->seeks[lo].index;
+	uint32_t t = cache->seeks[lo].tick;
+	while (true){
+		if (t >= tick)
+			break;
+		i++;
+		if (i >= cache->events_size)
+			break;
+		t += cache->events[i].delta;
+	}
+	if (tick_out)
+		*tick_out = t;
+	return i;
+}
+
+//
+// MIDI writing
+//
+
+// the track's length comes before its data, so events are encoded twice: once with f_dump set to
+// NULL to measure the track, then again to write it out through a small buffer
+typedef struct {
+	bm_dump_f f_dump;
+	void *user;
+	bool ok;
+	int size;                 // bytes encoded so far
+	int divisor;              // from the first RESET, or -1 if there hasn't been one
+	uint32_t pending_dt;      // deltas of events that weren't written
+	int running_status;
+	bm_device_st device;      // what a reader has seen so far, so redundant messages can be skipped
+	bool live;                // writing to a device, so there are no deltas or meta events
+	int buf_size;
+	uint8_t buf[4096];
+} writer_st;
+
+static void writer_init(writer_st *w, bm_dump_f f_dump, void *user){
+	w->f_dump = f_dump;
+	w->user = user;
+	w->ok = true;
+	w->size = 0;
+	w->divisor = -1;
+	w->pending_dt = 0;
+	w->running_status = -1;
+	bm_deviceinit(&w->device);
+	w->live = false;
+	w->buf_size = 0;
+}
+
+static void writer_flush(writer_st *w){
+	if (w->ok && w->buf_size > 0)
+		w->ok = dump_all(w->f_dump, w->user, w->buf, 1, w->buf_size);
+	w->buf_size = 0;
+}
+
+static void writer_bytes(writer_st *w, const uint8_t *bytes, int size){
+	w->size += size;
+	if (w->f_dump == NULL)
+		return;
+	if (w->buf_size + size > (int)sizeof(w->buf))
+		writer_flush(w);
+	memcpy(&w->buf[w->buf_size], bytes, size);
+	w->buf_size += size;
+}
+
+static void writer_dt(writer_st *w, uint32_t dt){
+	if (w->live)
+		return;
+	// variable ints hold 28 bits, so longer gaps are padded out with empty text events, which
+	// readers skip
+	static const uint8_t empty_text[3] = { 0xFF, 0x01, 0x00 };
+	while (dt > 0x0FFFFFFF){
+		static const uint8_t max_dt[4] = { 0xFF, 0xFF, 0xFF, 0x7F };
+		writer_bytes(w, max_dt, 4);
+		writer_bytes(w, empty_text, 3);
+		w->running_status = -1;
+		dt -= 0x0FFFFFFF;
+	}
+	uint8_t b[4];
+	int len = 0;
+	if (dt >= 1 << 21)
+		b[len++] = 0x80 | (dt >> 21);
+	if (dt >= 1 << 14)
+		b[len++] = 0x80 | ((dt >> 14) & 0x7F);
+	if (dt >= 1 << 7)
+		b[len++] = 0x80 | ((dt >> 7) & 0x7F);
+	b[len++] = dt & 0x7F;
+	writer_bytes(w, b, len);
+}
+
+// writes a channel message, using running status when possible
+static void writer_msg(writer_st *w, int status, int d1, int d2, bool has_d2){
+	uint8_t b[3];
+	int len = 0;
+	if (status != w->running_status)
+		b[len++] = status;
+	b[len++] = d1;
+	if (has_d2)
+		b[len++] = d2;
+	writer_bytes(w, b, len);
+	w->running_status = status;
+}
+
+// writes a control change, after the delta of the event it belongs to
+static inline void writer_ctrl(writer_st *w, int chan, int ctrl, int val){
+	writer_msg(w, 0xB0 | chan, ctrl, val, true);
+}
+
+// 14-bit controllers that a reader turns into a single event with both halves, where the MSB
+// clears the LSB; if the MSB already matches, only the LSB needs to be sent
+static void writer_ctrl14(writer_st *w, int chan, int ctrl, uint16_t *current, int val){
+	if ((*current & 0x3F80) != (val & 0x3F80)){
+		writer_ctrl(w, chan, ctrl, val >> 7);
+		*current = val & 0x3F80;
+		if ((val & 0x7F) == 0)
+			return;
+		writer_dt(w, 0);
+	}
+	writer_ctrl(w, chan, ctrl + 0x20, val & 0x7F);
+	*current = val;
+}
+
+static void writer_event(writer_st *w, bm_delta_ev_st dev){
+	const bm_ev_st *ev = &dev.ev;
+	uint32_t dt = w->pending_dt + dev.delta;
+	if (ev->type == BM_EV_RESET){
+		// the divisor goes in the header, and a track has no other way to reset
+		if (w->divisor < 0)
+			w->divisor = ev->u.reset;
+		w->pending_dt = dt;
+		return;
+	}
+	if (ev->type == BM_EV_META || ev->type == BM_EV_SYSEX){
+		// slices don't hold their data, so there's nothing to write
+		w->pending_dt = dt;
+		return;
+	}
+	w->pending_dt = 0;
+	writer_dt(w, dt);
+	switch (ev->type){
+		case BM_EV_RESET:
+		case BM_EV_META:
+		case BM_EV_SYSEX:
+			break;
+		case BM_EV_TEMPO: {
+			if (w->live)
+				break; // 0xFF is System Reset on the wire
+			uint8_t b[6] = { 0xFF, 0x51, 0x03,
+				(ev->u.tempo >> 16) & 0xFF, (ev->u.tempo >> 8) & 0xFF, ev->u.tempo & 0xFF };
+			writer_bytes(w, b, 6);
+			w->running_status = -1;
+			break;
+		}
+		case BM_EV_MASTVOL:
+		case BM_EV_MASTPAN: {
+			int v = ev->type == BM_EV_MASTVOL ? ev->u.mastvol : ev->u.mastpan + 0x2000;
+			uint8_t b[9] = { 0xF0, 0x07, 0x7F, 0x7F, 0x04,
+				ev->type == BM_EV_MASTVOL ? 0x01 : 0x02, v & 0x7F, (v >> 7) & 0x7F, 0xF7 };
+			if (w->live){
+				// SysEx on the wire has no length
+				writer_bytes(w, b, 1);
+				writer_bytes(w, &b[2], 7);
+			}
+			else
+				writer_bytes(w, b, 9);
+			w->running_status = -1;
+			break;
+		}
+		case BM_EV_NOTEON:
+			writer_msg(w, 0x90 | ev->u.noteon.channel, ev->u.noteon.note, ev->u.noteon.velocity,
+				true);
+			break;
+		case BM_EV_NOTEOFF:
+			// a Note-On with zero velocity shares running status with the Note-Ons around it
+			writer_msg(w, 0x90 | ev->u.noteoff.channel, ev->u.noteoff.note, 0, true);
+			break;
+		case BM_EV_PEDALON:
+			writer_ctrl(w, ev->u.pedalon.channel, 0x40 + ev->u.pedalon.pedal, 0x7F);
+			break;
+		case BM_EV_PEDALOFF:
+			writer_ctrl(w, ev->u.pedaloff.channel, 0x40 + ev->u.pedaloff.pedal, 0x00);
+			break;
+		case BM_EV_CHANVOL: {
+			int chan = ev->u.chanvol.channel;
+			writer_ctrl14(w, chan, 0x07, &w->device.ctrls[chan].vol, ev->u.chanvol.vol);
+			break;
+		}
+		case BM_EV_CHANPAN: {
+			int chan = ev->u.chanpan.channel;
+			writer_ctrl14(w, chan, 0x0A, &w->device.ctrls[chan].pan,
+				ev->u.chanpan.pan + 0x2000);
+			break;
+		}
+		case BM_EV_PATCH: {
+			// select the bank that the reader will look the patch up in, if it isn't already
+			int chan = ev->u.patch.channel;
+			int patch = ev->u.patch.patch;
+			uint32_t bank = 0x110000 | (patch < 256 ? 0x7900 : 0x7800) |
+				(patch_midi[patch] & 0xFF);
+			if (w->device.ctrls[chan].bank != bank){
+				writer_ctrl(w, chan, 0x00, (bank >> 8) & 0x7F);
+				writer_dt(w, 0);
+				writer_ctrl(w, chan, 0x20, bank & 0x7F);
+				writer_dt(w, 0);
+				w->device.ctrls[chan].bank = bank;
+			}
+			writer_msg(w, 0xC0 | chan, patch_midi[patch] >> 8, 0, false);
+			break;
+		}
+		case BM_EV_BEND: {
+			int v = ev->u.bend.bend + 0x2000;
+			writer_msg(w, 0xE0 | ev->u.bend.channel, v & 0x7F, (v >> 7) & 0x7F, true);
+			break;
+		}
+		case BM_EV_MOD: {
+			int chan = ev->u.mod.channel;
+			int v = ev->u.mod.mod;
+			writer_ctrl(w, chan, 0x01, v >> 7);
+			if (v & 0x7F){
+				writer_dt(w, 0);
+				writer_ctrl(w, chan, 0x21, v & 0x7F);
+			}
+			break;
+		}
+	}
+}
+
+static void writer_end(writer_st *w){
+	writer_dt(w, w->pending_dt);
+	w->pending_dt = 0;
+	static const uint8_t end_of_track[3] = { 0xFF, 0x2F, 0x00 };
+	writer_bytes(w, end_of_track, 3);
+	writer_flush(w);
+}
+
+static bool writer_mthd(bm_dump_f f_dump, void *user, int format, int tracks, int divisor){
+	// a missing or SMPTE divisor can't be written, so fall back to a common one
+	if (divisor <= 0 || divisor >= 0x8000)
+		divisor = 480;
+	uint8_t hdr[14] = {
+		'M', 'T', 'h', 'd', 0, 0, 0, 6,
+		0, format,
+		tracks >> 8, tracks & 0xFF,
+		divisor >> 8, divisor & 0xFF
+	};
+	return dump_all(f_dump, user, hdr, 1, sizeof(hdr));
+}
+
+static bool writer_mtrk(bm_dump_f f_dump, void *user, int track_size){
+	uint8_t hdr[8] = {
+		'M', 'T', 'r', 'k',
+		track_size >> 24, (track_size >> 16) & 0xFF, (track_size >> 8) & 0xFF, track_size & 0xFF
+	};
+	return dump_all(f_dump, user, hdr, 1, sizeof(hdr));
+}
+
+// the header of a format 0 file, followed by the header of its one track
+static bool writer_header(bm_dump_f f_dump, void *user, int divisor, int track_size){
+	return writer_mthd(f_dump, user, 0, 1, divisor) && writer_mtrk(f_dump, user, track_size);
+}
+
+bool bm_writemidi(const bm_delta_ev_st *events, int size, bm_dump_f f_dump, void *user){
+	writer_st w;
+	writer_init(&w, NULL, NULL);
+	for (int i = 0; i < size; i++)
+		writer_event(&w, events[i]);
+	writer_end(&w);
+	if (!writer_header(f_dump, user, w.divisor, w.size))
+		return false;
+	writer_init(&w, f_dump, user);
+	for (int i = 0; i < size; i++)
+		writer_event(&w, events[i]);
+	writer_end(&w);
+	return w.ok;
+}
+
+//
+// stream mixing
+//
+
+void bm_mixsource_smf(bm_mixsource_st *src, const uint8_t *data, int size){
+	src->data = data;
+	src->size = size;
+	src->events = NULL;
+	src->events_size = 0;
+	src->offset = 0;
+	for (int i = 0; i < 16; i++)
+		src->channels[i] = i;
+}
+
+void bm_mixsource_events(bm_mixsource_st *src, const bm_delta_ev_st *events, int size){
+	bm_mixsource_smf(src, NULL, 0);
+	src->events = events;
+	src->events_size = size;
+}
+
+// true for the types between BM_EV_NOTEON and BM_EV_MOD, which keep a channel in bm_packed_ev_st
+static inline bool channel_type(int type){
+	return type >= BM_EV_NOTEON && type <= BM_EV_MOD;
+}
+
+static inline uint8_t *ev_channel(bm_ev_st *ev){
+	switch (ev->type){
+		case BM_EV_NOTEON  : return &ev->u.noteon.channel;
+		case BM_EV_NOTEOFF : return &ev->u.noteoff.channel;
+		case BM_EV_PEDALON : return &ev->u.pedalon.channel;
+		case BM_EV_PEDALOFF: return &ev->u.pedaloff.channel;
+		case BM_EV_CHANVOL : return &ev->u.chanvol.channel;
+		case BM_EV_CHANPAN : return &ev->u.chanpan.channel;
+		case BM_EV_PATCH   : return &ev->u.patch.channel;
+		case BM_EV_BEND    : return &ev->u.bend.channel;
+		case BM_EV_MOD     : return &ev->u.mod.channel;
+		default            : return NULL;
+	}
+}
+
+// reads the source's next event and calculates when it happens in output ticks
+static void mixsource_advance(bm_mix_st *mix, bm_mixsource_st *src){
+	bm_delta_ev_st dev;
+	if (src->data){
+		if (!bm_reader_next(&src->reader, &dev)){
+			src->done = true;
+			return;
+		}
+	}
+	else{
+		if (src->index >= src->events_size){
+			src->done = true;
+			return;
+		}
+		dev = src->events[src->index++];
+	}
+	src->tick += dev.delta;
+	src->ev = dev.ev;
+	uint64_t rel = src->tick - src->base_tick;
+	uint64_t out = src->base_out + (src->divisor > 0 ? rel * mix->divisor / src->divisor : rel);
+	if (dev.ev.type == BM_EV_RESET){
+		// ticks after a reset are scaled by the new divisor, starting from here
+		src->base_tick = src->tick;
+		src->base_out = out;
+		src->divisor = dev.ev.u.reset;
+	}
+	src->out_tick = src->offset + out;
+}
+
+static inline bool mix_less(const bm_mix_st *mix, int a, int b){
+	uint64_t ta = mix->sources[a].out_tick;
+	uint64_t tb = mix->sources[b].out_tick;
+	return ta < tb || (ta == tb && a < b);
+}
+
+static void mix_siftdown(bm_mix_st *mix, int i){
+	int *heap = mix->heap;
+	int n = mix->heap_size;
+	while (true){
+		int best = i;
+		int l = i * 2 + 1;
+		int r = l + 1;
+		if (l < n && mix_less(mix, heap[l], heap[best]))
+			best = l;
+		if (r < n && mix_less(mix, heap[r], heap[best]))
+			best = r;
+		if (best == i)
+			return;
+		int t = heap[i];
+		heap[i] = heap[best];
+		heap[best] = t;
+		i = best;
+	}
+}
+
+bool bm_mix_init(bm_mix_st *mix, bm_mixsource_st *sources, int sources_size, int divisor,
+	int tempo_source, bm_warn_f f_warn, void *user){
+	if (sources_size < 0 || sources_size > BM_MIX_MAX_SOURCES)
+		return false;
+	mix->sources = sources;
+	mix->sources_size = sources_size;
+	mix->divisor = divisor;
+	mix->tempo_source = tempo_source;
+	mix->tick = 0;
+	mix->started = false;
+	mix->heap_size = 0;
+	for (int i = 0; i < sources_size; i++){
+		bm_mixsource_st *src = &sources[i];
+		if (src->data)
+			bm_reader_init(&src->reader, src->data, src->size, f_warn, user);
+		src->index = 0;
+		src->done = false;
+		src->tick = 0;
+		src->base_tick = 0;
+		src->base_out = 0;
+		src->divisor = 0; // until a RESET, source ticks are taken as output ticks
+		mixsource_advance(mix, src);
+		// without a divisor, use the first source's
+		if (mix->divisor <= 0 && !src->done && src->ev.type == BM_EV_RESET){
+			mix->divisor = src->ev.u.reset;
+			src->out_tick = src->offset;
+		}
+		if (!src->done)
+			mix->heap[mix->heap_size++] = i;
+	}
+	if (mix->divisor <= 0)
+		mix->divisor = 480;
+	for (int i = mix->heap_size / 2 - 1; i >= 0; i--)
+		mix_siftdown(mix, i);
+	return true;
+}
+
+bool bm_mix_next(bm_mix_st *mix, bm_delta_ev_st *event_out){
+	if (!mix->started){
+		mix->started = true;
+		*event_out = (bm_delta_ev_st){
+			.delta = 0,
+			.ev = (bm_ev_st){
+				.type = BM_EV_RESET,
+				.u.reset = mix->divisor
+			}
+		};
+		return true;
+	}
+	while (mix->heap_size > 0){
+		int s = mix->heap[0];
+		bm_mixsource_st *src = &mix->sources[s];
+		bm_ev_st ev = src->ev;
+		uint64_t tick = src->out_tick;
+
+		// replace the source's event with its next one, and restore the heap
+		mixsource_advance(mix, src);
+		if (src->done)
+			mix->heap[0] = mix->heap[--mix->heap_size];
+		mix_siftdown(mix, 0);
+
+		// drop or remap the event; the time of dropped events is carried by the next delta
+		if (ev.type == BM_EV_RESET)
+			continue;
+		if (ev.type == BM_EV_TEMPO && mix->tempo_source >= 0 && mix->tempo_source != s)
+			continue;
+		uint8_t *chan = ev_channel(&ev);
+		if (chan){
+			int c = src->channels[*chan];
+			if (c < 0)
+				continue;
+			*chan = c & 0xF;
+		}
+		event_out->delta = tick - mix->tick;
+		event_out->ev = ev;
+		mix->tick = tick;
+		return true;
+	}
+	return false;
+}
+
+void bm_mix(bm_mixsource_st *sources, int sources_size, int divisor, int tempo_source,
+	bm_event_f f_event, bm_warn_f f_warn, void *user){
+	bm_mix_st mix;
+	if (!bm_mix_init(&mix, sources, sources_size, divisor, tempo_source, f_warn, user))
+		return;
+	bm_delta_ev_st ev;
+	while (bm_mix_next(&mix, &ev))
+		f_event(ev, user);
+}
+
+bool bm_mix_writemidi(bm_mixsource_st *sources, int sources_size, int divisor, int tempo_source,
+	bm_dump_f f_dump, bm_warn_f f_warn, void *user){
+	// the mix is run twice like bm_writemidi's event array, instead of being stored in between;
+	// warnings are only reported during the first run
+	bm_mix_st mix;
+	writer_st w;
+	bm_delta_ev_st ev;
+	if (!bm_mix_init(&mix, sources, sources_size, divisor, tempo_source, f_warn, user))
+		return false;
+	writer_init(&w, NULL, NULL);
+	while (bm_mix_next(&mix, &ev))
+		writer_event(&w, ev);
+	writer_end(&w);
+	if (!writer_header(f_dump, user, w.divisor, w.size))
+		return false;
+	bm_mix_init(&mix, sources, sources_size, divisor, tempo_source, NULL, NULL);
+	writer_init(&w, f_dump, user);
+	while (bm_mix_next(&mix, &ev))
+		writer_event(&w, ev);
+	writer_end(&w);
+	return w.ok;
+}
+
+//
+// coalescing
+//
+
+void bm_coalesce_init(bm_coalesce_st *co, bm_event_f f_event, void *user){
+	for (int t = 0; t < BM_EV_TYPES; t++){
+		co->modes[t] = t == BM_EV_RESET || t == BM_EV_NOTEON || t == BM_EV_NOTEOFF ||
+			t == BM_EV_META || t == BM_EV_SYSEX ? 0 : BM_COALESCE_UNCHANGED | BM_COALESCE_BURST;
+		co->removed[t] = 0;
+	}
+	co->f_event = f_event;
+	co->user = user;
+	bm_init(&co->state);
+	co->pending_dt = 0;
+	co->buf_size = 0;
+}
+
+// returns true if applying the event would change the state
+static bool ev_changes(const bm_state_st *state, const bm_ev_st *ev){
+	switch (ev->type){
+		case BM_EV_RESET:
+			return true;
+		case BM_EV_TEMPO:
+			return state->tempo != ev->u.tempo;
+		case BM_EV_MASTVOL:
+			return state->mastvol != ev->u.mastvol;
+		case BM_EV_MASTPAN:
+			return (int16_t)state->mastpan != ev->u.mastpan; // the state keeps it unsigned
+		case BM_EV_NOTEON: {
+			const struct bm_state_note_struct *n =
+				&state->channels[ev->u.noteon.channel].notes[ev->u.noteon.note];
+			return !n->down || n->velocity != ev->u.noteon.velocity;
+		}
+		case BM_EV_NOTEOFF:
+			return state->channels[ev->u.noteoff.channel].notes[ev->u.noteoff.note].down;
+		case BM_EV_PEDALON:
+			return !state->channels[ev->u.pedalon.channel].pedals[ev->u.pedalon.pedal];
+		case BM_EV_PEDALOFF:
+			return state->channels[ev->u.pedaloff.channel].pedals[ev->u.pedaloff.pedal];
+		case BM_EV_CHANVOL:
+			return state->channels[ev->u.chanvol.channel].vol != ev->u.chanvol.vol;
+		case BM_EV_CHANPAN:
+			return state->channels[ev->u.chanpan.channel].pan != ev->u.chanpan.pan;
+		case BM_EV_PATCH:
+			return state->channels[ev->u.patch.channel].patch != ev->u.patch.patch;
+		case BM_EV_BEND:
+			return state->channels[ev->u.bend.channel].bend != ev->u.bend.bend;
+		case BM_EV_MOD:
+			return state->channels[ev->u.mod.channel].mod != ev->u.mod.mod;
+		case BM_EV_META:
+		case BM_EV_SYSEX:
+			return true;
+	}
+	return true;
+}
+
+// identifies the controller an event sets, so later events in a burst can replace earlier ones;
+// PEDALON and PEDALOFF share a key, since they set the same pedal, but only replace events of their
+// own type, so a release and re-catch of a pedal within a tick is kept
+static inline int burst_key(const bm_ev_st *ev){
+	int type = ev->type == BM_EV_PEDALOFF ? BM_EV_PEDALON : ev->type;
+	int pedal = 0;
+	if (ev->type == BM_EV_PEDALON)
+		pedal = ev->u.pedalon.pedal;
+	else if (ev->type == BM_EV_PEDALOFF)
+		pedal = ev->u.pedaloff.pedal;
+	uint8_t *chan = ev_channel((bm_ev_st *)ev);
+	return (type * 16 + (chan ? *chan : 0)) * 6 + pedal;
+}
+
+// sends the buffered burst downstream, skipping events replaced later in the burst, and events
+// that don't change the state
+static void coalesce_flush(bm_coalesce_st *co){
+	bool replaced[BM_COALESCE_BUFFER];
+	int keys[BM_COALESCE_BUFFER];
+	// type + 1 of the next event for each key, or 0 if there isn't one; only the entries for keys
+	// in the buffer are cleared
+	uint8_t next[BM_EV_TYPES * 16 * 6];
+	for (int i = 0; i < co->buf_size; i++){
+		const bm_ev_st *ev = &co->buf[i].ev;
+		keys[i] = (co->modes[ev->type] & BM_COALESCE_BURST) ? burst_key(ev) : -1;
+		if (keys[i] >= 0)
+			next[keys[i]] = 0;
+	}
+	for (int i = co->buf_size - 1; i >= 0; i--){
+		replaced[i] = keys[i] >= 0 && next[keys[i]] == co->buf[i].ev.type + 1;
+		if (keys[i] >= 0)
+			next[keys[i]] = co->buf[i].ev.type + 1;
+	}
+	for (int i = 0; i < co->buf_size; i++){
+		bm_delta_ev_st dev = co->buf[i];
+		co->pending_dt += dev.delta;
+		if (replaced[i] || ((co->modes[dev.ev.type] & BM_COALESCE_UNCHANGED) &&
+			!ev_changes(&co->state, &dev.ev))){
+			co->removed[dev.ev.type]++;
+			continue;
+		}
+		bm_update(&co->state, &dev.ev, 1);
+		dev.delta = co->pending_dt;
+		co->pending_dt = 0;
+		co->f_event(dev, co->user);
+	}
+	co->buf_size = 0;
+}
+
+void bm_coalesce_event(bm_delta_ev_st event, void *user){
+	bm_coalesce_st *co = user;
+	// a burst ends when time moves forward, and at any event that isn't coalesced in bursts, like
+	// notes and RESET, since controllers set around a note change how the note sounds
+	if (co->buf_size > 0 && (event.delta > 0 || co->buf_size >= BM_COALESCE_BUFFER ||
+		!(co->modes[event.ev.type] & BM_COALESCE_BURST) ||
+		!(co->modes[co->buf[co->buf_size - 1].ev.type] & BM_COALESCE_BURST)))
+		coalesce_flush(co);
+	co->buf[co->buf_size++] = event;
+}
+
+uint64_t bm_coalesce_finish(bm_coalesce_st *co){
+	coalesce_flush(co);
+	uint64_t total = 0;
+	for (int t = 0; t < BM_EV_TYPES; t++)
+		total += co->removed[t];
+	return total;
+}
+
+//
+// batch transforms
+//
+
+void bm_xf_transpose(bm_xf_batch_st *batch, int semitones){
+	int n = batch->size;
+	for (int i = 0; i < n; i++){
+		// NOTEON and NOTEOFF both keep the note in the low byte
+		int note = (batch->data[i] & 0xFF) + semitones;
+		note = note < 0 ? 0 : note > 127 ? 127 : note;
+		uint16_t moved = (batch->data[i] & 0xFF00) | note;
+		bool is_note = batch->type[i] == BM_EV_NOTEON || batch->type[i] == BM_EV_NOTEOFF;
+		batch->data[i] = is_note ? moved : batch->data[i];
+	}
+}
+
+void bm_xf_velcurve(bm_xf_batch_st *batch, const uint8_t velcurve[128]){
+	uint8_t curve[128];
+	for (int v = 0; v < 128; v++)
+		curve[v] = velcurve[v] < 1 ? 1 : velcurve[v] > 127 ? 127 : velcurve[v];
+	int n = batch->size;
+	for (int i = 0; i < n; i++){
+		if (batch->type[i] == BM_EV_NOTEON)
+			batch->data[i] = (batch->data[i] & 0xFF) | (curve[(batch->data[i] >> 8) & 0x7F] << 8);
+	}
+}
+
+void bm_xf_quantize(bm_xf_batch_st *batch, uint32_t grid, int strength){
+	if (grid == 0 || strength <= 0)
+		return;
+	if (strength > 100)
+		strength = 100;
+	int n = batch->size;
+	for (int i = 0; i < n; i++){
+		uint64_t t = batch->tick[i];
+		uint64_t q = (t + grid / 2) / grid * grid;
+		// both terms only grow with t, so the result keeps events in order
+		batch->tick[i] = (t * (100 - strength) + q * strength) / 100;
+	}
+}
+
+void bm_xf_chanmap(bm_xf_batch_st *batch, const int8_t chanmap[16]){
+	int n = batch->size;
+	for (int i = 0; i < n; i++){
+		// only channel events use the channel field; TEMPO and slices keep their high byte there
+		if (!channel_type(batch->type[i]))
+			continue;
+		int c = chanmap[batch->channel[i] & 0xF];
+		if (c < 0)
+			batch->type[i] = BM_XF_DROPPED;
+		else
+			batch->channel[i] = c & 0xF;
+	}
+}
+
+void bm_xf_apply(bm_xf_batch_st *batch, const bm_xf_st *stages, int stages_size){
+	for (int s = 0; s < stages_size; s++){
+		const bm_xf_st *st = &stages[s];
+		switch (st->type){
+			case BM_XF_TRANSPOSE:
+				bm_xf_transpose(batch, st->u.transpose);
+				break;
+			case BM_XF_VELCURVE:
+				bm_xf_velcurve(batch, st->u.velcurve);
+				break;
+			case BM_XF_QUANTIZE:
+				bm_xf_quantize(batch, st->u.quantize.grid, st->u.quantize.strength);
+				break;
+			case BM_XF_CHANMAP:
+				bm_xf_chanmap(batch, st->u.chanmap);
+				break;
+		}
+	}
+}
+
+static inline void xf_push(bm_xf_batch_st *batch, uint32_t tick, bm_delta_ev_st dev){
+	bm_packed_ev_st pk = bm_pack(dev);
+	int i = batch->size++;
+	batch->tick[i] = tick;
+	batch->type[i] = pk.type;
+	batch->channel[i] = pk.channel;
+	batch->data[i] = pk.data;
+}
+
+// returns the event at index i, with its delta from *tick, which is then moved to the event
+static inline bm_delta_ev_st xf_event(const bm_xf_batch_st *batch, int i, uint32_t *tick){
+	bm_packed_ev_st pk = {
+		batch->tick[i] - *tick, batch->type[i], batch->channel[i], batch->data[i]
+	};
+	*tick = batch->tick[i];
+	return bm_unpack(pk);
+}
+
+int bm_xf_events(bm_delta_ev_st *events, int size, const bm_xf_st *stages, int stages_size,
+	const bm_allocator_st *alloc){
+	bm_allocator_st a = allocator(alloc);
+	bm_xf_batch_st *batch = a.f_alloc(sizeof(bm_xf_batch_st), a.user);
+	if (batch == NULL)
+		return -1;
+	uint32_t in_tick = 0;
+	uint32_t out_tick = 0;
+	int out = 0;
+	for (int start = 0; start < size; start += BM_XF_BATCH){
+		int end = start + BM_XF_BATCH < size ? start + BM_XF_BATCH : size;
+		batch->size = 0;
+		for (int i = start; i < end; i++){
+			in_tick += events[i].delta;
+			xf_push(batch, in_tick, events[i]);
+		}
+		bm_xf_apply(batch, stages, stages_size);
+		// events are only ever removed, so writing back never overtakes reading
+		for (int i = 0; i < batch->size; i++){
+			if (batch->type[i] != BM_XF_DROPPED)
+				events[out++] = xf_event(batch, i, &out_tick);
+		}
+	}
+	a.f_free(batch, sizeof(bm_xf_batch_st), a.user);
+	return out;
+}
+
+typedef struct {
+	const bm_allocator_st *alloc;
+	uint8_t *data;
+	size_t size;
+	size_t count;
+} membuf_st;
+
+static size_t membuf_dump(const void *restrict ptr, size_t size, size_t nitems,
+	void *restrict user){
+	membuf_st *mb = user;
+	size_t total = size * nitems;
+	if (mb->size + total > mb->count){
+		size_t count = mb->count < 4096 ? 4096 : mb->count;
+		while (count < mb->size + total)
+			count *= 2;
+		uint8_t *data = mb->alloc->f_realloc(mb->data, mb->count, count, mb->alloc->user);
+		if (data == NULL)
+			return 0;
+		mb->data = data;
+		mb->count = count;
+	}
+	memcpy(&mb->data[mb->size], ptr, total);
+	mb->size += total;
+	return nitems;
+}
+
+bool bm_xf_writemidi(const uint8_t *data, int size, const bm_xf_st *stages, int stages_size,
+	const bm_allocator_st *alloc, bm_dump_f f_dump, bm_warn_f f_warn, void *user){
+	bm_allocator_st a = allocator(alloc);
+	bm_reader_st *rd = a.f_alloc(sizeof(bm_reader_st), a.user);
+	bm_xf_batch_st *batch = a.f_alloc(sizeof(bm_xf_batch_st), a.user);
+	writer_st *w = a.f_alloc(sizeof(writer_st), a.user);
+	membuf_st track = { .alloc = &a, .data = NULL, .size = 0, .count = 0 };
+	bool ok = rd && batch && w;
+	if (ok){
+		bm_reader_init(rd, data, size, f_warn, user);
+		writer_init(w, membuf_dump, &track);
+		uint32_t in_tick = 0;
+		uint32_t out_tick = 0;
+		bm_delta_ev_st dev;
+		bool more = true;
+		while (more){
+			batch->size = 0;
+			while (batch->size < BM_XF_BATCH && (more = bm_reader_next(rd, &dev))){
+				in_tick += dev.delta;
+				xf_push(batch, in_tick, dev);
+			}
+			bm_xf_apply(batch, stages, stages_size);
+			for (int i = 0; i < batch->size; i++){
+				if (batch->type[i] != BM_XF_DROPPED)
+					writer_event(w, xf_event(batch, i, &out_tick));
+			}
+		}
+		writer_end(w);
+		ok = w->ok &&
+			writer_header(f_dump, user, w->divisor, w->size) &&
+			dump_all(f_dump, user, track.data, 1, track.size);
+	}
+	// freed in reverse, so an arena can reclaim everything
+	if (track.data)
+		a.f_free(track.data, track.count, a.user);
+	if (w)
+		a.f_free(w, sizeof(writer_st), a.user);
+	if (batch)
+		a.f_free(batch, sizeof(bm_xf_batch_st), a.user);
+	if (rd)
+		a.f_free(rd, sizeof(bm_reader_st), a.user);
+	return ok;
+}
+
+//
+// fingerprinting
+//
+
+// times are hashed in 1/960ths of a beat, so files with different divisors line up
+#define FINGERPRINT_BEAT 960
+
+static inline uint64_t mix64(uint64_t x){
+	x ^= x >> 30;
+	x *= UINT64_C(0xBF58476D1CE4E5B9);
+	x ^= x >> 27;
+	x *= UINT64_C(0x94D049BB133111EB);
+	x ^= x >> 31;
+	return x;
+}
+
+static inline uint32_t mix32(uint32_t x){
+	x ^= x >> 16;
+	x *= 0x85EBCA6B;
+	x ^= x >> 13;
+	x *= 0xC2B2AE35;
+	x ^= x >> 16;
+	return x;
+}
+
+static void fingerprint_group_reset(bm_fingerprint_st *fp){
+	fp->group_size = 0;
+	fp->group_notes = 0;
+	fp->group_top = -1;
+	fp->group_low = 128;
+	fp->group_hash = 0;
+}
+
+void bm_fingerprint_init(bm_fingerprint_st *fp){
+	fp->exact = 0;
+	for (int k = 0; k < BM_FINGERPRINT_SIZE; k++)
+		fp->minhash[k] = UINT32_MAX;
+	fp->ngrams = 0;
+	fp->tick = 0;
+	fp->base_tick = 0;
+	fp->base_beat = 0;
+	fp->divisor = 0;
+	fp->ref_note = -1;
+	fp->group_beat = 0;
+	fp->last_beat = 0;
+	fp->onsets = 0;
+	fingerprint_group_reset(fp);
+}
+
+// returns round(4 * log2(b / a)) clamped to -12..12, by comparing against the bounds between
+// buckets, which are 2^((k + 0.5) / 4) in 16.16 fixed point
+static int gap_ratio(uint64_t a, uint64_t b){
+	static const uint32_t bounds[12] = {
+		71468, 84990, 101070, 120194, 142935, 169979,
+		202141, 240387, 285870, 339959, 404281, 480774
+	};
+	// gaps are at least 1, and capped so the products below can't overflow
+	a = a < 1 ? 1 : a > UINT32_MAX ? UINT32_MAX : a;
+	b = b < 1 ? 1 : b > UINT32_MAX ? UINT32_MAX : b;
+	int sign = 1;
+	if (b < a){
+		uint64_t t = a;
+		a = b;
+		b = t;
+		sign = -1;
+	}
+	int r = 0;
+	while (r < 12 && (b << 16) >= a * bounds[r])
+		r++;
+	return sign * r;
+}
+
+// records an onset, and once there are enough of them, adds the n-gram ending here to the
+// signature
+static void fingerprint_onset(bm_fingerprint_st *fp, int top, uint64_t beat){
+	const int n = BM_FINGERPRINT_NGRAM;
+	fp->onset_top[fp->onsets % n] = top;
+	fp->onset_beat[fp->onsets % n] = beat;
+	fp->onsets++;
+	if (fp->onsets < n)
+		return;
+	// onsets - n is the oldest onset in the ring
+	uint64_t key = 0;
+	for (int i = 1; i < n; i++){
+		int interval = fp->onset_top[(fp->onsets + i) % n] - fp->onset_top[(fp->onsets + i - 1) % n];
+		interval = interval < -24 ? -24 : interval > 24 ? 24 : interval;
+		key = (key << 6) | (interval + 24);
+	}
+	for (int i = 2; i < n; i++){
+		uint64_t gap1 = fp->onset_beat[(fp->onsets + i - 1) % n] -
+			fp->onset_beat[(fp->onsets + i - 2) % n];
+		uint64_t gap2 = fp->onset_beat[(fp->onsets + i) % n] -
+			fp->onset_beat[(fp->onsets + i - 1) % n];
+		key = (key << 5) | (gap_ratio(gap1, gap2) + 12);
+	}
+	// one permutation hashing: the hash picks one entry, which keeps the smallest value it sees,
+	// so each n-gram costs one hash instead of one per entry
+	uint64_t h = mix64(key);
+	int k = (int)(h >> 58) % BM_FINGERPRINT_SIZE;
+	uint32_t v = (uint32_t)h >> 1; // always below UINT32_MAX, which marks empty entries
+	if (v < fp->minhash[k])
+		fp->minhash[k] = v;
+	fp->ngrams++;
+}
+
+// hashes the held notes of the current tick; they're summed, so their order doesn't matter
+static void fingerprint_flush(bm_fingerprint_st *fp){
+	if (fp->ref_note < 0 && fp->group_low < 128)
+		fp->ref_note = fp->group_low;
+	for (int i = 0; i < fp->group_size; i++){
+		uint16_t e = fp->group[i];
+		bool drum = e & 0x4000;
+		int note = e & 0x7F;
+		if (!drum){
+			if (fp->ref_note < 0)
+				continue; // released before any pitch was struck
+			note = note - fp->ref_note + 128;
+		}
+		fp->group_hash += mix64((uint64_t)note | ((uint64_t)(e >> 7) << 8));
+		fp->group_notes++;
+	}
+	fp->group_size = 0;
+}
+
+// finishes the current tick, adding its notes to the exact hash and its onset to the n-grams
+static void fingerprint_tick(bm_fingerprint_st *fp){
+	fingerprint_flush(fp);
+	if (fp->group_notes > 0){
+		fp->exact = mix64(fp->exact ^ (fp->group_beat - fp->last_beat));
+		fp->exact = mix64(fp->exact + fp->group_hash);
+		fp->last_beat = fp->group_beat;
+	}
+	if (fp->group_top >= 0)
+		fingerprint_onset(fp, fp->group_top, fp->group_beat);
+	fingerprint_group_reset(fp);
+}
+
+void bm_fingerprint_event(bm_delta_ev_st event, void *user){
+	bm_fingerprint_st *fp = user;
+	if (event.delta > 0){
+		fingerprint_tick(fp);
+		fp->tick += event.delta;
+	}
+	uint64_t rel = fp->tick - fp->base_tick;
+	fp->group_beat = fp->base_beat +
+		(fp->divisor > 0 ? rel * FINGERPRINT_BEAT / fp->divisor : rel);
+	bm_ev_st *ev = &event.ev;
+	int chan, note, vel;
+	switch (ev->type){
+		case BM_EV_RESET:
+			if (ev->u.reset > 0){
+				// later ticks are scaled by the new divisor, starting from here
+				fp->base_tick = fp->tick;
+				fp->base_beat = fp->group_beat;
+				fp->divisor = ev->u.reset;
+			}
+			return;
+		case BM_EV_NOTEON:
+			chan = ev->u.noteon.channel;
+			note = ev->u.noteon.note;
+			vel = ev->u.noteon.velocity;
+			break;
+		case BM_EV_NOTEOFF:
+			chan = ev->u.noteoff.channel;
+			note = ev->u.noteoff.note;
+			vel = 0;
+			break;
+		default:
+			return;
+	}
+	bool drum = chan == 9;
+	if (!drum && ev->type == BM_EV_NOTEON){
+		if (note > fp->group_top)
+			fp->group_top = note;
+		if (note < fp->group_low)
+			fp->group_low = note;
+	}
+	if (fp->group_size >= BM_FINGERPRINT_GROUP)
+		fingerprint_flush(fp);
+	fp->group[fp->group_size++] = note | (vel << 7) | (drum ? 0x4000 : 0) |
+		(ev->type == BM_EV_NOTEOFF ? 0x8000 : 0);
+}
+
+void bm_fingerprint_finish(bm_fingerprint_st *fp){
+	fingerprint_tick(fp);
+	if (fp->ngrams == 0)
+		return;
+	// entries that no n-gram landed in borrow from the next filled entry, mixed with the distance
+	// to it, so two songs with similar n-grams still tend to agree on them
+	uint32_t filled[BM_FINGERPRINT_SIZE];
+	memcpy(filled, fp->minhash, sizeof(filled));
+	for (int k = 0; k < BM_FINGERPRINT_SIZE; k++){
+		if (filled[k] != UINT32_MAX)
+			continue;
+		int d = 1;
+		while (filled[(k + d) % BM_FINGERPRINT_SIZE] == UINT32_MAX)
+			d++;
+		fp->minhash[k] = mix32(filled[(k + d) % BM_FINGERPRINT_SIZE] + (uint32_t)d);
+	}
+}
+
+void bm_readmidi_fingerprint(const uint8_t *data, int size, bm_fingerprint_st *fp_out,
+	bm_warn_f f_warn, void *user){
+	bm_reader_st reader;
+	bm_reader_init(&reader, data, size, f_warn, user);
+	bm_fingerprint_init(fp_out);
+	bm_delta_ev_st ev;
+	while (bm_reader_next(&reader, &ev))
+		bm_fingerprint_event(ev, fp_out);
+	bm_fingerprint_finish(fp_out);
+}
+
+int bm_fingerprint_compare(const bm_fingerprint_st *a, const bm_fingerprint_st *b){
+	if (a->ngrams == 0 || b->ngrams == 0)
+		return 0;
+	int same = 0;
+	for (int k = 0; k < BM_FINGERPRINT_SIZE; k++)
+		same += a->minhash[k] == b->minhash[k];
+	return same;
+}
+
+//
+// feature extraction
+//
+
+void bm_analyze_init(bm_analyze_st *an){
+	memset(an, 0, sizeof(bm_analyze_st));
+	bm_features_st *f = &an->features;
+	for (int chan = 0; chan < 16; chan++)
+		f->channels[chan].low = 127;
+	f->tempo_min = UINT32_MAX;
+	an->tempo = 500000;
+}
+
+// starts measuring from the current tick, so a new divisor or tempo only applies to later ticks
+static void analyze_segment(bm_analyze_st *an){
+	an->seg_tick = an->tick;
+	an->seg_time = an->time;
+	an->seg_usecs = an->features.usecs;
+}
+
+static void analyze_beat(bm_analyze_st *an){
+	int n = an->beat_notes;
+	an->features.density[n < BM_ANALYZE_DENSITY ? n : BM_ANALYZE_DENSITY - 1]++;
+	an->beat_notes = 0;
+}
+
+static void analyze_advance(bm_analyze_st *an, uint32_t delta){
+	bm_features_st *f = &an->features;
+	an->tick += delta;
+	uint64_t rel = an->tick - an->seg_tick;
+	uint64_t time = an->seg_time + (an->divisor > 0 ? rel * BM_ANALYZE_BEAT / an->divisor : rel);
+	f->usecs = an->seg_usecs + (an->divisor > 0 ? rel * an->tempo / an->divisor : 0);
+	uint64_t elapsed = time - an->time;
+	an->time = time;
+	if (elapsed == 0)
+		return;
+	f->polyphony[an->sounding < BM_ANALYZE_POLYPHONY ? an->sounding :
+		BM_ANALYZE_POLYPHONY - 1] += elapsed;
+	for (int chan = 0; chan < 16; chan++){
+		if (an->channel_sounding[chan] > 0)
+			f->channels[chan].active += elapsed;
+	}
+	if (an->tempo < f->tempo_min)
+		f->tempo_min = an->tempo;
+	if (an->tempo > f->tempo_max)
+		f->tempo_max = an->tempo;
+	uint64_t beat = time / BM_ANALYZE_BEAT;
+	if (beat > an->beat){
+		analyze_beat(an);
+		// beats skipped entirely had no notes
+		f->density[0] += beat - an->beat - 1;
+		an->beat = beat;
+	}
+}
+
+void bm_analyze_event(bm_delta_ev_st event, void *user){
+	bm_analyze_st *an = user;
+	bm_features_st *f = &an->features;
+	if (event.delta > 0)
+		analyze_advance(an, event.delta);
+	bm_ev_st *ev = &event.ev;
+	switch (ev->type){
+		case BM_EV_RESET:
+			analyze_segment(an);
+			if (ev->u.reset > 0)
+				an->divisor = ev->u.reset;
+			an->tempo = 500000;
+			memset(an->masks, 0, sizeof(an->masks));
+			memset(an->channel_sounding, 0, sizeof(an->channel_sounding));
+			an->sounding = 0;
+			break;
+		case BM_EV_TEMPO:
+			analyze_segment(an);
+			if (ev->u.tempo != an->tempo)
+				f->tempo_changes++;
+			an->tempo = ev->u.tempo;
+			break;
+		case BM_EV_NOTEON: {
+			int chan = ev->u.noteon.channel;
+			int note = ev->u.noteon.note;
+			f->notes++;
+			f->velocities[ev->u.noteon.velocity >> 3]++;
+			f->channels[chan].notes++;
+			if (note < f->channels[chan].low)
+				f->channels[chan].low = note;
+			if (note > f->channels[chan].high)
+				f->channels[chan].high = note;
+			if (chan != 9){
+				f->pitches[note]++;
+				f->pitch_classes[note % 12]++;
+			}
+			an->beat_notes++;
+			uint64_t bit = UINT64_C(1) << (note & 63);
+			if (!(an->masks[chan][note >> 6] & bit)){
+				an->masks[chan][note >> 6] |= bit;
+				an->channel_sounding[chan]++;
+				an->sounding++;
+			}
+			break;
+		}
+		case BM_EV_NOTEOFF: {
+			int chan = ev->u.noteoff.channel;
+			int note = ev->u.noteoff.note;
+			uint64_t bit = UINT64_C(1) << (note & 63);
+			if (an->masks[chan][note >> 6] & bit){
+				an->masks[chan][note >> 6] &= ~bit;
+				an->channel_sounding[chan]--;
+				an->sounding--;
+			}
+			break;
+		}
+		default:
+			break;
+	}
+}
+
+void bm_analyze_finish(bm_analyze_st *an){
+	bm_features_st *f = &an->features;
+	analyze_beat(an);
+	f->length = an->time;
+	if (f->tempo_min > f->tempo_max) // no time passed
+		f->tempo_min = f->tempo_max = an->tempo;
+}
+
+void bm_analyze(const uint8_t *data, int size, bm_features_st *features_out, bm_warn_f f_warn,
+	void *user){
+	bm_reader_st reader;
+	bm_analyze_st an;
+	bm_reader_init(&reader, data, size, f_warn, user);
+	bm_analyze_init(&an);
+	bm_delta_ev_st ev;
+	while (bm_reader_next(&reader, &ev))
+		bm_analyze_event(ev, &an);
+	bm_analyze_finish(&an);
+	*features_out = an.features;
+}
+
+//
+// histograms
+//
+
+void bm_histogram_init(bm_histogram_st *h){
+	memset(h, 0, sizeof(bm_histogram_st));
+	h->min = UINT64_MAX;
+}
+
+static inline int histogram_index(uint64_t value){
+	if (value < 8)
+		return (int)value;
+	int shift = 60 - __builtin_clzll(value); // keeps the top 4 bits
+	return (shift + 1) * 8 + (int)((value >> shift) & 7);
+}
+
+uint64_t bm_histogram_low(int index){
+	if (index < 8)
+		return index;
+	int shift = index / 8 - 1;
+	return (uint64_t)(8 + index % 8) << shift;
+}
+
+uint64_t bm_histogram_high(int index){
+	if (index < 8)
+		return index;
+	int shift = index / 8 - 1;
+	return bm_histogram_low(index) + ((UINT64_C(1) << shift) - 1);
+}
+
+void bm_histogram_record(bm_histogram_st *h, uint64_t value){
+	h->buckets[histogram_index(value)]++;
+	h->count++;
+	h->sum += value;
+	if (value < h->min)
+		h->min = value;
+	if (value > h->max)
+		h->max = value;
+}
+
+uint64_t bm_histogram_percentile(const bm_histogram_st *h, double percentile){
+	if (h->count == 0)
+		return 0;
+	uint64_t target = (uint64_t)(h->count * (percentile / 100.0) + 0.5);
+	if (target < 1)
+		target = 1;
+	uint64_t seen = 0;
+	for (int i = 0; i < BM_HISTOGRAM_BUCKETS; i++){
+		seen += h->buckets[i];
+		if (seen >= target){
+			uint64_t high = bm_histogram_high(i);
+			return high < h->max ? high : h->max;
+		}
+	}
+	return h->max;
+}
+
+// Newton's method, to avoid depending on libm for one square root
+static double histogram_sqrt(double v){
+	if (v <= 0)
+		return 0;
+	double r = v < 1 ? 1 : v;
+	for (int i = 0; i < 64; i++){
+		double next = (r + v / r) / 2;
+		if (next >= r)
+			break;
+		r = next;
+	}
+	return r;
+}
+
+// formats one line of text and sends it to f_dump
+static bool dump_line(bm_dump_f f_dump, void *user, const char *fmt, ...){
+	char buf[256];
+	va_list args;
+	va_start(args, fmt);
+	int len = vsnprintf(buf, sizeof(buf), fmt, args);
+	va_end(args);
+	if (len < 0 || len >= (int)sizeof(buf))
+		return false;
+	return dump_all(f_dump, user, buf, 1, len);
+}
+
+bool bm_histogram_dump(const bm_histogram_st *h, double scale, bm_dump_f f_dump, void *user){
+	if (scale <= 0)
+		scale = 1;
+	if (!dump_line(f_dump, user, "%12s %14s %10s %14s\n\n", "Value", "Percentile", "TotalCount",
+		"1/(1-Percentile)"))
+		return false;
+
+	// the standard deviation is estimated from the middle of each bucket
+	double mean = h->count ? (double)h->sum / h->count : 0;
+	double var = 0;
+	uint64_t seen = 0;
+	for (int i = 0; i < BM_HISTOGRAM_BUCKETS; i++){
+		if (h->buckets[i] == 0)
+			continue;
+		seen += h->buckets[i];
+		uint64_t high = bm_histogram_high(i);
+		if (high > h->max)
+			high = h->max;
+		uint64_t low = bm_histogram_low(i);
+		if (low < h->min)
+			low = h->min;
+		double mid = (low / 2.0 + high / 2.0) - mean;
+		var += mid * mid * h->buckets[i];
+		double p = (double)seen / h->count;
+		bool ok = seen < h->count ?
+			dump_line(f_dump, user, "%12.3f %2.12f %10llu %14.2f\n", high / scale, p,
+				(unsigned long long)seen, 1 / (1 - p)) :
+			dump_line(f_dump, user, "%12.3f %2.12f %10llu\n", high / scale, p,
+				(unsigned long long)seen);
+		if (!ok)
+			return false;
+	}
+	double stddev = h->count ? histogram_sqrt(var / h->count) : 0;
+	return
+		dump_line(f_dump, user, "#[Mean    = %12.3f, StdDeviation   = %12.3f]\n",
+			mean / scale, stddev / scale) &&
+		dump_line(f_dump, user, "#[Max     = %12.3f, Total count    = %12llu]\n",
+			h->max / scale, (unsigned long long)h->count) &&
+		dump_line(f_dump, user, "#[Buckets = %12d, SubBuckets     = %12d]\n",
+			BM_HISTOGRAM_BUCKETS / 8, 8);
+}
+
+//
+// playback
+//
+
+#if BM_PLAYBACK
+
+static inline uint64_t clock_ns(){
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + (uint64_t)ts.tv_nsec;
+}
+
+static void sleep_until(uint64_t ns){
+	struct timespec ts = { .tv_sec = ns / 1000000000, .tv_nsec = ns % 1000000000 };
+#if defined(_POSIX_TIMERS) && _POSIX_TIMERS > 0 && !defined(__APPLE__)
+	while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR);
+#else
+	// without absolute sleeps, sleep for the time remaining, which the spin makes up for
+	uint64_t now = clock_ns();
+	if (now >= ns)
+		return;
+	ts.tv_sec = (ns - now) / 1000000000;
+	ts.tv_nsec = (ns - now) % 1000000000;
+	nanosleep(&ts, NULL);
+#endif
+}
+
+void bm_player_init(bm_player_st *pl, bm_event_f f_sink, void *user){
+	bm_histogram_init(&pl->latency);
+	pl->spin_ns = BM_PLAYER_SPIN;
+	pl->f_sink = f_sink;
+	pl->user = user;
+	pl->started = false;
+	pl->start_ns = 0;
+	pl->tick = 0;
+	pl->seg_tick = 0;
+	pl->seg_ns = 0;
+	pl->divisor = 1;
+	pl->tempo = 500000;
+}
+
+void bm_player_event(bm_delta_ev_st event, void *user){
+	bm_player_st *pl = user;
+	if (!pl->started){
+		pl->started = true;
+		pl->start_ns = clock_ns();
+	}
+	pl->tick += event.delta;
+	// tempo is microseconds per quarter-note, and the divisor is ticks per quarter-note; the
+	// remainder is scaled separately so multiplying by 1000 can't overflow
+	uint64_t usecs = (uint64_t)(pl->tick - pl->seg_tick) * pl->tempo;
+	uint64_t rel_ns = pl->seg_ns + usecs / pl->divisor * 1000 +
+		usecs % pl->divisor * 1000 / pl->divisor;
+	uint64_t deadline = pl->start_ns + rel_ns;
+	uint64_t now = clock_ns();
+	if (now < deadline){
+		if (deadline - now > (uint64_t)pl->spin_ns)
+			sleep_until(deadline - pl->spin_ns);
+		while ((now = clock_ns()) < deadline);
+	}
+	bm_histogram_record(&pl->latency, now - deadline);
+	if (event.ev.type == BM_EV_RESET || event.ev.type == BM_EV_TEMPO){
+		// later ticks are timed from here
+		pl->seg_tick = pl->tick;
+		pl->seg_ns = rel_ns;
+		if (event.ev.type == BM_EV_TEMPO)
+			pl->tempo = event.ev.u.tempo;
+		else{
+			pl->tempo = 500000;
+			if (event.ev.u.reset > 0)
+				pl->divisor = event.ev.u.reset;
+		}
+	}
+	pl->f_sink(event, pl->user);
+}
+
+void bm_play(const uint8_t *data, int size, bm_player_st *pl, bm_warn_f f_warn, void *user){
+	bm_reader_st reader;
+	bm_reader_init(&reader, data, size, f_warn, user);
+	bm_delta_ev_st ev;
+	while (bm_reader_next(&reader, &ev))
+		bm_player_event(ev, pl);
+}
+
+void bm_wiresink_init(bm_wiresink_st *ws, bm_dump_f f_dump, void *user){
+	ws->ok = true;
+	ws->f_dump = f_dump;
+	ws->user = user;
+	ws->running_status = -1;
+	bm_deviceinit(&ws->device);
+}
+
+void bm_wiresink_event(bm_delta_ev_st event, void *user){
+	bm_wiresink_st *ws = user;
+	// only the writer's running status and controller state carry over between events
+	writer_st w;
+	writer_init(&w, ws->f_dump, ws->user);
+	w.live = true;
+	w.running_status = ws->running_status;
+	w.device = ws->device;
+	writer_event(&w, event);
+	writer_flush(&w);
+	ws->running_status = w.running_status;
+	ws->device = w.device;
+	if (!w.ok)
+		ws->ok = false;
+}
+
+#endif // BM_PLAYBACK
+
+//
+// archives
+//
+
+// probabilities are 11-bit fixed point, and move 1/32 of the way toward each coded bit
+#define RC_BITS 11
+#define RC_MOVE 5
+#define RC_TOP  (UINT32_C(1) << 24)
+
+static void archive_model_init(bm_archive_model_st *m){
+	uint16_t *p = (uint16_t *)&m->probs;
+	for (size_t i = 0; i < sizeof(m->probs) / sizeof(uint16_t); i++)
+		p[i] = 1 << (RC_BITS - 1);
+	m->last_delta = 0;
+	m->prev_type = BM_EV_RESET;
+	m->prev_channel = 0;
+	memset(m->last_note, 60, sizeof(m->last_note));
+	memset(m->last_velocity, 0, sizeof(m->last_velocity));
+	memset(m->last_value, 0, sizeof(m->last_value));
+}
+
+static inline uint32_t archive_checksum(uint32_t h, bm_packed_ev_st pk){
+	h = (h ^ pk.delta) * 16777619;
+	return (h ^ (pk.type | ((uint32_t)pk.channel << 8) | ((uint32_t)pk.data << 16))) * 16777619;
+}
+
+static inline void enc_byte(bm_archive_writer_st *aw, uint8_t b){
+	aw->buf[aw->buf_size++] = b;
+	aw->offset++;
+	if (aw->buf_size >= (int)sizeof(aw->buf)){
+		if (!dump_all(aw->f_dump, aw->user, aw->buf, 1, aw->buf_size))
+			aw->ok = false;
+		aw->buf_size = 0;
+	}
+}
+
+// moves the top byte of `low` out; a byte that could still be bumped by a carry is held back,
+// along with any 0xFF bytes after it, which a carry would roll over
+static void enc_shift(bm_archive_writer_st *aw){
+	if ((uint32_t)aw->low < UINT32_C(0xFF000000) || (aw->low >> 32) != 0){
+		uint8_t carry = (uint8_t)(aw->low >> 32);
+		if (aw->pending > 0){
+			enc_byte(aw, aw->cache + carry);
+			for (; aw->pending > 1; aw->pending--)
+				enc_byte(aw, 0xFF + carry);
+		}
+		aw->pending = 0;
+		aw->cache = (uint8_t)(aw->low >> 24);
+	}
+	aw->pending++;
+	aw->low = (aw->low & UINT32_C(0x00FFFFFF)) << 8;
+}
+
+static inline void enc_bit(bm_archive_writer_st *aw, uint16_t *p, uint32_t bit){
+	uint32_t bound = (aw->range >> RC_BITS) * *p;
+	if (bit){
+		aw->low += bound;
+		aw->range -= bound;
+		*p -= *p >> RC_MOVE;
+	}
+	else{
+		aw->range = bound;
+		*p += ((1 << RC_BITS) - *p) >> RC_MOVE;
+	}
+	while (aw->range < RC_TOP){
+		aw->range <<= 8;
+		enc_shift(aw);
+	}
+}
+
+// bits with even odds, which don't need a model
+static inline void enc_direct(bm_archive_writer_st *aw, uint32_t v, int bits){
+	for (int i = bits - 1; i >= 0; i--){
+		aw->range >>= 1;
+		if ((v >> i) & 1)
+			aw->low += aw->range;
+		while (aw->range < RC_TOP){
+			aw->range <<= 8;
+			enc_shift(aw);
+		}
+	}
+}
+
+// codes `bits` bits from the top down, with each bit's model picked by the bits above it
+static inline void enc_tree(bm_archive_writer_st *aw, uint16_t *probs, int bits, uint32_t v){
+	uint32_t node = 1;
+	for (int i = bits - 1; i >= 0; i--){
+		uint32_t bit = (v >> i) & 1;
+		enc_bit(aw, &probs[node], bit);
+		node = (node << 1) | bit;
+	}
+}
+
+static inline uint8_t dec_byte(bm_archive_reader_st *rd){
+	if (rd->pos < rd->size)
+		return rd->data[rd->pos++];
+	rd->overrun = true;
+	return 0;
+}
+
+static inline uint32_t dec_bit(bm_archive_reader_st *rd, uint16_t *p){
+	uint32_t bound = (rd->range >> RC_BITS) * *p;
+	uint32_t bit;
+	if (rd->code < bound){
+		rd->range = bound;
+		*p += ((1 << RC_BITS) - *p) >> RC_MOVE;
+		bit = 0;
+	}
+	else{
+		rd->code -= bound;
+		rd->range -= bound;
+		*p -= *p >> RC_MOVE;
+		bit = 1;
+	}
+	while (rd->range < RC_TOP){
+		rd->range <<= 8;
+		rd->code = (rd->code << 8) | dec_byte(rd);
+	}
+	return bit;
+}
+
+static inline uint32_t dec_direct(bm_archive_reader_st *rd, int bits){
+	uint32_t v = 0;
+	for (int i = 0; i < bits; i++){
+		rd->range >>= 1;
+		uint32_t bit = rd->code >= rd->range;
+		if (bit)
+			rd->code -= rd->range;
+		v = (v << 1) | bit;
+		while (rd->range < RC_TOP){
+			rd->range <<= 8;
+			rd->code = (rd->code << 8) | dec_byte(rd);
+		}
+	}
+	return v;
+}
+
+static inline uint32_t dec_tree(bm_archive_reader_st *rd, uint16_t *probs, int bits){
+	uint32_t node = 1;
+	for (int i = 0; i < bits; i++)
+		node = (node << 1) | dec_bit(rd, &probs[node]);
+	return node - (1 << bits);
+}
+
+// codes one event in either direction, so the writer and reader can't disagree on the format;
+// when encoding (aw set), every field is read from *pk, and when decoding (rd set), *pk is filled
+// in as each field is decoded, so values computed from *pk before then are unused
+#define CODE_BIT(p, bit)       (aw ? (enc_bit(aw, (p), (bit)), (bit)) : dec_bit(rd, (p)))
+#define CODE_DIRECT(v, bits)   (aw ? (enc_direct(aw, (v), (bits)), (v)) : dec_direct(rd, (bits)))
+#define CODE_TREE(p, bits, v)  (aw ? (enc_tree(aw, (p), (bits), (v)), (v)) : dec_tree(rd, (p), (bits)))
+
+static inline bool archive_code(bm_archive_writer_st *aw, bm_archive_reader_st *rd,
+	bm_packed_ev_st *pk){
+	bm_archive_model_st *m = aw ? &aw->model : &rd->model;
+
+	uint32_t type = CODE_TREE(m->probs.type[m->prev_type], 4, (uint32_t)pk->type);
+	if (type >= BM_EV_TYPES)
+		return false;
+	m->prev_type = type;
+	pk->type = type;
+
+	// deltas are a zero flag, a repeat flag, then a bit length and the bits below the top one, of
+	// which only the highest is modeled
+	uint32_t delta = 0;
+	if (CODE_BIT(&m->probs.delta_zero[type], (uint32_t)(pk->delta != 0))){
+		if (CODE_BIT(&m->probs.delta_repeat[type], (uint32_t)(pk->delta == m->last_delta)))
+			delta = m->last_delta;
+		else{
+			uint32_t bits = pk->delta ? 32 - __builtin_clz(pk->delta) : 0;
+			bits = CODE_TREE(m->probs.delta_bits[type], 6, bits);
+			if (bits < 1 || bits > 32)
+				return false;
+			delta = UINT32_C(1) << (bits - 1);
+			if (bits >= 2){
+				delta |= CODE_BIT(&m->probs.delta_high[bits],
+					(pk->delta >> (bits - 2)) & 1) << (bits - 2);
+			}
+			if (bits >= 3){
+				uint32_t mask = (UINT32_C(1) << (bits - 2)) - 1;
+				delta |= CODE_DIRECT(pk->delta & mask, (int)bits - 2);
+			}
+			m->last_delta = delta;
+		}
+	}
+	pk->delta = delta;
+
+	uint32_t channel = 0;
+	if (channel_type(type)){
+		channel = CODE_TREE(m->probs.channel[m->prev_channel], 4, (uint32_t)pk->channel);
+		m->prev_channel = channel;
+	}
+	else if (type == BM_EV_TEMPO || type == BM_EV_META || type == BM_EV_SYSEX)
+		channel = CODE_TREE(m->probs.tempo_high, 8, (uint32_t)pk->channel);
+	pk->channel = channel;
+
+	if (type == BM_EV_NOTEON){
+		uint32_t note = pk->data & 0x7F;
+		uint32_t vel = (pk->data >> 8) & 0x7F;
+		note = (m->last_note[channel] + CODE_TREE(m->probs.note_on, 7,
+			(note - m->last_note[channel]) & 0x7F)) & 0x7F;
+		if (CODE_BIT(&m->probs.velocity_same, (uint32_t)(vel == m->last_velocity[channel])))
+			vel = m->last_velocity[channel];
+		else
+			vel = CODE_TREE(m->probs.velocity, 7, vel);
+		m->last_note[channel] = note;
+		m->last_velocity[channel] = vel;
+		pk->data = note | (vel << 8);
+	}
+	else if (type == BM_EV_NOTEOFF){
+		uint32_t note = pk->data & 0x7F;
+		pk->data = (m->last_note[channel] + CODE_TREE(m->probs.note_off, 7,
+			(note - m->last_note[channel]) & 0x7F)) & 0x7F;
+	}
+	else{
+		// TEMPO and slices keep their top byte in place of a channel
+		uint16_t *last = &m->last_value[type][channel_type(type) ? channel : 0];
+		uint32_t diff = (pk->data - *last) & 0xFFFF;
+		uint32_t high = CODE_TREE(m->probs.value_high[type], 8, diff >> 8);
+		uint32_t low = CODE_TREE(m->probs.value_low[type], 8, diff & 0xFF);
+		*last = (uint16_t)(*last + ((high << 8) | low));
+		pk->data = *last;
+	}
+	return true;
+}
+
+#undef CODE_BIT
+#undef CODE_DIRECT
+#undef CODE_TREE
+
+static void archive_write(bm_archive_writer_st *aw, const void *data, size_t size){
+	const uint8_t *bytes = data;
+	for (size_t i = 0; i < size; i++)
+		enc_byte(aw, bytes[i]);
+}
+
+void bm_archive_writer_init(bm_archive_writer_st *aw, const bm_allocator_st *alloc,
+	bm_dump_f f_dump, void *user){
+	aw->ok = host_is_le();
+	aw->alloc = allocator(alloc);
+	aw->f_dump = f_dump;
+	aw->user = user;
+	aw->offset = 0;
+	aw->entries = NULL;
+	aw->entries_size = 0;
+	aw->entries_count = 0;
+	aw->names = NULL;
+	aw->names_size = 0;
+	aw->names_count = 0;
+	aw->buf_size = 0;
+	bm_archive_hdr_st hdr = {
+		.magic = BM_ARCHIVE_MAGIC,
+		.version = BM_ARCHIVE_VERSION,
+		.header_size = sizeof(bm_archive_hdr_st),
+		.reserved = 0
+	};
+	archive_write(aw, &hdr, sizeof(hdr));
+}
+
+void bm_archive_begin(bm_archive_writer_st *aw, const char *name, int source_size){
+	if (name == NULL)
+		name = "";
+	size_t len = strlen(name);
+	void *entries = aw->entries;
+	void *names = aw->names;
+	if (len >= (size_t)(INT32_MAX - aw->names_size) ||
+		!grow(&aw->alloc, &entries, &aw->entries_count, aw->entries_size,
+			sizeof(bm_archive_entry_st)))
+		aw->ok = false;
+	aw->entries = entries;
+	while (aw->ok && aw->names_size + (int)len + 1 > aw->names_count){
+		if (!grow(&aw->alloc, &names, &aw->names_count, aw->names_count, 1))
+			aw->ok = false;
+		aw->names = names;
+	}
+	if (!aw->ok)
+		return;
+
+	bm_archive_entry_st *e = &aw->entries[aw->entries_size];
+	e->offset = aw->offset;
+	e->size = 0;
+	e->events_size = 0;
+	e->name_offset = aw->names_size;
+	e->name_size = (uint32_t)len;
+	e->source_size = source_size > 0 ? source_size : 0;
+	e->checksum = 0;
+	memcpy(&aw->names[aw->names_size], name, len + 1);
+	aw->names_size += (int)len + 1;
+
+	archive_model_init(&aw->model);
+	aw->checksum = UINT32_C(2166136261);
+	aw->low = 0;
+	aw->range = UINT32_MAX;
+	aw->cache = 0;
+	aw->pending = 0;
+}
+
+void bm_archive_event(bm_delta_ev_st event, void *user){
+	bm_archive_writer_st *aw = user;
+	if (!aw->ok)
+		return;
+	bm_packed_ev_st pk = bm_pack(event);
+	archive_code(aw, NULL, &pk);
+	aw->checksum = archive_checksum(aw->checksum, pk);
+	aw->entries[aw->entries_size].events_size++;
+}
+
+void bm_archive_end(bm_archive_writer_st *aw){
+	if (!aw->ok)
+		return;
+	for (int i = 0; i < 5; i++)
+		enc_shift(aw);
+	bm_archive_entry_st *e = &aw->entries[aw->entries_size];
+	if (aw->offset - e->offset > UINT32_MAX){
+		aw->ok = false;
+		return;
+	}
+	e->size = (uint32_t)(aw->offset - e->offset);
+	e->checksum = aw->checksum;
+	aw->entries_size++;
+}
+
+bool bm_archive_add(bm_archive_writer_st *aw, const char *name, const uint8_t *data, int size,
+	bm_warn_f f_warn, void *user){
+	bm_archive_begin(aw, name, size);
+	bm_reader_st reader;
+	bm_reader_init(&reader, data, size, f_warn, user);
+	bm_delta_ev_st ev;
+	while (bm_reader_next(&reader, &ev))
+		bm_archive_event(ev, aw);
+	bm_archive_end(aw);
+	return aw->ok;
+}
+
+bool bm_archive_finish(bm_archive_writer_st *aw){
+	static const uint8_t zeros[8] = { 0 };
+	archive_write(aw, zeros, (8 - (aw->offset & 7)) & 7);
+	bm_archive_tail_st tail = {
+		.directory_offset = aw->offset,
+		.entries_size = aw->entries_size,
+		.names_size = aw->names_size,
+		.magic = BM_ARCHIVE_MAGIC,
+		.reserved = 0
+	};
+	archive_write(aw, aw->entries, sizeof(bm_archive_entry_st) * (size_t)aw->entries_size);
+	tail.names_offset = aw->offset;
+	archive_write(aw, aw->names, aw->names_size);
+	archive_write(aw, zeros, (8 - (aw->offset & 7)) & 7);
+	archive_write(aw, &tail, sizeof(tail));
+	if (aw->buf_size > 0 && !dump_all(aw->f_dump, aw->user, aw->buf, 1, aw->buf_size))
+		aw->ok = false;
+	aw->buf_size = 0;
+
+	aw->alloc.f_free(aw->names, aw->names_count, aw->alloc.user);
+	aw->alloc.f_free(aw->entries, sizeof(bm_archive_entry_st) * (size_t)aw->entries_count,
+		aw->alloc.user);
+	aw->entries = NULL;
+	aw->names = NULL;
+	aw->entries_size = aw->entries_count = 0;
+	aw->names_size = aw->names_count = 0;
+	return aw->ok;
+}
+
+bool bm_archive_open(bm_archive_st *ar, const void *data, size_t size){
+	const uint8_t *bytes = data;
+	if (!host_is_le() || size < sizeof(bm_archive_hdr_st) + sizeof(bm_archive_tail_st) ||
+		((uintptr_t)bytes & 7) != 0)
+		return false;
+	const bm_archive_hdr_st *hdr = data;
+	if (hdr->magic != BM_ARCHIVE_MAGIC || hdr->version != BM_ARCHIVE_VERSION ||
+		hdr->header_size != sizeof(bm_archive_hdr_st))
+		return false;
+
+	// validate that every section lives inside of the data, before the tail
+	uint64_t tail_offset = size - sizeof(bm_archive_tail_st);
+	if ((tail_offset & 7) != 0)
+		return false;
+	const bm_archive_tail_st *tail = (const bm_archive_tail_st *)&bytes[tail_offset];
+	uint64_t directory_end = tail->directory_offset +
+		(uint64_t)tail->entries_size * sizeof(bm_archive_entry_st);
+	if (tail->magic != BM_ARCHIVE_MAGIC ||
+		tail->directory_offset < sizeof(bm_archive_hdr_st) ||
+		tail->directory_offset > tail_offset || (tail->directory_offset & 7) != 0 ||
+		tail->entries_size > INT32_MAX || tail->names_offset < directory_end ||
+		tail->names_offset > tail_offset || tail->names_size > tail_offset - tail->names_offset)
+		return false;
+
+	ar->data = bytes;
+	ar->size = size;
+	ar->entries = (const bm_archive_entry_st *)&bytes[tail->directory_offset];
+	ar->names = (const char *)&bytes[tail->names_offset];
+	ar->entries_size = (int)tail->entries_size;
+	ar->names_size = tail->names_size;
+	ar->entries_end = tail->directory_offset;
+	return true;
+}
+
+const char *bm_archive_name(const bm_archive_st *ar, int index){
+	if (index < 0 || index >= ar->entries_size)
+		return NULL;
+	const bm_archive_entry_st *e = &ar->entries[index];
+	if (e->name_offset >= ar->names_size || e->name_size >= ar->names_size - e->name_offset ||
+		ar->names[e->name_offset + e->name_size] != 0)
+		return NULL;
+	return &ar->names[e->name_offset];
+}
+
+void bm_archive_reader_init(bm_archive_reader_st *rd, const bm_archive_st *ar, int index){
+	rd->ok = index >= 0 && index < ar->entries_size;
+	const bm_archive_entry_st *e = rd->ok ? &ar->entries[index] : NULL;
+	if (e && (e->offset < sizeof(bm_archive_hdr_st) || e->offset > ar->entries_end ||
+		e->size > ar->entries_end - e->offset))
+		rd->ok = false;
+	rd->data = e ? &ar->data[e->offset] : NULL;
+	rd->size = rd->ok ? e->size : 0;
+	rd->pos = 0;
+	rd->events_left = rd->ok ? e->events_size : 0;
+	rd->checksum = UINT32_C(2166136261);
+	rd->expect = rd->ok ? e->checksum : 0;
+	rd->overrun = false;
+	rd->range = UINT32_MAX;
+	rd->code = 0;
+	// the encoder never writes the first byte, since it's always 0
+	for (int i = 0; i < 4; i++)
+		rd->code = (rd->code << 8) | dec_byte(rd);
+	archive_model_init(&rd->model);
+}
+
+bool bm_archive_reader_next(bm_archive_reader_st *rd, bm_delta_ev_st *event_out){
+	if (rd->events_left == 0){
+		if (rd->overrun || rd->checksum != rd->expect)
+			rd->ok = false;
+		return false;
+	}
+	bm_packed_ev_st pk = { 0, 0, 0, 0 };
+	if (!archive_code(NULL, rd, &pk) || rd->overrun || !packed_valid(pk)){
+		rd->ok = false;
+		rd->events_left = 0;
+		return false;
+	}
+	rd->checksum = archive_checksum(rd->checksum, pk);
+	rd->events_left--;
+	*event_out = bm_unpack(pk);
+	return true;
+}
+
+bool bm_archive_read(const bm_archive_st *ar, int index, bm_event_f f_event, void *user){
+	bm_archive_reader_st rd;
+	bm_archive_reader_init(&rd, ar, index);
+	bm_delta_ev_st ev;
+	while (bm_archive_reader_next(&rd, &ev))
+		f_event(ev, user);
+	return rd.ok;
+}
+
+//
+// piano-roll pyramids
+//
+
+#define ROLL_MAX_LEVELS 32
+
+// adds coverage to a cell, stopping at 255
+static inline void roll_add(uint8_t *cell, uint32_t amount){
+	uint32_t v = *cell + amount;
+	*cell = v > 255 ? 255 : (uint8_t)v;
+}
+
+// averages pairs of columns into the level above, rounding up
+static void roll_halve(uint8_t *restrict dst, const uint8_t *restrict src, int width){
+	for (int i = 0; i < width; i++)
+		dst[i] = (uint8_t)((src[2 * i] + src[2 * i + 1] + 1) >> 1);
+}
+
+static inline bool roll_empty(const uint8_t *row){
+	uint8_t any = 0;
+	for (int i = 0; i < BM_ROLL_TILE; i++)
+		any |= row[i];
+	return any == 0;
+}
+
+bool bm_writeroll(const bm_note_st *notes, int size, uint32_t base_ticks,
+	const bm_allocator_st *alloc, bm_dump_f f_dump, void *user){
+	if (!host_is_le() || size < 0 || base_ticks == 0)
+		return false;
+	bm_allocator_st a = allocator(alloc);
+
+	// first pass finds the length of the song, and the keys each channel uses; zero-length notes
+	// sound for their starting tick
+	uint64_t end = 1;
+	int low[16];
+	int high[16];
+	for (int ch = 0; ch < 16; ch++){
+		low[ch] = 128;
+		high[ch] = -1;
+	}
+	for (int i = 0; i < size; i++){
+		const bm_note_st *n = &notes[i];
+		uint64_t e = (uint64_t)n->start + (n->duration > 0 ? n->duration : 1);
+		if (e > end)
+			end = e;
+		int ch = n->channel & 0xF;
+		int key = n->note & 0x7F;
+		if (key < low[ch])
+			low[ch] = key;
+		if (key > high[ch])
+			high[ch] = key;
+	}
+
+	// every level is rounded up to whole tiles, so tiles never need bounds checks
+	uint32_t columns[ROLL_MAX_LEVELS];
+	uint32_t tiles[ROLL_MAX_LEVELS];
+	size_t level_offset[ROLL_MAX_LEVELS];
+	int levels = 0;
+	uint64_t cols = (end + base_ticks - 1) / base_ticks;
+	if (cols > UINT32_MAX - BM_ROLL_TILE)
+		return false;
+	size_t pyramid = 0; // bytes per row across every level
+	while (true){
+		columns[levels] = (uint32_t)cols;
+		tiles[levels] = (uint32_t)((cols + BM_ROLL_TILE - 1) / BM_ROLL_TILE);
+		level_offset[levels] = pyramid;
+		pyramid += (size_t)tiles[levels] * BM_ROLL_TILE;
+		levels++;
+		if (cols <= BM_ROLL_TILE || levels >= ROLL_MAX_LEVELS)
+			break;
+		cols = (cols + 1) / 2;
+	}
+	size_t channel_offset[16];
+	size_t total = 0;
+	for (int ch = 0; ch < 16; ch++){
+		channel_offset[ch] = total;
+		if (high[ch] < 0)
+			continue;
+		size_t rows = (size_t)(high[ch] - low[ch] + 1);
+		if (pyramid > (SIZE_MAX - total) / rows)
+			return false;
+		total += rows * pyramid;
+	}
+	uint8_t *raster = a.f_alloc(total > 0 ? total : 1, a.user);
+	if (raster == NULL)
+		return false;
+	memset(raster, 0, total);
+	#define ROLL_ROW(ch, key, level) \
+		(&raster[channel_offset[ch] + (size_t)((key) - low[ch]) * pyramid + level_offset[level]])
+
+	// fill level 0 in one pass over the notes; columns a note covers completely are filled with
+	// memset, and only the partly covered columns at either end need arithmetic
+	for (int i = 0; i < size; i++){
+		const bm_note_st *n = &notes[i];
+		uint8_t *row = ROLL_ROW(n->channel & 0xF, n->note & 0x7F, 0);
+		uint64_t s = n->start;
+		uint64_t e = s + (n->duration > 0 ? n->duration : 1);
+		uint64_t c0 = s / base_ticks;
+		uint64_t c1 = (e - 1) / base_ticks;
+		#define ROLL_COVER(ticks) \
+			(uint32_t)(((uint64_t)(ticks) * 255 + base_ticks - 1) / base_ticks)
+		if (c0 == c1)
+			roll_add(&row[c0], ROLL_COVER(e - s));
+		else{
+			roll_add(&row[c0], ROLL_COVER((c0 + 1) * base_ticks - s));
+			if (c1 > c0 + 1)
+				memset(&row[c0 + 1], 255, c1 - c0 - 1);
+			roll_add(&row[c1], ROLL_COVER(e - c1 * base_ticks));
+		}
+		#undef ROLL_COVER
+	}
+	for (int ch = 0; ch < 16; ch++){
+		for (int key = low[ch]; key <= high[ch]; key++){
+			for (int lv = 1; lv < levels; lv++){
+				// the level below is a whole number of tiles, which might be less than twice
+				// this level's width; the rest stays zeroed
+				int width = (int)(tiles[lv - 1] * (BM_ROLL_TILE / 2));
+				if (width > (int)tiles[lv] * BM_ROLL_TILE)
+					width = (int)tiles[lv] * BM_ROLL_TILE;
+				roll_halve(ROLL_ROW(ch, key, lv), ROLL_ROW(ch, key, lv - 1), width);
+			}
+		}
+	}
+
+	// find the keys each tile uses, to lay out the index before any tiles are written
+	size_t tiles_total = 0;
+	for (int lv = 0; lv < levels; lv++)
+		tiles_total += (size_t)tiles[lv] * 16;
+	uint8_t *ranges = a.f_alloc(tiles_total * 2, a.user);
+	if (ranges == NULL){
+		a.f_free(raster, total > 0 ? total : 1, a.user);
+		return false;
+	}
+	uint64_t data_offset = sizeof(bm_roll_hdr_st) + sizeof(bm_roll_level_st) * (size_t)levels +
+		sizeof(uint32_t) * tiles_total;
+	uint64_t offset = data_offset;
+	size_t r = 0;
+	for (int lv = 0; lv < levels; lv++){
+		for (int ch = 0; ch < 16; ch++){
+			for (uint32_t t = 0; t < tiles[lv]; t++, r++){
+				int lo = 255;
+				int hi = 0;
+				for (int key = low[ch]; key <= high[ch]; key++){
+					if (roll_empty(ROLL_ROW(ch, key, lv) + (size_t)t * BM_ROLL_TILE))
+						continue;
+					if (lo == 255)
+						lo = key;
+					hi = key;
+				}
+				ranges[r * 2] = (uint8_t)lo;
+				ranges[r * 2 + 1] = (uint8_t)hi;
+				if (lo != 255)
+					offset += sizeof(bm_roll_tile_st) + (size_t)(hi - lo + 1) * BM_ROLL_TILE;
+			}
+		}
+	}
+	bool ok = offset <= UINT32_MAX;
+
+	bm_roll_hdr_st hdr = {
+		.magic = BM_ROLL_MAGIC,
+		.version = BM_ROLL_VERSION,
+		.header_size = sizeof(bm_roll_hdr_st),
+		.tile_width = BM_ROLL_TILE,
+		.base_ticks = base_ticks,
+		.columns = columns[0],
+		.levels = (uint32_t)levels,
+		.levels_offset = sizeof(bm_roll_hdr_st)
+	};
+	ok = ok && dump_all(f_dump, user, &hdr, sizeof(hdr), 1);
+	uint32_t index_offset = sizeof(bm_roll_hdr_st) + sizeof(bm_roll_level_st) * levels;
+	for (int lv = 0; lv < levels && ok; lv++){
+		bm_roll_level_st level = {
+			.columns = columns[lv],
+			.tiles = tiles[lv],
+			.index_offset = index_offset,
+			.reserved = 0
+		};
+		ok = dump_all(f_dump, user, &level, sizeof(level), 1);
+		index_offset += sizeof(uint32_t) * 16 * tiles[lv];
+	}
+	offset = data_offset;
+	for (r = 0; r < tiles_total && ok; r++){
+		uint32_t at = 0;
+		if (ranges[r * 2] != 255){
+			at = (uint32_t)offset;
+			offset += sizeof(bm_roll_tile_st) +
+				(size_t)(ranges[r * 2 + 1] - ranges[r * 2] + 1) * BM_ROLL_TILE;
+		}
+		ok = dump_all(f_dump, user, &at, sizeof(at), 1);
+	}
+	r = 0;
+	for (int lv = 0; lv < levels && ok; lv++){
+		for (int ch = 0; ch < 16 && ok; ch++){
+			for (uint32_t t = 0; t < tiles[lv] && ok; t++, r++){
+				if (ranges[r * 2] == 255)
+					continue;
+				bm_roll_tile_st tile = { .low = ranges[r * 2], .high = ranges[r * 2 + 1] };
+				ok = dump_all(f_dump, user, &tile, sizeof(tile), 1);
+				for (int key = tile.low; key <= tile.high && ok; key++){
+					ok = dump_all(f_dump, user, ROLL_ROW(ch, key, lv) +
+						(size_t)t * BM_ROLL_TILE, 1, BM_ROLL_TILE);
+				}
+			}
+		}
+	}
+	#undef ROLL_ROW
+	a.f_free(ranges, tiles_total * 2, a.user);
+	a.f_free(raster, total > 0 ? total : 1, a.user);
+	return ok;
+}
+
+bool bm_rollopen(bm_roll_st *roll, const void *data, int size){
+	const uint8_t *bytes = data;
+	if (!host_is_le() || size < (int)sizeof(bm_roll_hdr_st) || ((uintptr_t)bytes & 3) != 0)
+		return false;
+	const bm_roll_hdr_st *hdr = data;
+	if (hdr->magic != BM_ROLL_MAGIC || hdr->version != BM_ROLL_VERSION ||
+		hdr->header_size != sizeof(bm_roll_hdr_st) || hdr->tile_width != BM_ROLL_TILE ||
+		hdr->base_ticks == 0 || hdr->levels < 1 || hdr->levels > ROLL_MAX_LEVELS ||
+		(hdr->levels_offset & 3) != 0 || hdr->levels_offset < sizeof(bm_roll_hdr_st) ||
+		(uint64_t)hdr->levels_offset + sizeof(bm_roll_level_st) * hdr->levels > (uint64_t)size)
+		return false;
+
+	// validate that every index lives inside of the data; tiles are checked when they're used
+	const bm_roll_level_st *levels = (const bm_roll_level_st *)&bytes[hdr->levels_offset];
+	for (uint32_t lv = 0; lv < hdr->levels; lv++){
+		if ((levels[lv].index_offset & 3) != 0 || (uint64_t)levels[lv].index_offset +
+			(uint64_t)levels[lv].tiles * 16 * sizeof(uint32_t) > (uint64_t)size)
+			return false;
+	}
+	roll->hdr = hdr;
+	roll->levels = levels;
+	roll->data = bytes;
+	roll->size = size;
+	return true;
+}
+
+const uint8_t *bm_rolltile(const bm_roll_st *roll, int level, int channel, int tile,
+	int *low_out, int *high_out){
+	if (level < 0 || level >= (int)roll->hdr->levels || channel < 0 || channel >= 16 ||
+		tile < 0 || (uint32_t)tile >= roll->levels[level].tiles)
+		return NULL;
+	const bm_roll_level_st *lv = &roll->levels[level];
+	const uint32_t *index = (const uint32_t *)&roll->data[lv->index_offset];
+	uint32_t at = index[(size_t)channel * lv->tiles + tile];
+	if (at < sizeof(bm_roll_hdr_st) || (uint64_t)at + sizeof(bm_roll_tile_st) > (uint64_t)roll->size)
+		return NULL;
+	const bm_roll_tile_st *t = (const bm_roll_tile_st *)&roll->data[at];
+	if (t->low > t->high || t->high > 127 || (uint64_t)at + sizeof(bm_roll_tile_st) +
+		(uint64_t)(t->high - t->low + 1) * BM_ROLL_TILE > (uint64_t)roll->size)
+		return NULL;
+	*low_out = t->low;
+	*high_out = t->high;
+	return &roll->data[at + sizeof(bm_roll_tile_st)];
+}
+
+//
+// absolute-time writing
+//
+
+struct bm_abswriter_slot_struct {
+	uint32_t tick;
+	int track;
+	uint64_t seq;
+	bm_ev_st ev;
+};
+
+struct bm_abswriter_track_struct {
+	FILE *spool;
+	uint32_t tick;            // tick of the track's last event
+	writer_st w;
+};
+
+static size_t spool_dump(const void *restrict ptr, size_t size, size_t nitems,
+	void *restrict user){
+	return fwrite(ptr, size, nitems, user);
+}
+
+static inline bool slot_less(const struct bm_abswriter_slot_struct *a,
+	const struct bm_abswriter_slot_struct *b){
+	return a->tick < b->tick || (a->tick == b->tick && a->seq < b->seq);
+}
+
+bool bm_abswriter_init(bm_abswriter_st *aw, int divisor, int window, int split,
+	const bm_allocator_st *alloc, bm_dump_f f_dump, bm_warn_f f_warn, void *user){
+	aw->alloc = allocator(alloc);
+	aw->f_dump = f_dump;
+	aw->f_warn = f_warn;
+	aw->user = user;
+	aw->divisor = divisor;
+	aw->split = split;
+	aw->window = window > 0 ? window : 1;
+	aw->heap_size = 0;
+	aw->seq = 0;
+	aw->tick = 0;
+	for (int t = 0; t < BM_ABSWRITER_TRACKS; t++)
+		aw->tracks[t] = NULL;
+	aw->heap = aw->alloc.f_alloc(sizeof(struct bm_abswriter_slot_struct) * (size_t)aw->window,
+		aw->alloc.user);
+	aw->ok = aw->heap != NULL;
+	return aw->ok;
+}
+
+// sends the earliest held event to its track, starting the track if it's new
+static void abswriter_pop(bm_abswriter_st *aw){
+	struct bm_abswriter_slot_struct *heap = aw->heap;
+	struct bm_abswriter_slot_struct s = heap[0];
+	struct bm_abswriter_slot_struct last = heap[--aw->heap_size];
+	int i = 0;
+	while (true){
+		int c = i * 2 + 1;
+		if (c >= aw->heap_size)
+			break;
+		if (c + 1 < aw->heap_size && slot_less(&heap[c + 1], &heap[c]))
+			c++;
+		if (!slot_less(&heap[c], &last))
+			break;
+		heap[i] = heap[c];
+		i = c;
+	}
+	heap[i] = last;
+
+	if (!aw->ok)
+		return;
+	if (s.tick < aw->tick){
+		if (aw->f_warn)
+			aw->f_warn("Event arrived too late to be put in order", aw->user);
+		s.tick = aw->tick;
+	}
+	aw->tick = s.tick;
+	struct bm_abswriter_track_struct *t = aw->tracks[s.track];
+	if (t == NULL){
+		t = aw->alloc.f_alloc(sizeof(struct bm_abswriter_track_struct), aw->alloc.user);
+		if (t == NULL){
+			aw->ok = false;
+			return;
+		}
+		t->spool = tmpfile();
+		if (t->spool == NULL){
+			aw->alloc.f_free(t, sizeof(struct bm_abswriter_track_struct), aw->alloc.user);
+			aw->ok = false;
+			return;
+		}
+		t->tick = 0;
+		writer_init(&t->w, spool_dump, t->spool);
+		aw->tracks[s.track] = t;
+	}
+	writer_event(&t->w, (bm_delta_ev_st){ (int)(s.tick - t->tick), s.ev });
+	t->tick = s.tick;
+	if (!t->w.ok)
+		aw->ok = false;
+}
+
+void bm_abswriter_event(bm_abswriter_st *aw, uint32_t tick, bm_ev_st ev, int key){
+	// slices don't hold their data, so the writer would drop them anyway
+	if (!aw->ok || ev.type == BM_EV_RESET || (unsigned)ev.type > BM_EV_MOD)
+		return;
+	int track;
+	if (aw->split == BM_ABSWRITER_KEY){
+		if (key < 0 || key >= BM_ABSWRITER_TRACKS){
+			if (aw->f_warn)
+				aw->f_warn("Track key out of range, dropping event", aw->user);
+			return;
+		}
+		track = key;
+	}
+	else
+		track = channel_type(ev.type) ? bm_pack((bm_delta_ev_st){ 0, ev }).channel + 1 : 0;
+
+	if (aw->heap_size >= aw->window)
+		abswriter_pop(aw);
+	struct bm_abswriter_slot_struct *heap = aw->heap;
+	struct bm_abswriter_slot_struct s = { .tick = tick, .track = track, .seq = aw->seq++,
+		.ev = ev };
+	int i = aw->heap_size++;
+	while (i > 0 && slot_less(&s, &heap[(i - 1) / 2])){
+		heap[i] = heap[(i - 1) / 2];
+		i = (i - 1) / 2;
+	}
+	heap[i] = s;
+}
+
+bool bm_abswriter_finish(bm_abswriter_st *aw){
+	while (aw->heap_size > 0)
+		abswriter_pop(aw);
+	int tracks = 0;
+	for (int t = 0; t < BM_ABSWRITER_TRACKS; t++){
+		if (aw->tracks[t]){
+			writer_end(&aw->tracks[t]->w);
+			if (!aw->tracks[t]->w.ok)
+				aw->ok = false;
+		}
+		if (t == 0 || aw->tracks[t])
+			tracks++;
+	}
+
+	// copy each spooled track out behind its header, reusing its writer's buffer
+	bool ok = aw->ok && writer_mthd(aw->f_dump, aw->user, 1, tracks, aw->divisor);
+	for (int t = 0; t < BM_ABSWRITER_TRACKS && ok; t++){
+		struct bm_abswriter_track_struct *tr = aw->tracks[t];
+		if (tr == NULL){
+			// an empty conductor track
+			static const uint8_t end_of_track[4] = { 0x00, 0xFF, 0x2F, 0x00 };
+			if (t == 0){
+				ok = writer_mtrk(aw->f_dump, aw->user, sizeof(end_of_track)) &&
+					dump_all(aw->f_dump, aw->user, end_of_track, 1, sizeof(end_of_track));
+			}
+			continue;
+		}
+		ok = writer_mtrk(aw->f_dump, aw->user, tr->w.size) && fflush(tr->spool) == 0 &&
+			fseek(tr->spool, 0, SEEK_SET) == 0;
+		int left = tr->w.size;
+		while (ok && left > 0){
+			int n = left < (int)sizeof(tr->w.buf) ? left : (int)sizeof(tr->w.buf);
+			ok = fread(tr->w.buf, 1, n, tr->spool) == (size_t)n &&
+				dump_all(aw->f_dump, aw->user, tr->w.buf, 1, n);
+			left -= n;
+		}
+	}
+	if (!ok)
+		aw->ok = false;
+
+	for (int t = 0; t < BM_ABSWRITER_TRACKS; t++){
+		if (aw->tracks[t] == NULL)
+			continue;
+		fclose(aw->tracks[t]->spool);
+		aw->alloc.f_free(aw->tracks[t], sizeof(struct bm_abswriter_track_struct),
+			aw->alloc.user);
+		aw->tracks[t] = NULL;
+	}
+	if (aw->heap){
+		aw->alloc.f_free(aw->heap, sizeof(struct bm_abswriter_slot_struct) * (size_t)aw->window,
+			aw->alloc.user);
+	}
+	aw->heap = NULL;
+	aw->heap_size = 0;
+	return aw->ok;
+}
+
+//
+// latency tracing
+//
+
+#if BM_PLAYBACK
+
+uint64_t bm_trace_now(){
+	return clock_ns();
+}
+
+void bm_trace_init(bm_trace_st *tr){
+	for (int i = 0; i < BM_STAGES; i++)
+		bm_histogram_init(&tr->stages[i]);
+	bm_histogram_init(&tr->total);
+}
+
+int bm_devicebytes_traced(bm_device_st *device, bm_state_st *state, const uint8_t *data,
+	int size, uint64_t arrival_ns, bm_ev_st *events_out, bm_stamp_st *stamps_out,
+	int max_events_size, bm_trace_st *trace, bm_warn_f f_warn, void *user){
+	bool timed = trace || stamps_out;
+	int e = 0;
+	int p = 0;
+	bm_ev_st ev;
+	// each message starts decoding when the previous one is done, so reading the clock once
+	// after each step times every stage
+	uint64_t t0 = timed ? clock_ns() : 0;
+	while (e < max_events_size && p < size){
+		ev.type = 99; // set event type to something invalid to detect if one is written
+		int at = p;
+		p += midi_single(&data[p], size - p, device, f_warn, user, NULL, &ev, NULL);
+		uint64_t t1 = timed ? clock_ns() : 0;
+		if ((int)ev.type == 99){
+			t0 = t1;
+			continue;
+		}
+		slice_at(&ev, at);
+		uint64_t t2 = t1;
+		if (state){
+			bm_update(state, &ev, 1);
+			t2 = timed ? clock_ns() : 0;
+		}
+		if (trace){
+			bm_histogram_record(&trace->stages[BM_STAGE_QUEUE],
+				t0 > arrival_ns ? t0 - arrival_ns : 0);
+			bm_histogram_record(&trace->stages[BM_STAGE_DECODE], t1 - t0);
+			if (state)
+				bm_histogram_record(&trace->stages[BM_STAGE_UPDATE], t2 - t1);
+		}
+		if (stamps_out)
+			stamps_out[e] = (bm_stamp_st){ arrival_ns, t1, t2 };
+		events_out[e++] = ev;
+		t0 = t2;
+	}
+	return e;
+}
+
+void bm_trace_consumed(bm_trace_st *tr, const bm_stamp_st *stamp){
+	uint64_t now = clock_ns();
+	bm_histogram_record(&tr->stages[BM_STAGE_CONSUMER],
+		now > stamp->updated_ns ? now - stamp->updated_ns : 0);
+	bm_histogram_record(&tr->total, now > stamp->arrival_ns ? now - stamp->arrival_ns : 0);
+}
+
+#endif // BM_PLAYBACK
+
+//
+// following
+//
+
+void bm_reader_init_follow(bm_reader_st *reader, bm_warn_f f_warn, void *user){
+	reader_init(reader, NULL, 0, NULL, NULL, NULL);
+	reader->f_warn = f_warn;
+	reader->user = user;
+	reader->follow = true;
+	reader->complete = false;
+	reader->scan = 0;
+}
+
+void bm_reader_follow(bm_reader_st *reader, const uint8_t *data, int size, bool complete){
+	reader->data = data;
+	if (reader->complete)
+		return;
+	if (size > reader->size)
+		reader->size = size;
+	reader->complete = complete;
+
+	// only the last chunk can still be growing
+	if (reader->chunks_size > 0){
+		chunk_st *last = &reader->chunks[reader->chunks_size - 1];
+		if (last->end < last->limit){
+			last->end = last->limit < reader->size ? last->limit : reader->size;
+			if (complete && last->limit != INT_MAX && last->limit > reader->size){
+				int offset = last->limit - reader->size;
+				warn(reader->f_warn, reader->user, STATS(reader->stats), BM_WARN_CHUNK,
+					"Chunk ends %d byte%s too early", offset, ss(offset));
+			}
+		}
+	}
+	follow_scan(reader);
+}
+
+//
+// slices
+//
+
+bm_slice_st bm_slice(const uint8_t *data, bm_ev_st ev){
+	// the message was checked when it was decoded, so it can be read back without checks
+	const uint8_t *msg = &data[ev.u.slice];
+	if (ev.type != BM_EV_META && ev.type != BM_EV_SYSEX)
+		return (bm_slice_st){ .kind = -1, .data = NULL, .size = 0 };
+	// meta events have their type between the status and the length
+	int kind = ev.type == BM_EV_META ? msg[1] : msg[0];
+	int p = ev.type == BM_EV_META ? 2 : 1;
+	int size = 0;
+	do
+		size = (size << 7) | (msg[p] & 0x7F);
+	while (msg[p++] & 0x80);
+	return (bm_slice_st){ .kind = kind, .data = &msg[p], .size = size };
 }
@@ -9,6 +9,13 @@
 #include <stdbool.h>
 #include <stdlib.h>
 
+#ifdef __cplusplus
+#	define BM_RESTRICT __restrict
+extern "C" {
+#else
+#	define BM_RESTRICT restrict
+#endif
+
 typedef enum {
 	BM_EV_RESET,    // reset all sound and optionally set ticks per quarter-note
 	BM_EV_TEMPO,    // set microseconds per quarter-note
@@ -22,9 +29,13 @@ typedef enum {
 	BM_EV_CHANPAN,  // channel panning
 	BM_EV_PATCH,    // channel patch
 	BM_EV_BEND,     // channel pitch bend
-	BM_EV_MOD       // channel mod wheel
+	BM_EV_MOD,      // channel mod wheel
+	BM_EV_META,     // meta event, only produced when asked for, see bm_slice
+	BM_EV_SYSEX     // SysEx message, only produced when asked for, see bm_slice
 } bm_ev_type;
 
+#define BM_EV_TYPES 15 // number of bm_ev_type values
+
 #define BM_PEDAL_DAMPER           0
 #define BM_PEDAL_PORTAMENTO       1
 #define BM_PEDAL_SOSTENUTO        2
@@ -342,6 +353,7 @@ typedef struct {
 			uint8_t channel;  // unsigned 4-bit (0 to 15)
 			uint16_t mod;     // unsigned 14-bit (0 to 16383)
 		} mod;
+		uint32_t slice;       // offset of the message in the data it was decoded from
 	} u;
 } bm_ev_st;
 
@@ -365,6 +377,7 @@ typedef struct {
 } bm_state_st;
 
 typedef struct {
+	int slices;               // set after init to BM_SLICE_* flags for the events to produce
 	// this should be considered private, but it is exposed here to allow for static allocation
 	struct {
 		uint32_t bank;
@@ -379,10 +392,27 @@ typedef struct {
 	bm_ev_st ev; // the new event
 } bm_delta_ev_st;
 
+// bm_delta_ev_st takes 12 bytes, because the union is padded out to its largest member and sits
+// next to a 4-byte enum; bm_packed_ev_st holds the same information in 8 bytes, so large event
+// arrays use a third less memory bandwidth
+// use bm_pack/bm_unpack to convert between the two
+typedef struct {
+	uint32_t delta;           // number of ticks from previous event
+	uint8_t type;             // bm_ev_type
+	uint8_t channel;          // channel, or bits 16-23 of the tempo or slice offset
+	uint16_t data;            // note | (velocity << 8) for BM_EV_NOTEON, otherwise the value
+} bm_packed_ev_st;
+
+#ifdef __cplusplus
+static_assert(sizeof(bm_packed_ev_st) == 8, "bm_packed_ev_st must be 8 bytes");
+#else
+_Static_assert(sizeof(bm_packed_ev_st) == 8, "bm_packed_ev_st must be 8 bytes");
+#endif
+
 typedef void (*bm_event_f)(bm_delta_ev_st event, void *user);
 typedef void (*bm_warn_f)(const char *msg, void *user);
-typedef size_t (*bm_dump_f)(const void *restrict ptr, size_t size, size_t nitems,
-	void *restrict dumpuser);
+typedef size_t (*bm_dump_f)(const void *BM_RESTRICT ptr, size_t size, size_t nitems,
+	void *BM_RESTRICT dumpuser);
 
 const char *bm_patchstr(uint16_t patch);
 void bm_init(bm_state_st *state);
@@ -392,7 +422,1088 @@ int  bm_devicebytes(bm_device_st *device, const uint8_t *data, int size, bm_ev_s
 	int max_events_size, bm_warn_f f_warn, void *user);
 void bm_readmidi(const uint8_t *data, int size, bm_event_f f_event, bm_warn_f f_warn,
 	void *user);
-void bm_writemidi(bm_delta_ev_st *events, int size, bm_dump_f f_dump, void *user);
+// writes a format 0 file; the first RESET sets the divisor, and later ones are dropped, along with
+// slices, which don't hold their data
+bool bm_writemidi(const bm_delta_ev_st *events, int size, bm_dump_f f_dump, void *user);
+
+// pull decoding
+//
+// bm_readmidi is a loop around bm_reader_next, which produces one event per call.  Reading events
+// one at a time lets the consumer be inlined into the caller's loop, instead of being called through
+// a function pointer (see basicmidi.hpp).  Warnings are sent to f_warn during the call that produces
+// the event following them.  `data` must stay valid until the reader is done.
+
+typedef struct {
+	int slices;               // set after init to BM_SLICE_* flags, for every track's device
+	// this should be considered private, but it is exposed here to allow for static allocation
+	const uint8_t *data;
+	bm_warn_f f_warn;
+	void *user;
+	struct bm_stats_struct *stats;
+	int chunks_size;
+	int ch;                   // next chunk to read
+	int track_base;           // first chunk of the tracks being merged
+	int track_count;
+	int tracks_left;
+	int pending_dt;
+	int hd_format;            // format of the header just read, or -1 once its tracks are set up
+	int hd_tracks;
+	int divisor;              // from the current header
+	int dt_track;             // track that still needs its next dt read, or -1
+	int patterns_left;        // format 2 tracks still to play after the current one
+	bool pattern_pending;     // the next format 2 track starts on the next call
+	int pattern;              // for a sequence reader, the format 2 track to play, or -1
+	bool single;              // stop after one sequence
+	bool found_header;
+	bool follow;              // reading a file that's still being written, see bm_reader_follow
+	bool complete;            // the data won't grow any more
+	int size;
+	int scan;                 // where the next chunk begins, INT_MAX if unknown, or -1 to stop
+	int walk;                 // how far the scan has looked for the end of an unknown-length track
+	int walk_status;          // running status at walk
+	struct bm_reader_chunk_struct {
+		bm_device_st device;
+		int type;
+		int start;
+		int end;
+		int limit;            // where the chunk's length says it ends, or INT_MAX if unknown
+		int dt;
+	} chunks[300];            // max number of chunks seen in the wild is 254
+} bm_reader_st;
+
+void bm_reader_init(bm_reader_st *reader, const uint8_t *data, int size, bm_warn_f f_warn,
+	void *user);
+// returns false once there are no more events
+bool bm_reader_next(bm_reader_st *reader, bm_delta_ev_st *event_out);
+
+// sequences
+//
+// A file holds one or more sequences, which are sets of tracks played together: each header
+// (MThd) starts a new sequence made of the tracks that follow it, except in format 2, where every
+// track is a separate pattern, and so its own sequence.  bm_readmidi plays the sequences one after
+// another, starting each one with a RESET event.
+//
+// Sequences don't share any decoding state, so each one can be read by its own reader, in any order
+// or on separate threads.  bm_sequences finds them, and bm_reader_init_sequence makes a reader that
+// only produces one of them.  Warnings about the file's layout (its chunks, and having more than
+// one header) are only sent by bm_sequences, but warnings about a header are repeated by each of
+// its sequences.
+
+typedef struct {
+	int chunk;                // index of the sequence's header among the file's chunks
+	int pattern;              // for format 2, which of the header's tracks to play, otherwise -1
+	int format;               // from the header
+	int tracks;               // number of tracks merged together
+} bm_sequence_st;
+
+// returns the total number of sequences; if that is larger than max_sequences_size, only the first
+// max_sequences_size are written
+int  bm_sequences(const uint8_t *data, int size, bm_sequence_st *sequences_out,
+	int max_sequences_size, bm_warn_f f_warn, void *user);
+void bm_reader_init_sequence(bm_reader_st *reader, const uint8_t *data, int size,
+	const bm_sequence_st *sequence, bm_warn_f f_warn, void *user);
+
+// packed variants
+// bm_update_packed trusts its events like bm_update does; bm_cacheopen and the archive reader
+// reject events with an unknown type, or a channel, note, pedal, or patch out of range
+void bm_update_packed(bm_state_st *state, const bm_packed_ev_st *events, int events_size);
+int  bm_devicebytes_packed(bm_device_st *device, const uint8_t *data, int size,
+	bm_packed_ev_st *events_out, int max_events_size, bm_warn_f f_warn, void *user);
+// decodes the entire file into events_out, and returns the total number of events in the file; if
+// that is larger than max_events_size, only the first max_events_size events are written, so the
+// caller can grow the buffer and try again
+int  bm_readmidi_packed(const uint8_t *data, int size, bm_packed_ev_st *events_out,
+	int max_events_size, bm_warn_f f_warn, void *user);
+
+// decode statistics
+//
+// bm_readmidi_stats fills in counters while decoding.  The counters are compiled in by default;
+// building basicmidi.c with -DBM_STATS=0 removes them entirely, in which case bm_readmidi_stats
+// leaves the stats zeroed.  Counting cycles per phase costs a timestamp read around every message,
+// so it only happens when `count_cycles` is set before decoding.
+
+typedef enum {
+	BM_WARN_HEADER,           // problems with the MThd chunk
+	BM_WARN_CHUNK,            // misaligned, truncated, or unrecognized chunks
+	BM_WARN_TRACK,            // bad timestamps, or tracks that end badly
+	BM_WARN_MESSAGE,          // malformed or unknown channel messages
+	BM_WARN_PATCH,            // banks and patches that can't be mapped
+	BM_WARN_SYSEX,            // malformed SysEx events
+	BM_WARN_META              // malformed meta events
+} bm_warn_category;
+
+#define BM_WARN_CATEGORIES 7
+
+typedef enum {
+	BM_MSG_NOTEOFF,
+	BM_MSG_NOTEON,
+	BM_MSG_NOTEPRESSURE,
+	BM_MSG_CONTROL,
+	BM_MSG_PROGRAM,
+	BM_MSG_CHANPRESSURE,
+	BM_MSG_BEND,
+	BM_MSG_SYSEX,
+	BM_MSG_META,
+	BM_MSG_INVALID            // unknown status bytes, or data bytes without running status
+} bm_msg_type;
+
+#define BM_MSG_TYPES 10
+
+typedef enum {
+	BM_PHASE_SCAN,            // locating chunks
+	BM_PHASE_MERGE,           // picking the next track to read
+	BM_PHASE_DECODE,          // decoding timestamps and messages
+	BM_PHASE_CALLBACK         // time spent inside of f_event
+} bm_phase;
+
+#define BM_PHASES 4
+
+typedef struct bm_stats_struct {
+	bool count_cycles;                  // set before decoding to fill in `cycles`
+	uint64_t messages[BM_MSG_TYPES];    // every message decoded
+	uint64_t dropped[BM_MSG_TYPES];     // messages that didn't produce an event
+	uint64_t events[BM_EV_TYPES];       // events produced
+	uint64_t warnings[BM_WARN_CATEGORIES];
+	uint64_t resyncs;                   // chunks found by searching past misaligned data
+	uint64_t resync_bytes;              // bytes skipped while searching
+	int tracks;                         // number of track chunks
+	int max_open_tracks;                // most tracks merged at the same time
+	uint32_t track_bytes[300];          // size of each track chunk (at most 300 are read)
+	uint64_t cycles[BM_PHASES];         // timestamp counter ticks spent in each phase
+} bm_stats_st;
+
+// initializes a reader that also fills in `stats`, which must already be initialized
+void bm_reader_init_stats(bm_reader_st *reader, const uint8_t *data, int size, bm_warn_f f_warn,
+	void *user, bm_stats_st *stats);
+
+void bm_stats_init(bm_stats_st *stats);
+void bm_readmidi_stats(const uint8_t *data, int size, bm_event_f f_event, bm_warn_f f_warn,
+	void *user, bm_stats_st *stats);
+
+// allocators
+//
+// Everything in the library that allocates memory takes a `const bm_allocator_st *`, where NULL
+// means the system allocator (malloc, realloc, and free).  The sizes passed to f_realloc and f_free
+// are the sizes the memory was last allocated with, so allocators don't need to track them.
+// Structures that allocate keep a copy of their allocator, so the allocator's `user` must stay
+// valid until they're freed.
+//
+// bm_arena_st is an allocator that hands out memory from large blocks in order, and frees it all
+// at once.  Resetting an arena takes constant time and keeps its blocks, so a worker that resets
+// its arena between files stops calling the system allocator once the blocks are big enough.
+// Freeing memory from an arena only reclaims it if it was the most recent allocation, which is also
+// the only allocation that can grow in place.  Anything allocated from an arena can't be used after
+// the arena is reset; calling the structure's free function is not needed, but does no harm.
+
+typedef void *(*bm_alloc_f)(size_t size, void *user);
+typedef void *(*bm_realloc_f)(void *ptr, size_t old_size, size_t new_size, void *user);
+typedef void (*bm_free_f)(void *ptr, size_t size, void *user);
+
+typedef struct {
+	bm_alloc_f f_alloc;
+	bm_realloc_f f_realloc;
+	bm_free_f f_free;
+	void *user;
+} bm_allocator_st;
+
+#define BM_ARENA_BLOCK 65536 // default block size
+
+typedef struct {
+	// this should be considered private, but it is exposed here to allow for static allocation
+	struct bm_arena_block_struct *head;
+	struct bm_arena_block_struct *current; // NULL before the first allocation after a reset
+	size_t used;              // bytes used in current
+	size_t last;              // offset of the most recent allocation in current
+	size_t block_size;
+} bm_arena_st;
+
+// a block_size of 0 uses BM_ARENA_BLOCK; allocations larger than that get a block of their own
+void bm_arena_init(bm_arena_st *arena, size_t block_size);
+bm_allocator_st bm_arena_allocator(bm_arena_st *arena);
+void bm_arena_reset(bm_arena_st *arena);
+void bm_arena_free(bm_arena_st *arena);
+
+// struct-of-arrays event store
+//
+// Holds a decoded event stream as one array per field, so scans over a single field (every note,
+// every velocity, etc) run over contiguous memory.  Events without a channel have channel 0, and
+// events without a velocity have velocity 0.  `types[t].index` lists the position of every event
+// of type `t`, in order.
+
+typedef struct {
+	int size;                 // number of events
+	int count;                // allocated size of each column
+	uint32_t *tick;           // absolute tick
+	uint8_t *type;            // bm_ev_type
+	uint8_t *channel;         // unsigned 4-bit (0 to 15)
+	int32_t *value;           // note for NOTEON/NOTEOFF, pedal for PEDALON/PEDALOFF, otherwise the
+	                          // event's value (divisor, tempo, volume, pan, patch, bend, mod, or
+	                          // slice offset)
+	uint8_t *velocity;        // unsigned 7-bit (0 to 127)
+	struct {
+		int32_t *index;       // indices into the columns
+		int size;
+		int count;
+	} types[BM_EV_TYPES];
+	bool oom;                 // set if an allocation failed; the store is left truncated
+	bm_allocator_st alloc;
+} bm_soa_st;
+
+void bm_soa_init(bm_soa_st *soa, const bm_allocator_st *alloc);
+void bm_soa_clear(bm_soa_st *soa);
+void bm_soa_free(bm_soa_st *soa);
+bool bm_soa_push(bm_soa_st *soa, uint32_t tick, bm_ev_st ev);
+bm_delta_ev_st bm_soa_event(const bm_soa_st *soa, int index); // delta relative to index - 1
+// clears the store and fills it with every event in the file; returns false if out of memory
+bool bm_readmidi_soa(const uint8_t *data, int size, bm_soa_st *soa, bm_warn_f f_warn, void *user);
+// column operations
+void bm_soa_notehist(const bm_soa_st *soa, int hist[128]);     // count of NOTEON per note
+void bm_soa_velhist(const bm_soa_st *soa, int hist[128]);      // count of NOTEON per velocity
+void bm_soa_transpose(bm_soa_st *soa, int semitones);          // clamps notes to 0-127
+void bm_soa_scalevel(bm_soa_st *soa, int numerator, int denominator); // clamps to 1-127
+
+// note pairing
+//
+// Matches every NOTEON with the NOTEOFF that releases it, producing a flat array of notes sorted by
+// start time.  Overlapping notes on the same channel and key are released oldest first.  Each
+// channel can hold 128 open notes; past that, the oldest one is cut off.  Notes still open at the
+// end of the stream (or at a RESET) are closed there.
+
+#define BM_NOTEPAIR_DAMPER 1 // notes released while the damper pedal is down last until it lifts
+
+typedef struct {
+	uint32_t start;           // absolute tick of the NOTEON
+	uint32_t duration;        // number of ticks the note sounds
+	uint8_t channel;          // unsigned 4-bit (0 to 15)
+	uint8_t note;             // unsigned 7-bit (0 to 127)
+	uint8_t velocity;         // unsigned 7-bit (0 to 127)
+} bm_note_st;
+
+typedef struct {
+	// this should be considered private, but it is exposed here to allow for static allocation
+	bm_note_st *notes;
+	int max_notes_size;
+	int size;
+	int flags;
+	uint32_t tick;
+	struct {
+		struct {
+			uint32_t start;
+			int index;
+			uint8_t note;
+			bool released;
+		} open[128];
+		int open_size;
+		bool damper;
+	} channels[16];
+} bm_notepair_st;
+
+void bm_notepair_init(bm_notepair_st *np, bm_note_st *notes_out, int max_notes_size, int flags);
+void bm_notepair_event(bm_delta_ev_st event, void *np); // compatible with bm_event_f
+// closes any open notes, and returns the total number of notes; if that is larger than
+// max_notes_size, only the first max_notes_size notes were written
+int  bm_notepair_finish(bm_notepair_st *np);
+int  bm_notepairs(const bm_delta_ev_st *events, int size, bm_note_st *notes_out,
+	int max_notes_size, int flags);
+int  bm_readmidi_notes(const uint8_t *data, int size, bm_note_st *notes_out, int max_notes_size,
+	int flags, bm_warn_f f_warn, void *user);
+
+// note index
+//
+// An implicit interval tree over notes, answering "which notes are sounding at tick t" (and "which
+// notes overlap a range of ticks") in O(log n + results).  The notes are copied and sorted by start
+// time, and the tree is laid out in that same array, so building is a sort plus one linear pass,
+// and queries touch very little memory.  A note sounds from `start` up to (but not including)
+// `start + duration`; zero-length notes sound for their starting tick.  Queries write indices into
+// `idx->notes` in ascending order, and return the total number of matches (writing at most
+// max_out), filtered to the channels set in the `channels` bitmask (0xFFFF for all channels).
+
+typedef struct {
+	bm_note_st *notes;        // sorted by start
+	uint32_t *max_end;        // largest end tick in each subtree
+	int size;
+	int root_level;
+	bm_allocator_st alloc;
+} bm_noteindex_st;
+
+bool bm_noteindex_build(bm_noteindex_st *idx, const bm_note_st *notes, int size,
+	const bm_allocator_st *alloc);
+void bm_noteindex_free(bm_noteindex_st *idx);
+int  bm_noteindex_at(const bm_noteindex_st *idx, uint32_t tick, uint16_t channels, int *out,
+	int max_out);
+int  bm_noteindex_range(const bm_noteindex_st *idx, uint32_t start, uint32_t end,
+	uint16_t channels, int *out, int max_out);
+
+// event cache
+//
+// A cache file is a snapshot of the merged event stream produced by bm_readmidi, so players can
+// reload a song without decoding the SMF again.  Every section is an array of fixed-width
+// little-endian records aligned to 8 bytes, which means a file can be mmap'ed (or read into any
+// malloc'ed buffer) and used in place with no parsing.
+//
+// Layout:
+//   bm_cache_hdr_st
+//   bm_cache_tempo_st[tempos_size]  tempo map (every RESET and TEMPO event)
+//   bm_cache_seek_st[seeks_size]    absolute tick of every `seek_interval`th event
+//   bm_packed_ev_st[events_size]    the events themselves
+//
+// Slices are stored like any other event, so their offsets still point into the source file, which
+// has to be at hand to read them (see bm_slice).
+
+#define BM_CACHE_MAGIC         0x43454D42 // "BMEC" when stored little-endian
+#define BM_CACHE_VERSION       1
+#define BM_CACHE_SEEK_INTERVAL 1024
+
+typedef struct {
+	uint32_t magic;           // BM_CACHE_MAGIC
+	uint32_t version;         // BM_CACHE_VERSION
+	uint32_t header_size;     // sizeof(bm_cache_hdr_st)
+	uint32_t events_size;     // number of events
+	uint32_t tempos_size;     // number of tempo map entries
+	uint32_t seeks_size;      // number of seek entries
+	uint32_t seek_interval;   // number of events between seek entries
+	uint32_t total_ticks;     // absolute tick of the last event
+	uint32_t tempos_offset;   // byte offset of the tempo map
+	uint32_t seeks_offset;    // byte offset of the seek table
+	uint32_t events_offset;   // byte offset of the events
+	uint32_t reserved;        // always 0
+} bm_cache_hdr_st;
+
+typedef struct {
+	uint64_t usec;            // absolute time of the change, in microseconds
+	uint32_t tick;            // absolute tick of the change
+	uint32_t index;           // index of the event that caused the change
+	uint32_t tempo;           // microseconds per quarter-note from here on
+	uint32_t divisor;         // ticks per quarter-note from here on
+} bm_cache_tempo_st;
+
+typedef struct {
+	uint32_t tick;            // absolute tick of the event at `index`
+	uint32_t index;           // event index, always a multiple of the seek interval
+} bm_cache_seek_st;
+
+typedef struct {
+	const bm_cache_hdr_st *hdr;
+	const bm_cache_tempo_st *tempos;
+	const bm_cache_seek_st *seeks;
+	const bm_packed_ev_st *events;
+	int tempos_size;
+	int seeks_size;
+	int events_size;
+} bm_cache_st;
+
+bool bm_writecache(const bm_delta_ev_st *events, int size, bm_dump_f f_dump, void *user);
+bool bm_cacheopen(bm_cache_st *cache, const void *data, int size);
+bm_delta_ev_st bm_cacheevent(const bm_cache_st *cache, int index);
+// returns the index of the first event at or after `tick`, storing that event's absolute tick in
+// `tick_out` (if not NULL); returns events_size if there are no such events, storing the tick of
+// the last event instead, or 0 if there are no events at all
+int  bm_cacheseek(const bm_cache_st *cache, uint32_t tick, uint32_t *tick_out);
+
+// stream mixing
+//
+// Merges several sources (MIDI files or event arrays) into one stream, ordered by absolute tick,
+// with ties going to the lower numbered source.  Each source's ticks are scaled from its own
+// divisor to the output divisor, so sources line up by beat; the output only has one tempo map, so
+// TEMPO events are only kept from `tempo_source` (or from every source, if it's -1).  RESET events
+// are dropped, and the output starts with a single RESET for the output divisor.  Events are pulled
+// from the sources as the mix is read, so nothing is decoded ahead of time.
+
+#define BM_MIX_MAX_SOURCES 64
+
+typedef struct {
+	// set by bm_mixsource_smf/bm_mixsource_events, and can be changed before bm_mix_init
+	const uint8_t *data;           // MIDI file, or NULL if the source is an event array
+	int size;
+	const bm_delta_ev_st *events;
+	int events_size;
+	uint32_t offset;               // output ticks added to every event
+	int8_t channels[16];           // output channel for each channel, or -1 to drop the channel
+	// this should be considered private, but it is exposed here to allow for static allocation
+	bm_reader_st reader;
+	int index;
+	bool done;
+	bm_ev_st ev;                   // next event
+	uint64_t tick;                 // source ticks up to the next event
+	uint64_t out_tick;             // output ticks up to the next event
+	uint64_t base_tick;            // source and output ticks at the last RESET
+	uint64_t base_out;
+	int divisor;
+} bm_mixsource_st;
+
+typedef struct {
+	// this should be considered private, but it is exposed here to allow for static allocation
+	bm_mixsource_st *sources;
+	int sources_size;
+	int divisor;
+	int tempo_source;
+	uint64_t tick;
+	bool started;
+	int heap[BM_MIX_MAX_SOURCES];
+	int heap_size;
+} bm_mix_st;
+
+void bm_mixsource_smf(bm_mixsource_st *src, const uint8_t *data, int size);
+void bm_mixsource_events(bm_mixsource_st *src, const bm_delta_ev_st *events, int size);
+// a divisor of 0 uses the first source's divisor; returns false if there are too many sources
+bool bm_mix_init(bm_mix_st *mix, bm_mixsource_st *sources, int sources_size, int divisor,
+	int tempo_source, bm_warn_f f_warn, void *user);
+bool bm_mix_next(bm_mix_st *mix, bm_delta_ev_st *event_out); // returns false at the end
+void bm_mix(bm_mixsource_st *sources, int sources_size, int divisor, int tempo_source,
+	bm_event_f f_event, bm_warn_f f_warn, void *user);
+// mixes directly into bm_writemidi's output, without storing the mixed events
+bool bm_mix_writemidi(bm_mixsource_st *sources, int sources_size, int divisor, int tempo_source,
+	bm_dump_f f_dump, bm_warn_f f_warn, void *user);
+
+// coalescing
+//
+// A stage that sits between a reader and its consumer, and removes events that have no effect.  It
+// tracks the state the same way bm_update does, and each event type can be configured to drop
+// events that don't change that state, and/or to keep only the last event for each controller
+// within a burst.  A burst is a run of events in the same tick, ended by any event whose type isn't
+// coalesced in bursts, like a note, so controllers set around a note still take effect around it.
+// Dropped events pass their deltas on to the next event sent downstream.  A burst is held until it
+// ends, so call bm_coalesce_finish at the end of the stream to send the last of it.
+//
+// bm_coalesce_init enables both modes for every type except RESET, NOTEON, and NOTEOFF; dropping
+// repeated NOTEON or unmatched NOTEOFF events is allowed, but it changes how overlapping notes on
+// the same key are paired.
+
+#define BM_COALESCE_UNCHANGED 1 // drop events that don't change the state
+#define BM_COALESCE_BURST     2 // within a burst, only keep the last event for each controller
+#define BM_COALESCE_BUFFER    256
+
+typedef struct {
+	int modes[BM_EV_TYPES];            // BM_COALESCE_* flags for each bm_ev_type
+	uint64_t removed[BM_EV_TYPES];     // number of events dropped, for each bm_ev_type
+	// this should be considered private, but it is exposed here to allow for static allocation
+	bm_event_f f_event;
+	void *user;
+	bm_state_st state;
+	int pending_dt;
+	int buf_size;
+	bm_delta_ev_st buf[BM_COALESCE_BUFFER];
+} bm_coalesce_st;
+
+void bm_coalesce_init(bm_coalesce_st *co, bm_event_f f_event, void *user);
+void bm_coalesce_event(bm_delta_ev_st event, void *co); // compatible with bm_event_f
+// sends any held events downstream, and returns the total number of events removed
+uint64_t bm_coalesce_finish(bm_coalesce_st *co);
+
+// batch transforms
+//
+// Edits events a batch at a time, with each stage running over the whole batch before the next
+// stage starts, so the arithmetic stages vectorize.  Batches store events the same way as
+// bm_packed_ev_st, one field per array, except with absolute ticks instead of deltas.  Stages that
+// drop an event set its type to BM_XF_DROPPED, and the event is skipped when the batch is read out.
+//
+// Quantizing moves every event by the same rule (toward the nearest multiple of `grid`, by
+// `strength` percent), so the order of events never changes; notes shorter than the grid can end
+// up with zero length.
+
+#define BM_XF_BATCH   1024
+#define BM_XF_DROPPED 0xFF
+
+typedef enum {
+	BM_XF_TRANSPOSE,          // add semitones to every note, clamping to 0-127
+	BM_XF_VELCURVE,           // replace every NOTEON velocity through a lookup table
+	BM_XF_QUANTIZE,           // snap event times to a grid
+	BM_XF_CHANMAP             // move channels, or drop them
+} bm_xf_type;
+
+typedef struct {
+	bm_xf_type type;
+	union {
+		int transpose;        // semitones
+		uint8_t velcurve[128];// new velocity for each velocity; 0 is treated as 1
+		struct {
+			uint32_t grid;    // ticks
+			int strength;     // 0 to 100 percent
+		} quantize;
+		int8_t chanmap[16];   // new channel for each channel, or -1 to drop the channel
+	} u;
+} bm_xf_st;
+
+typedef struct {
+	int size;
+	uint32_t tick[BM_XF_BATCH];
+	uint8_t type[BM_XF_BATCH];
+	uint8_t channel[BM_XF_BATCH];
+	uint16_t data[BM_XF_BATCH];
+} bm_xf_batch_st;
+
+void bm_xf_transpose(bm_xf_batch_st *batch, int semitones);
+void bm_xf_velcurve(bm_xf_batch_st *batch, const uint8_t velcurve[128]);
+void bm_xf_quantize(bm_xf_batch_st *batch, uint32_t grid, int strength);
+void bm_xf_chanmap(bm_xf_batch_st *batch, const int8_t chanmap[16]);
+// runs each stage over the whole batch, in order
+void bm_xf_apply(bm_xf_batch_st *batch, const bm_xf_st *stages, int stages_size);
+// transforms an event array in place, returning the new size after dropped events are removed, or
+// -1 if out of memory
+int  bm_xf_events(bm_delta_ev_st *events, int size, const bm_xf_st *stages, int stages_size,
+	const bm_allocator_st *alloc);
+// decodes, transforms, and writes a format 0 file in one pass; the track is encoded into memory
+// so its length can be written first, and false is returned if that runs out of memory
+bool bm_xf_writemidi(const uint8_t *data, int size, const bm_xf_st *stages, int stages_size,
+	const bm_allocator_st *alloc, bm_dump_f f_dump, bm_warn_f f_warn, void *user);
+
+// fingerprinting
+//
+// Summarizes a song's notes so copies can be found without decoding both files again.  Copies that
+// only differ in metadata, track order, tempo, divisor, or transposition get the same fingerprint.
+// Times are measured in beats instead of ticks, TEMPO events are ignored, notes that start on the
+// same tick are treated as a set, and pitches are taken relative to the lowest note of the first
+// chord (except on channel 10, where notes pick drums instead of pitches).
+//
+// `exact` hashes every NOTEON and NOTEOFF after that normalization, so it only matches copies with
+// the same notes.  `minhash` is a MinHash signature over n-grams of consecutive onsets, where each
+// n-gram holds the intervals between the top notes of the onsets and the ratios between the gaps
+// separating them.  Each n-gram is hashed once, and lands in the one entry its hash picks, which
+// keeps the smallest hash it sees.  The fraction of matching entries between two signatures
+// estimates how many n-grams the songs share, so near-copies (a fixed wrong note, a trimmed intro,
+// a changed velocity) still score high.
+
+#define BM_FINGERPRINT_SIZE  64  // entries in the MinHash signature
+#define BM_FINGERPRINT_NGRAM 4   // onsets per n-gram
+#define BM_FINGERPRINT_GROUP 128 // notes held per tick before they're hashed
+
+typedef struct {
+	uint64_t exact;                         // hash of the normalized notes
+	uint32_t minhash[BM_FINGERPRINT_SIZE];  // signature; only meaningful if ngrams > 0
+	int ngrams;                             // number of n-grams in the signature
+	// this should be considered private, but it is exposed here to allow for static allocation
+	uint32_t tick;
+	uint32_t base_tick;
+	uint64_t base_beat;
+	int divisor;
+	int ref_note;                           // -1 until the first chord is hashed
+	uint64_t group_beat;
+	uint64_t last_beat;
+	int group_size;
+	int group_notes;
+	int group_top;
+	int group_low;
+	uint16_t group[BM_FINGERPRINT_GROUP];
+	uint64_t group_hash;
+	int onsets;
+	int onset_top[BM_FINGERPRINT_NGRAM];
+	uint64_t onset_beat[BM_FINGERPRINT_NGRAM];
+} bm_fingerprint_st;
+
+void bm_fingerprint_init(bm_fingerprint_st *fp);
+void bm_fingerprint_event(bm_delta_ev_st event, void *fp); // compatible with bm_event_f
+// hashes the last tick's notes; the public fields are only valid after this is called
+void bm_fingerprint_finish(bm_fingerprint_st *fp);
+void bm_readmidi_fingerprint(const uint8_t *data, int size, bm_fingerprint_st *fp_out,
+	bm_warn_f f_warn, void *user);
+// returns the number of matching signature entries (0 to BM_FINGERPRINT_SIZE), or 0 if either
+// song is too short to have any n-grams
+int  bm_fingerprint_compare(const bm_fingerprint_st *a, const bm_fingerprint_st *b);
+
+// feature extraction
+//
+// Measures a song's content in one pass, into counters with the same layout for every song, so
+// songs can be compared or fed to a model without any other processing.  Times are measured in
+// BM_ANALYZE_BEAT units per beat, so songs with different divisors line up.  Sounding notes are
+// tracked with a 128-bit mask per channel, so overlapping notes on the same channel and key count
+// once, and notes held by a pedal after their NOTEOFF don't count.  Channel 10 picks drums instead
+// of pitches, so its notes are left out of the pitch histograms, but count everywhere else.
+
+#define BM_ANALYZE_BEAT      960 // time units per beat
+#define BM_ANALYZE_DENSITY   32  // buckets for NOTEONs per beat
+#define BM_ANALYZE_POLYPHONY 32  // buckets for notes sounding at once
+
+typedef struct {
+	uint32_t notes;                           // NOTEON events
+	uint32_t pitches[128];                    // NOTEONs per key, except on channel 10
+	uint32_t pitch_classes[12];               // same, folded into one octave (0 is C)
+	uint32_t velocities[16];                  // NOTEONs per velocity, in groups of 8
+	// for both of these, the last bucket also counts anything higher
+	uint32_t density[BM_ANALYZE_DENSITY];     // number of beats with each number of NOTEONs
+	uint64_t polyphony[BM_ANALYZE_POLYPHONY]; // time spent with each number of notes sounding
+	struct {
+		uint32_t notes;                       // NOTEON events
+		uint64_t active;                      // time spent with at least one note sounding
+		uint8_t low;                          // lowest and highest keys; if the channel has no
+		uint8_t high;                         // notes, low is 127 and high is 0
+	} channels[16];
+	uint32_t tempo_changes;                   // TEMPO events that changed the tempo
+	uint32_t tempo_min;                       // microseconds per quarter-note
+	uint32_t tempo_max;
+	uint64_t length;                          // time of the last event
+	uint64_t usecs;                           // same, in microseconds; the average tempo is
+	                                          // usecs * BM_ANALYZE_BEAT / length
+} bm_features_st;
+
+typedef struct {
+	bm_features_st features;
+	// this should be considered private, but it is exposed here to allow for static allocation
+	uint32_t tick;
+	uint32_t seg_tick;  // tick of the last RESET or TEMPO, where the times below were measured
+	uint64_t seg_time;
+	uint64_t seg_usecs;
+	int divisor;
+	uint32_t tempo;
+	uint64_t time;
+	uint64_t beat;
+	uint32_t beat_notes;
+	int sounding;
+	int channel_sounding[16];
+	uint64_t masks[16][2];
+} bm_analyze_st;
+
+void bm_analyze_init(bm_analyze_st *an);
+void bm_analyze_event(bm_delta_ev_st event, void *an); // compatible with bm_event_f
+// counts the last beat; an->features is only complete after this is called
+void bm_analyze_finish(bm_analyze_st *an);
+void bm_analyze(const uint8_t *data, int size, bm_features_st *features_out, bm_warn_f f_warn,
+	void *user);
+
+// histograms
+//
+// Counts values into log-linear buckets: values below 8 get their own buckets, and every power of
+// two above that is split into 8 buckets, so any value is within 12.5% of its bucket's bounds, and
+// the buckets cover all of uint64_t in a fixed size.
+
+#define BM_HISTOGRAM_BUCKETS 496
+
+typedef struct {
+	uint64_t count;
+	uint64_t min;                          // UINT64_MAX if count is 0
+	uint64_t max;
+	uint64_t sum;                          // wraps around if the values are huge
+	uint64_t buckets[BM_HISTOGRAM_BUCKETS];
+} bm_histogram_st;
+
+void bm_histogram_init(bm_histogram_st *h);
+void bm_histogram_record(bm_histogram_st *h, uint64_t value);
+// returns an upper bound for the value at `percentile` (0 to 100), which is never more than max
+uint64_t bm_histogram_percentile(const bm_histogram_st *h, double percentile);
+// the range of values counted by buckets[index]
+uint64_t bm_histogram_low(int index);
+uint64_t bm_histogram_high(int index);
+// writes the histogram as text in HdrHistogram's percentile distribution format, with a line for
+// every bucket that has values, so it can be read by HdrHistogram's plotting tools; values are
+// divided by `scale` (1000 to write nanoseconds as microseconds, for example)
+bool bm_histogram_dump(const bm_histogram_st *h, double scale, bm_dump_f f_dump, void *user);
+
+// playback
+//
+// Plays an event stream in real time against the monotonic clock, sending each event to a sink
+// once it's due.  Deadlines are calculated from when the first event arrives, using the tempo in
+// effect for each tick, so rounding errors don't build up over a long song.  Sleeps tend to wake up
+// late, so the player sleeps until an absolute time `spin_ns` before each deadline, then spins on
+// the clock for the rest.  Events that arrive late are sent right away, and every event records how
+// many nanoseconds after its deadline the sink was called.
+//
+// bm_player_event blocks until the event is due, so the player can sit directly behind a reader,
+// and the stream decodes as it plays.  Only POSIX systems have the clocks this needs, so
+// BM_PLAYBACK is 0 elsewhere, and this section is left out.
+
+#ifndef BM_PLAYBACK
+#	if defined(__unix__) || defined(__APPLE__)
+#		define BM_PLAYBACK 1
+#	else
+#		define BM_PLAYBACK 0
+#	endif
+#endif
+
+#if BM_PLAYBACK
+
+#define BM_PLAYER_SPIN 200000 // default spin_ns
+
+typedef struct {
+	bm_histogram_st latency;  // nanoseconds between each event's deadline and its delivery
+	int64_t spin_ns;          // set after init to change how long the player spins
+	// this should be considered private, but it is exposed here to allow for static allocation
+	bm_event_f f_sink;
+	void *user;
+	bool started;
+	uint64_t start_ns;        // monotonic time of the first event
+	uint32_t tick;
+	uint32_t seg_tick;        // tick of the last RESET or TEMPO, and when it happened
+	uint64_t seg_ns;
+	int divisor;
+	uint32_t tempo;
+} bm_player_st;
+
+// a sink that writes events as the bytes a MIDI cable would carry, with no deltas or meta events,
+// and flushes after each one; dumping to a FIFO or a raw MIDI device plays the song live
+typedef struct {
+	bool ok;                  // false once a write fails
+	// this should be considered private, but it is exposed here to allow for static allocation
+	bm_dump_f f_dump;
+	void *user;
+	int running_status;
+	bm_device_st device;
+} bm_wiresink_st;
+
+void bm_player_init(bm_player_st *pl, bm_event_f f_sink, void *user);
+// waits until the event is due, then sends it to the sink (compatible with bm_event_f)
+void bm_player_event(bm_delta_ev_st event, void *pl);
+// decodes and plays a MIDI file; returns once the last event is sent
+void bm_play(const uint8_t *data, int size, bm_player_st *pl, bm_warn_f f_warn, void *user);
+void bm_wiresink_init(bm_wiresink_st *ws, bm_dump_f f_dump, void *user);
+void bm_wiresink_event(bm_delta_ev_st event, void *ws); // compatible with bm_event_f
+
+#endif // BM_PLAYBACK
+
+// archives
+//
+// An archive stores the event streams of many MIDI files in one file, so a large collection can be
+// scanned without opening every file.  Each entry holds the merged event stream that bm_readmidi
+// produces for one file, compressed on its own: fields are coded as differences from recent values
+// (the last delta, the last note on the channel, the last value of the same controller), and then
+// go through an adaptive binary range coder with a separate model for each field.  Entries don't
+// share any coding state, so reading one takes a single seek to the offset in its directory record,
+// and a scan can split the directory into ranges of entries and read each range on its own thread,
+// in file order.
+//
+// Layout (native structs, so like the event cache, archives are only defined on little-endian
+// hosts):
+//   bm_archive_hdr_st
+//   the compressed entries, one after another
+//   bm_archive_entry_st[entries_size]  directory, aligned to 8 bytes
+//   names, each followed by a NUL
+//   bm_archive_tail_st                 locates the directory, at the end of the file
+//
+// The writer sends everything to f_dump in order, holding only the directory in memory, so an
+// archive can be written to a pipe.  A damaged entry is caught when its last event is read, by a
+// checksum over its events, so events read before then can be wrong.
+
+#define BM_ARCHIVE_MAGIC   0x52414D42 // "BMAR" when stored little-endian
+#define BM_ARCHIVE_VERSION 1
+
+typedef struct {
+	uint32_t magic;           // BM_ARCHIVE_MAGIC
+	uint32_t version;         // BM_ARCHIVE_VERSION
+	uint32_t header_size;     // sizeof(bm_archive_hdr_st)
+	uint32_t reserved;        // always 0
+} bm_archive_hdr_st;
+
+typedef struct {
+	uint64_t offset;          // byte offset of the compressed events
+	uint32_t size;            // compressed size in bytes
+	uint32_t events_size;     // number of events
+	uint32_t name_offset;     // byte offset of the name in the names section
+	uint32_t name_size;       // length of the name, not counting its NUL
+	uint32_t source_size;     // size of the file the events were decoded from
+	uint32_t checksum;        // FNV-1a hash of the events, packed like bm_packed_ev_st
+} bm_archive_entry_st;
+
+typedef struct {
+	uint64_t directory_offset;
+	uint64_t names_offset;
+	uint32_t entries_size;    // number of directory entries
+	uint32_t names_size;      // bytes in the names section
+	uint32_t magic;           // BM_ARCHIVE_MAGIC, so a truncated archive is noticed
+	uint32_t reserved;        // always 0
+} bm_archive_tail_st;
+
+typedef struct {
+	// this should be considered private, but it is exposed here to allow for static allocation
+	struct {
+		uint16_t type[16][16];        // by previous type
+		uint16_t delta_zero[16];      // by type
+		uint16_t delta_repeat[16];    // by type
+		uint16_t delta_bits[16][64];  // by type
+		uint16_t delta_high[33];      // by bit length
+		uint16_t channel[16][16];     // by previous channel
+		uint16_t tempo_high[256];
+		uint16_t note_on[128];
+		uint16_t note_off[128];
+		uint16_t velocity_same;
+		uint16_t velocity[128];
+		uint16_t value_high[16][256]; // by type
+		uint16_t value_low[16][256];  // by type
+	} probs;
+	uint32_t last_delta;
+	uint8_t prev_type;
+	uint8_t prev_channel;
+	uint8_t last_note[16];
+	uint8_t last_velocity[16];
+	uint16_t last_value[16][16];      // by type and channel
+} bm_archive_model_st;
+
+typedef struct {
+	bool ok;                  // false once a write fails or memory runs out
+	// this should be considered private, but it is exposed here to allow for static allocation
+	bm_allocator_st alloc;
+	bm_dump_f f_dump;
+	void *user;
+	uint64_t offset;          // bytes written so far, including the buffer
+	bm_archive_entry_st *entries;
+	int entries_size;
+	int entries_count;
+	char *names;
+	int names_size;
+	int names_count;
+	uint32_t checksum;
+	uint64_t low;             // range coder
+	uint32_t range;
+	uint8_t cache;
+	uint64_t pending;         // bytes held back while a carry can still reach them
+	int buf_size;
+	uint8_t buf[4096];
+	bm_archive_model_st model;
+} bm_archive_writer_st;
+
+typedef struct {
+	const uint8_t *data;
+	size_t size;
+	const bm_archive_entry_st *entries;
+	const char *names;
+	int entries_size;
+	uint32_t names_size;
+	uint64_t entries_end;     // offset of the directory, where the compressed entries stop
+} bm_archive_st;
+
+typedef struct {
+	bool ok;                  // false if the entry is damaged; final once no events are left
+	// this should be considered private, but it is exposed here to allow for static allocation
+	const uint8_t *data;
+	uint32_t size;
+	uint32_t pos;
+	uint32_t events_left;
+	uint32_t checksum;
+	uint32_t expect;
+	uint32_t range;           // range coder
+	uint32_t code;
+	bool overrun;
+	bm_archive_model_st model;
+} bm_archive_reader_st;
+
+// writes the header; the directory is held in memory from `alloc` until bm_archive_finish
+void bm_archive_writer_init(bm_archive_writer_st *aw, const bm_allocator_st *alloc,
+	bm_dump_f f_dump, void *user);
+// starts a new entry; `source_size` is only recorded in the directory
+void bm_archive_begin(bm_archive_writer_st *aw, const char *name, int source_size);
+void bm_archive_event(bm_delta_ev_st event, void *aw); // compatible with bm_event_f
+void bm_archive_end(bm_archive_writer_st *aw);
+// decodes a MIDI file into a new entry; returns aw->ok
+bool bm_archive_add(bm_archive_writer_st *aw, const char *name, const uint8_t *data, int size,
+	bm_warn_f f_warn, void *user);
+// writes the directory and frees it; returns false if any part of the archive failed to write
+bool bm_archive_finish(bm_archive_writer_st *aw);
+
+// `data` must be aligned to 8 bytes, and stay valid while the archive is used
+bool bm_archive_open(bm_archive_st *ar, const void *data, size_t size);
+// returns NULL if the name is damaged
+const char *bm_archive_name(const bm_archive_st *ar, int index);
+void bm_archive_reader_init(bm_archive_reader_st *rd, const bm_archive_st *ar, int index);
+// returns false once there are no more events
+bool bm_archive_reader_next(bm_archive_reader_st *rd, bm_delta_ev_st *event_out);
+// sends every event of an entry to f_event; returns false if the entry is damaged
+bool bm_archive_read(const bm_archive_st *ar, int index, bm_event_f f_event, void *user);
+
+// piano-roll pyramids
+//
+// A precomputed piano roll at every zoom level, so a viewer can draw any part of a song at any
+// zoom by copying a few tiles.  Each channel has one row per key and one byte per column of time,
+// holding how much of the column the key is sounding, from 0 (silent) to 255 (the whole column);
+// notes that overlap on the same key add up, stopping at 255.  Columns at level 0 are `base_ticks`
+// long, and each level above halves the resolution, with every cell the average of the two cells
+// below it, rounded up so anything that sounds stays visible.  Levels are added until one tile
+// covers the whole song.
+//
+// Levels are cut into tiles BM_ROLL_TILE columns wide, and each tile only stores the rows between
+// the lowest and highest keys it uses; tiles with no notes aren't stored at all.  Every level has
+// an index of tile offsets, so finding a tile takes constant time, and drawing a region only reads
+// the tiles it covers.  Like the event cache, a file can be used in place with no parsing.
+//
+// Layout:
+//   bm_roll_hdr_st
+//   bm_roll_level_st[levels]
+//   uint32_t[16][tiles] for each level       tile offsets by channel, 0 for empty tiles
+//   bm_roll_tile_st, then (high - low + 1) rows of BM_ROLL_TILE bytes, for each stored tile
+
+#define BM_ROLL_MAGIC   0x52524D42 // "BMRR" when stored little-endian
+#define BM_ROLL_VERSION 1
+#define BM_ROLL_TILE    256 // columns per tile
+
+typedef struct {
+	uint32_t magic;           // BM_ROLL_MAGIC
+	uint32_t version;         // BM_ROLL_VERSION
+	uint32_t header_size;     // sizeof(bm_roll_hdr_st)
+	uint32_t tile_width;      // BM_ROLL_TILE
+	uint32_t base_ticks;      // ticks per column at level 0
+	uint32_t columns;         // columns at level 0 that hold any part of the song
+	uint32_t levels;          // number of zoom levels
+	uint32_t levels_offset;   // byte offset of the level table
+} bm_roll_hdr_st;
+
+typedef struct {
+	uint32_t columns;         // columns that hold any part of the song at this level
+	uint32_t tiles;           // tiles per channel, enough to hold every column
+	uint32_t index_offset;    // byte offset of the level's tile offsets
+	uint32_t reserved;        // always 0
+} bm_roll_level_st;
+
+typedef struct {
+	uint8_t low;              // lowest key stored
+	uint8_t high;             // highest key stored
+	uint16_t reserved;        // always 0
+} bm_roll_tile_st;
+
+typedef struct {
+	const bm_roll_hdr_st *hdr;
+	const bm_roll_level_st *levels;
+	const uint8_t *data;
+	int size;
+} bm_roll_st;
+
+// builds the pyramid for notes from bm_notepair, holding every level in memory from `alloc` while
+// it's written; returns false if that runs out of memory, or if f_dump fails
+bool bm_writeroll(const bm_note_st *notes, int size, uint32_t base_ticks,
+	const bm_allocator_st *alloc, bm_dump_f f_dump, void *user);
+bool bm_rollopen(bm_roll_st *roll, const void *data, int size);
+// returns the rows of a tile, from key *low_out to *high_out, each BM_ROLL_TILE bytes, or NULL if
+// the tile is empty (or doesn't exist); column c of the tile covers ticks starting at
+// ((tile * BM_ROLL_TILE + c) * base_ticks) << level
+const uint8_t *bm_rolltile(const bm_roll_st *roll, int level, int channel, int tile,
+	int *low_out, int *high_out);
+
+// absolute-time writing
+//
+// Writes a format 1 file from events stamped with absolute ticks instead of deltas, which can
+// arrive somewhat out of order.  Events wait in a min-heap that holds `window` events, and once it
+// fills up, the earliest event (by tick, then by arrival) is written for every new one, so an event
+// can arrive up to `window` events late and still be put in order.  Events that arrive later than
+// that are written at the tick of the last event written, with a warning.
+//
+// Events are split into tracks either by channel (BM_ABSWRITER_CHANNEL: track 0 holds the events
+// without a channel, like TEMPO, and channel N goes to track N + 1), or by a key the caller gives
+// with each event (BM_ABSWRITER_KEY), up to BM_ABSWRITER_TRACKS tracks.  Only tracks that get
+// events are written, in order, except track 0 is always written.  Every track's length comes
+// before its data, and tracks can't be finished until the song is, so each track is spooled to a
+// tmpfile() as it's encoded; memory use depends on the window, not the length of the song.  The
+// divisor is set by bm_abswriter_init, so RESET events are dropped.  f_dump and f_warn share
+// `user`.
+
+#define BM_ABSWRITER_CHANNEL 0
+#define BM_ABSWRITER_KEY     1
+#define BM_ABSWRITER_TRACKS  64
+
+typedef struct {
+	bool ok;                  // false once a write fails or memory runs out
+	// this should be considered private, but it is exposed here to allow for static allocation
+	bm_allocator_st alloc;
+	bm_dump_f f_dump;
+	bm_warn_f f_warn;
+	void *user;
+	int divisor;
+	int split;                // BM_ABSWRITER_CHANNEL or BM_ABSWRITER_KEY
+	struct bm_abswriter_slot_struct *heap;
+	int heap_size;
+	int window;
+	uint64_t seq;             // arrival counter, which breaks ties between equal ticks
+	uint32_t tick;            // tick of the last event written
+	struct bm_abswriter_track_struct *tracks[BM_ABSWRITER_TRACKS];
+} bm_abswriter_st;
+
+// returns false if the window can't be allocated from `alloc` (NULL for the system allocator)
+bool bm_abswriter_init(bm_abswriter_st *aw, int divisor, int window, int split,
+	const bm_allocator_st *alloc, bm_dump_f f_dump, bm_warn_f f_warn, void *user);
+// `key` picks the track for BM_ABSWRITER_KEY, and is ignored for BM_ABSWRITER_CHANNEL
+void bm_abswriter_event(bm_abswriter_st *aw, uint32_t tick, bm_ev_st ev, int key);
+// writes out the held events and the whole file, and frees everything; returns aw->ok
+bool bm_abswriter_finish(bm_abswriter_st *aw);
+
+// latency tracing
+//
+// Measures how long bytes from a live device take to become state changes.  The caller stamps
+// each buffer with bm_trace_now as soon as it arrives, and bm_devicebytes_traced decodes it like
+// bm_devicebytes, applies each event to `state`, and stamps each event with when its buffer
+// arrived, when it was decoded, and when it was applied.  Once the consumer is done with an event,
+// it passes the event's stamp to bm_trace_consumed, which finishes the event's measurements.
+//
+// Each stage is counted in nanoseconds, in its own histogram.  Reading the clock costs around
+// two timestamps per message, so it only happens when `trace` or `stamps_out` is set; with both
+// NULL, bm_devicebytes_traced is bm_devicebytes followed by bm_update, and bm_devicebytes itself
+// is never traced.  Like playback, this needs the monotonic clock, so it's left out when
+// BM_PLAYBACK is 0.
+
+#if BM_PLAYBACK
+
+typedef enum {
+	BM_STAGE_QUEUE,           // from the buffer's arrival until its message starts decoding
+	BM_STAGE_DECODE,          // decoding the message
+	BM_STAGE_UPDATE,          // applying the event to the state
+	BM_STAGE_CONSUMER         // from the update until bm_trace_consumed
+} bm_stage;
+
+#define BM_STAGES 4
+
+typedef struct {
+	bm_histogram_st stages[BM_STAGES];
+	bm_histogram_st total;    // from the buffer's arrival until bm_trace_consumed
+} bm_trace_st;
+
+typedef struct {
+	uint64_t arrival_ns;
+	uint64_t decoded_ns;
+	uint64_t updated_ns;
+} bm_stamp_st;
+
+// the monotonic clock, in nanoseconds
+uint64_t bm_trace_now();
+void bm_trace_init(bm_trace_st *tr);
+// `state` can be NULL if the caller applies the events itself, which leaves the update stage empty
+int  bm_devicebytes_traced(bm_device_st *device, bm_state_st *state, const uint8_t *data,
+	int size, uint64_t arrival_ns, bm_ev_st *events_out, bm_stamp_st *stamps_out,
+	int max_events_size, bm_trace_st *trace, bm_warn_f f_warn, void *user);
+void bm_trace_consumed(bm_trace_st *tr, const bm_stamp_st *stamp);
+
+#endif // BM_PLAYBACK
+
+// following
+//
+// Reads a MIDI file while it's still being written, like `tail -f`.  The reader keeps its place in
+// every track between calls, so each call only decodes the bytes that arrived since the last one.
+// After bm_reader_init_follow, pass the data so far to bm_reader_follow whenever the file grows,
+// then call bm_reader_next until it returns false, which means it's waiting for more data.  The
+// data can move between calls, but the bytes already passed in can't change.
+//
+// A track that stops partway through a message or timestamp is treated as unfinished instead of
+// truncated, and since any track could have the next event, events are only produced once every
+// track in the sequence has its next timestamp.  A sequence starts once all of the tracks its
+// header reports have begun.  A track chunk whose length is 0 or over 16 MB is taken to be a
+// placeholder for a length that isn't known yet, so the track ends at its End of Track event.
+// Once `complete` is set, the reader finishes the file like bm_reader_next normally does,
+// including the warnings for anything left unfinished.  Searching for misaligned chunks would mean
+// searching the same data again every time more arrives, so the reader waits at damaged data until
+// the file is complete, and searches it then.
+
+void bm_reader_init_follow(bm_reader_st *reader, bm_warn_f f_warn, void *user);
+void bm_reader_follow(bm_reader_st *reader, const uint8_t *data, int size, bool complete);
+
+// slices
+//
+// Meta events and SysEx messages are normally dropped, unless they set the tempo, master volume or
+// master balance.  Setting `slices` on a bm_device_st or bm_reader_st after init makes them produce
+// BM_EV_META and BM_EV_SYSEX events for the kinds asked for, and each of those events holds the
+// offset of its message in the data it was decoded from.  bm_slice turns that into a pointer and
+// length inside the same data, so nothing is copied or allocated, and decoding is unchanged when
+// `slices` is 0.  An offset stays valid as long as the data does, even when a followed file moves
+// to a bigger buffer.  bm_reader_next offsets are from the start of the file, and bm_devicebytes
+// offsets are from the start of the data passed to that call.  bm_pack keeps 24 bits of the
+// offset, so packed slices only work for data under 16 MB.
+
+#define BM_SLICE_TEXT    0x01 // meta events 01 to 0F: text, copyright, names, lyrics, markers, etc
+#define BM_SLICE_TIMESIG 0x02 // Time Signature meta events
+#define BM_SLICE_KEYSIG  0x04 // Key Signature meta events
+#define BM_SLICE_META    0x08 // every other meta event, except End of Track and Set Tempo
+#define BM_SLICE_SYSEX   0x10 // SysEx messages, except Master Volume and Master Balance
+#define BM_SLICE_ALL     0x1F
+
+typedef struct {
+	int kind;                 // meta event type, 0xF0/0xF7 for SysEx, or -1 for other events
+	const uint8_t *data;      // payload, pointing into the data the event was decoded from
+	int size;                 // payload bytes
+} bm_slice_st;
+
+// `data` must be the same data the event's offset is from
+bm_slice_st bm_slice(const uint8_t *data, bm_ev_st ev);
 
 // calculates the number of samples that `ticks` represents, using the state's divisor and tempo,
 // along with the samples per second
@@ -409,108 +1520,221 @@ static inline int bm_samples(uint16_t divisor, uint32_t tempo, int sample_rate,
 // event construction helpers
 
 static inline bm_ev_st bm_ev_reset(int divisor){
-	return (bm_ev_st){
-		.type = BM_EV_RESET,
-		.u.reset = divisor & 0xFFFF
-	};
+	bm_ev_st ev = { BM_EV_RESET, { 0 } };
+	ev.u.reset = divisor & 0xFFFF;
+	return ev;
 }
 
 static inline bm_ev_st bm_ev_tempo(int tempo){
-	return (bm_ev_st){
-		.type = BM_EV_TEMPO,
-		.u.tempo = tempo & 0xFFFFFF
-	};
+	bm_ev_st ev = { BM_EV_TEMPO, { 0 } };
+	ev.u.tempo = tempo & 0xFFFFFF;
+	return ev;
 }
 
 static inline bm_ev_st bm_ev_mastvol(int mastvol){
-	return (bm_ev_st){
-		.type = BM_EV_MASTVOL,
-		.u.mastvol = mastvol & 0x3FFF
-	};
+	bm_ev_st ev = { BM_EV_MASTVOL, { 0 } };
+	ev.u.mastvol = mastvol & 0x3FFF;
+	return ev;
 }
 
 static inline bm_ev_st bm_ev_mastpan(int mastpan){
-	return (bm_ev_st){
-		.type = BM_EV_MASTPAN,
-		.u.mastpan = ((int16_t)(mastpan << 2)) >> 2
-	};
+	bm_ev_st ev = { BM_EV_MASTPAN, { 0 } };
+	ev.u.mastpan = ((int16_t)(mastpan << 2)) >> 2;
+	return ev;
 }
 
 static inline bm_ev_st bm_ev_noteoff(int channel, int note){
-	return (bm_ev_st){
-		.type = BM_EV_NOTEOFF,
-		.u.noteoff.channel = channel & 0xF,
-		.u.noteoff.note = note & 0x7F
-	};
+	bm_ev_st ev = { BM_EV_NOTEOFF, { 0 } };
+	ev.u.noteoff.channel = channel & 0xF;
+	ev.u.noteoff.note = note & 0x7F;
+	return ev;
 }
 
 static inline bm_ev_st bm_ev_noteon(int channel, int note, int velocity){
 	if (velocity <= 0)
 		return bm_ev_noteoff(channel, note);
-	else{
-		return (bm_ev_st){
-			.type = BM_EV_NOTEON,
-			.u.noteon.channel = channel & 0xF,
-			.u.noteon.note = channel & 0x7F,
-			.u.noteon.velocity = velocity & 0x7F
-		};
-	}
+	bm_ev_st ev = { BM_EV_NOTEON, { 0 } };
+	ev.u.noteon.channel = channel & 0xF;
+	ev.u.noteon.note = note & 0x7F;
+	ev.u.noteon.velocity = velocity & 0x7F;
+	return ev;
 }
 
 static inline bm_ev_st bm_ev_pedalon(int channel, int pedal){
-	return (bm_ev_st){
-		.type = BM_EV_PEDALON,
-		.u.pedalon.channel = channel & 0xF,
-		.u.pedalon.pedal = ((pedal % 6) + 6) % 6
-	};
+	bm_ev_st ev = { BM_EV_PEDALON, { 0 } };
+	ev.u.pedalon.channel = channel & 0xF;
+	ev.u.pedalon.pedal = ((pedal % 6) + 6) % 6;
+	return ev;
 }
 
 static inline bm_ev_st bm_ev_pedaloff(int channel, int pedal){
-	return (bm_ev_st){
-		.type = BM_EV_PEDALOFF,
-		.u.pedaloff.channel = channel & 0xF,
-		.u.pedaloff.pedal = ((pedal % 6) + 6) % 6
-	};
+	bm_ev_st ev = { BM_EV_PEDALOFF, { 0 } };
+	ev.u.pedaloff.channel = channel & 0xF;
+	ev.u.pedaloff.pedal = ((pedal % 6) + 6) % 6;
+	return ev;
 }
 
 static inline bm_ev_st bm_ev_chanvol(int channel, int vol){
-	return (bm_ev_st){
-		.type = BM_EV_CHANVOL,
-		.u.chanvol.channel = channel & 0xF,
-		.u.chanvol.vol = vol & 0x3FFF
-	};
+	bm_ev_st ev = { BM_EV_CHANVOL, { 0 } };
+	ev.u.chanvol.channel = channel & 0xF;
+	ev.u.chanvol.vol = vol & 0x3FFF;
+	return ev;
 }
 
 static inline bm_ev_st bm_ev_chanpan(int channel, int pan){
-	return (bm_ev_st){
-		.type = BM_EV_CHANPAN,
-		.u.chanpan.channel = channel & 0xF,
-		.u.chanpan.pan = ((int16_t)(pan << 2)) >> 2
-	};
+	bm_ev_st ev = { BM_EV_CHANPAN, { 0 } };
+	ev.u.chanpan.channel = channel & 0xF;
+	ev.u.chanpan.pan = ((int16_t)(pan << 2)) >> 2;
+	return ev;
 }
 
 static inline bm_ev_st bm_ev_patch(int channel, int patch){
-	return (bm_ev_st){
-		.type = BM_EV_PATCH,
-		.u.patch.channel = channel & 0xF,
-		.u.patch.patch = ((patch % 265) + 265) % 265
-	};
+	bm_ev_st ev = { BM_EV_PATCH, { 0 } };
+	ev.u.patch.channel = channel & 0xF;
+	ev.u.patch.patch = ((patch % 265) + 265) % 265;
+	return ev;
 }
 
 static inline bm_ev_st bm_ev_bend(int channel, int bend){
-	return (bm_ev_st){
-		.type = BM_EV_BEND,
-		.u.bend.channel = channel & 0xF,
-		.u.bend.bend = ((int16_t)(bend << 2)) >> 2
-	};
+	bm_ev_st ev = { BM_EV_BEND, { 0 } };
+	ev.u.bend.channel = channel & 0xF;
+	ev.u.bend.bend = ((int16_t)(bend << 2)) >> 2;
+	return ev;
 }
 
 static inline bm_ev_st bm_ev_mod(int channel, int mod){
-	return (bm_ev_st){
-		.type = BM_EV_MOD,
-		.u.mod.channel = channel & 0xF,
-		.u.mod.mod = mod & 0x3FFF
-	};
+	bm_ev_st ev = { BM_EV_MOD, { 0 } };
+	ev.u.mod.channel = channel & 0xF;
+	ev.u.mod.mod = mod & 0x3FFF;
+	return ev;
+}
+
+// packed event conversion
+
+static inline bm_packed_ev_st bm_pack(bm_delta_ev_st dev){
+	const bm_ev_st *ev = &dev.ev;
+	bm_packed_ev_st pk = { (uint32_t)dev.delta, (uint8_t)ev->type, 0, 0 };
+	switch (ev->type){
+		case BM_EV_RESET:
+			pk.data = ev->u.reset;
+			break;
+		case BM_EV_TEMPO:
+			pk.channel = (ev->u.tempo >> 16) & 0xFF;
+			pk.data = ev->u.tempo & 0xFFFF;
+			break;
+		case BM_EV_MASTVOL:
+			pk.data = ev->u.mastvol;
+			break;
+		case BM_EV_MASTPAN:
+			pk.data = (uint16_t)ev->u.mastpan;
+			break;
+		case BM_EV_NOTEON:
+			pk.channel = ev->u.noteon.channel;
+			pk.data = ev->u.noteon.note | (ev->u.noteon.velocity << 8);
+			break;
+		case BM_EV_NOTEOFF:
+			pk.channel = ev->u.noteoff.channel;
+			pk.data = ev->u.noteoff.note;
+			break;
+		case BM_EV_PEDALON:
+			pk.channel = ev->u.pedalon.channel;
+			pk.data = ev->u.pedalon.pedal;
+			break;
+		case BM_EV_PEDALOFF:
+			pk.channel = ev->u.pedaloff.channel;
+			pk.data = ev->u.pedaloff.pedal;
+			break;
+		case BM_EV_CHANVOL:
+			pk.channel = ev->u.chanvol.channel;
+			pk.data = ev->u.chanvol.vol;
+			break;
+		case BM_EV_CHANPAN:
+			pk.channel = ev->u.chanpan.channel;
+			pk.data = (uint16_t)ev->u.chanpan.pan;
+			break;
+		case BM_EV_PATCH:
+			pk.channel = ev->u.patch.channel;
+			pk.data = ev->u.patch.patch;
+			break;
+		case BM_EV_BEND:
+			pk.channel = ev->u.bend.channel;
+			pk.data = (uint16_t)ev->u.bend.bend;
+			break;
+		case BM_EV_MOD:
+			pk.channel = ev->u.mod.channel;
+			pk.data = ev->u.mod.mod;
+			break;
+		case BM_EV_META:
+		case BM_EV_SYSEX:
+			pk.channel = (ev->u.slice >> 16) & 0xFF;
+			pk.data = ev->u.slice & 0xFFFF;
+			break;
+	}
+	return pk;
+}
+
+static inline bm_delta_ev_st bm_unpack(bm_packed_ev_st pk){
+	bm_delta_ev_st dev = { (int)pk.delta, { (bm_ev_type)pk.type, { 0 } } };
+	switch (pk.type){
+		case BM_EV_RESET:
+			dev.ev.u.reset = pk.data;
+			break;
+		case BM_EV_TEMPO:
+			dev.ev.u.tempo = ((uint32_t)pk.channel << 16) | pk.data;
+			break;
+		case BM_EV_MASTVOL:
+			dev.ev.u.mastvol = pk.data;
+			break;
+		case BM_EV_MASTPAN:
+			dev.ev.u.mastpan = (int16_t)pk.data;
+			break;
+		case BM_EV_NOTEON:
+			dev.ev.u.noteon.channel = pk.channel;
+			dev.ev.u.noteon.note = pk.data & 0xFF;
+			dev.ev.u.noteon.velocity = pk.data >> 8;
+			break;
+		case BM_EV_NOTEOFF:
+			dev.ev.u.noteoff.channel = pk.channel;
+			dev.ev.u.noteoff.note = pk.data;
+			break;
+		case BM_EV_PEDALON:
+			dev.ev.u.pedalon.channel = pk.channel;
+			dev.ev.u.pedalon.pedal = pk.data;
+			break;
+		case BM_EV_PEDALOFF:
+			dev.ev.u.pedaloff.channel = pk.channel;
+			dev.ev.u.pedaloff.pedal = pk.data;
+			break;
+		case BM_EV_CHANVOL:
+			dev.ev.u.chanvol.channel = pk.channel;
+			dev.ev.u.chanvol.vol = pk.data;
+			break;
+		case BM_EV_CHANPAN:
+			dev.ev.u.chanpan.channel = pk.channel;
+			dev.ev.u.chanpan.pan = (int16_t)pk.data;
+			break;
+		case BM_EV_PATCH:
+			dev.ev.u.patch.channel = pk.channel;
+			dev.ev.u.patch.patch = pk.data;
+			break;
+		case BM_EV_BEND:
+			dev.ev.u.bend.channel = pk.channel;
+			dev.ev.u.bend.bend = (int16_t)pk.data;
+			break;
+		case BM_EV_MOD:
+			dev.ev.u.mod.channel = pk.channel;
+			dev.ev.u.mod.mod = pk.data;
+			break;
+		case BM_EV_META:
+		case BM_EV_SYSEX:
+			dev.ev.u.slice = ((uint32_t)pk.channel << 16) | pk.data;
+			break;
+	}
+	return dev;
+}
+
+#ifdef __cplusplus
 }
+#endif
 
 #endif // BASICMIDI__H
@@ -0,0 +1,91 @@
+// (c) Copyright 2018, Sean Connelly (@voidqk), http://sean.cm
+// MIT License
+// Project Home: https://github.com/voidqk/basicmidi
+
+// C++ wrapper around the pull reader in basicmidi.h (requires C++17)
+//
+// bm::read takes the handler's type as a template parameter, and decodes with the inline copy of
+// the reader's inner loop in basicmidi_decode.h, so the merge of the tracks, the decoding of each
+// message, and the handler's event code all compile into one loop per handler.  Only the setup of
+// each header and format 2 pattern, and the end of the data, go through bm_reader_next.
+//
+// A handler is either an object with `on_event(const bm_delta_ev_st &)` and an optional
+// `on_warn(const char *)`, or anything callable with a `const bm_delta_ev_st &`:
+//
+//   struct counter {
+//       int notes = 0;
+//       void on_event(const bm_delta_ev_st &ev){ notes += ev.ev.type == BM_EV_NOTEON; }
+//   } c;
+//   bm::read(data, c);
+//
+// Handlers without `on_warn` don't receive warnings, and the decoder is instantiated without them,
+// so their formatting is removed at compile time.
+
+#ifndef BASICMIDI__HPP
+#define BASICMIDI__HPP
+
+#include "basicmidi.h"
+#include "basicmidi_decode.h"
+#include <type_traits>
+#include <utility>
+
+namespace bm {
+
+namespace detail {
+	template <typename H, typename = void>
+	struct has_on_event : std::false_type {};
+	template <typename H>
+	struct has_on_event<H, std::void_t<decltype(
+		std::declval<H &>().on_event(std::declval<const bm_delta_ev_st &>()))>> : std::true_type {};
+
+	template <typename H, typename = void>
+	struct has_on_warn : std::false_type {};
+	template <typename H>
+	struct has_on_warn<H, std::void_t<decltype(
+		std::declval<H &>().on_warn(std::declval<const char *>()))>> : std::true_type {};
+
+	template <typename H>
+	void forward_warn(const char *msg, void *user){
+		static_cast<H *>(user)->on_warn(msg);
+	}
+}
+
+// decodes the MIDI file in data[0..size), sending every event to the handler
+template <typename Handler>
+inline void read(const uint8_t *data, int size, Handler &&handler){
+	using H = std::remove_reference_t<Handler>;
+	static_assert(detail::has_on_event<H>::value ||
+		std::is_invocable<H &, const bm_delta_ev_st &>::value,
+		"handler needs on_event(const bm_delta_ev_st &), or to be callable with an event");
+	constexpr bool warns = detail::has_on_warn<H>::value;
+	bm_reader_st reader;
+	if constexpr (warns)
+		bm_reader_init(&reader, data, size, detail::forward_warn<H>, &handler);
+	else
+		bm_reader_init(&reader, data, size, nullptr, nullptr);
+	bm_delta_ev_st ev;
+	while (true){
+		if (reader.hd_format >= 0 || reader.pattern_pending ||
+			!detail::reader_merge<warns>(&reader, &ev)){
+			// the open tracks have finished, or the next ones need to be set up
+			if (!bm_reader_next(&reader, &ev))
+				break;
+		}
+		if constexpr (detail::has_on_event<H>::value)
+			handler.on_event(ev);
+		else
+			handler(ev);
+	}
+}
+
+// accepts any contiguous container of bytes, like std::vector<uint8_t> or std::string
+template <typename Bytes, typename Handler>
+inline auto read(const Bytes &data, Handler &&handler)
+	-> decltype((void)data.data(), (void)data.size()){
+	static_assert(sizeof(*data.data()) == 1, "data must be a container of bytes");
+	read(reinterpret_cast<const uint8_t *>(data.data()), static_cast<int>(data.size()), handler);
+}
+
+} // namespace bm
+
+#endif // BASICMIDI__HPP
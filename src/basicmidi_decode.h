@@ -0,0 +1,683 @@
+// (c) Copyright 2018, Sean Connelly (@voidqk), http://sean.cm
+// MIT License
+// Project Home: https://github.com/voidqk/basicmidi
+
+// the decoder's inner loop, shared by basicmidi.c and basicmidi.hpp (not part of the public API)
+//
+// Everything here is static inline, so bm::read can compile the merge of the open tracks and the
+// decoding of each message into its own loop, instead of calling bm_reader_next for every event.
+// In C++ the functions that warn are templates on DECODE_WARNS, and instantiating them with false
+// removes every warning at compile time; in C they always warn, and check f_warn at runtime.
+
+#ifndef BASICMIDI_DECODE__H
+#define BASICMIDI_DECODE__H
+
+#include "basicmidi.h"
+#include <stdarg.h>
+#include <stdio.h>
+
+#ifdef __cplusplus
+#	define DECODE_FN template <bool DECODE_WARNS> static inline
+#	define DECODE(fn) fn<DECODE_WARNS>
+namespace bm {
+namespace detail {
+#else
+#	define DECODE_FN static inline
+#	define DECODE(fn) fn
+#	define DECODE_WARNS 1
+#endif
+
+// index < 256 for melody, index >= 256 for percussion
+// 0xQQRR   QQ = Program Change code, RR = Bank code
+static const uint16_t patch_midi[265] = {
+	0x0000, 0x0001, 0x0002, 0x0100, 0x0101, 0x0200, 0x0201, 0x0300,
+	0x0301, 0x0400, 0x0401, 0x0402, 0x0403, 0x0500, 0x0501, 0x0502,
+	0x0503, 0x0504, 0x0600, 0x0601, 0x0602, 0x0603, 0x0700, 0x0701,
+	0x0800, 0x0900, 0x0A00, 0x0B00, 0x0B01, 0x0C00, 0x0C01, 0x0D00,
+	0x0E00, 0x0E01, 0x0E02, 0x0F00, 0x1000, 0x1001, 0x1002, 0x1003,
+	0x1100, 0x1101, 0x1102, 0x1200, 0x1300, 0x1301, 0x1302, 0x1400,
+	0x1401, 0x1500, 0x1501, 0x1600, 0x1700, 0x1800, 0x1801, 0x1802,
+	0x1803, 0x1900, 0x1901, 0x1902, 0x1903, 0x1A00, 0x1A01, 0x1B00,
+	0x1B01, 0x1B02, 0x1C00, 0x1C01, 0x1C02, 0x1C03, 0x1D00, 0x1D01,
+	0x1E00, 0x1E01, 0x1E02, 0x1F00, 0x1F01, 0x2000, 0x2100, 0x2101,
+	0x2200, 0x2300, 0x2400, 0x2500, 0x2600, 0x2601, 0x2602, 0x2603,
+	0x2604, 0x2700, 0x2701, 0x2702, 0x2703, 0x2800, 0x2801, 0x2900,
+	0x2A00, 0x2B00, 0x2C00, 0x2D00, 0x2E00, 0x2E01, 0x2F00, 0x3000,
+	0x3001, 0x3002, 0x3100, 0x3200, 0x3201, 0x3300, 0x3400, 0x3401,
+	0x3500, 0x3501, 0x3600, 0x3601, 0x3700, 0x3701, 0x3702, 0x3703,
+	0x3800, 0x3801, 0x3900, 0x3901, 0x3902, 0x3A00, 0x3B00, 0x3B01,
+	0x3C00, 0x3C01, 0x3D00, 0x3D01, 0x3E00, 0x3E01, 0x3E02, 0x3E03,
+	0x3F00, 0x3F01, 0x3F02, 0x4000, 0x4100, 0x4200, 0x4300, 0x4400,
+	0x4500, 0x4600, 0x4700, 0x4800, 0x4900, 0x4A00, 0x4B00, 0x4C00,
+	0x4D00, 0x4E00, 0x4F00, 0x5000, 0x5001, 0x5002, 0x5100, 0x5101,
+	0x5102, 0x5103, 0x5104, 0x5200, 0x5300, 0x5400, 0x5401, 0x5500,
+	0x5600, 0x5700, 0x5701, 0x5800, 0x5900, 0x5901, 0x5A00, 0x5B00,
+	0x5B01, 0x5C00, 0x5D00, 0x5E00, 0x5F00, 0x6000, 0x6100, 0x6200,
+	0x6201, 0x6300, 0x6400, 0x6500, 0x6600, 0x6601, 0x6602, 0x6700,
+	0x6000, 0x6001, 0x6100, 0x6200, 0x6300, 0x6301, 0x6400, 0x6500,
+	0x6600, 0x6700, 0x7000, 0x7100, 0x7200, 0x7300, 0x7301, 0x7400,
+	0x7401, 0x7500, 0x7501, 0x7600, 0x7601, 0x7602, 0x7700, 0x7800,
+	0x7801, 0x7802, 0x7900, 0x7901, 0x7A00, 0x7A01, 0x7A02, 0x7A03,
+	0x7A04, 0x7A05, 0x7B00, 0x7B01, 0x7B02, 0x7B03, 0x7C00, 0x7C01,
+	0x7C02, 0x7C03, 0x7C04, 0x7C05, 0x7D00, 0x7D01, 0x7D02, 0x7D03,
+	0x7D04, 0x7D05, 0x7D06, 0x7D07, 0x7D08, 0x7D09, 0x7E00, 0x7E01,
+	0x7E02, 0x7E03, 0x7E04, 0x7E05, 0x7F00, 0x7F01, 0x7F02, 0x7F03,
+	0x0000, 0x0800, 0x1000, 0x1800, 0x1900, 0x2000, 0x2800, 0x3000,
+	0x3800
+};
+
+#ifndef BM_STATS
+#	define BM_STATS 1
+#endif
+
+#if BM_STATS && !defined(__cplusplus)
+#	define STATS(stats) (stats)
+#else
+// a constant NULL lets the compiler remove every counter; bm::read doesn't count anything
+#	define STATS(stats) ((bm_stats_st *)NULL)
+#endif
+
+static inline uint64_t stats_cycles(){
+#if BM_STATS && (defined(__x86_64__) || defined(__i386__))
+	return __builtin_ia32_rdtsc();
+#elif BM_STATS && defined(__aarch64__)
+	uint64_t v;
+	__asm__ volatile ("mrs %0, cntvct_el0" : "=r" (v));
+	return v;
+#else
+	return 0;
+#endif
+}
+
+static inline void warn(bm_warn_f f_warn, void *user, bm_stats_st *stats, bm_warn_category category,
+	const char *fmt, ...){
+	if (STATS(stats))
+		stats->warnings[category]++;
+	if (f_warn == NULL)
+		return;
+	va_list args;
+	va_start(args, fmt);
+	char buf[100];
+	vsnprintf(buf, sizeof(buf), fmt, args);
+	va_end(args);
+	f_warn(buf, user);
+}
+
+// the decoder warns through this, so an instantiation without warnings or stats drops the call,
+// along with the formatting of its arguments, at compile time
+#define WARN(f_warn, user, stats, ...)                   \
+	do{                                                  \
+		if (DECODE_WARNS || STATS(stats))                \
+			warn(f_warn, user, stats, __VA_ARGS__);      \
+	} while (0)
+
+static inline const char *ss(int num){
+	return num == 1 ? "" : "s";
+}
+
+// reads the variable length quantity at data[*p] that gives the data length of a SysEx or meta
+// event, moving *p past it; returns 1 if it was read, 0 if it runs out of data, or -1 if it doesn't
+// terminate within 4 bytes
+static inline int data_length(const uint8_t *data, int *p, int data_size, int *length){
+	int dl = 0;
+	int len = 0;
+	while (true){
+		if (*p >= data_size)
+			return 0;
+		len++;
+		if (len >= 5)
+			return -1;
+		int t = data[(*p)++];
+		dl = (dl << 7) | (t & 0x7F);
+		if ((t & 0x80) == 0)
+			break;
+	}
+	*length = dl;
+	return 1;
+}
+
+// BM_SLICE_* flag that asks for a meta event of the given type
+static inline int meta_slice(int type){
+	if (type >= 0x01 && type <= 0x0F)
+		return BM_SLICE_TEXT;
+	else if (type == 0x58)
+		return BM_SLICE_TIMESIG;
+	else if (type == 0x59)
+		return BM_SLICE_KEYSIG;
+	return BM_SLICE_META;
+}
+
+DECODE_FN int midi_single(const uint8_t *data, int data_size, bm_device_st *device,
+	bm_warn_f f_warn, void *user, bm_stats_st *stats, bm_ev_st *event_out, bool *end_of_track){
+	// read msg
+	int p = 0;
+	int msg = data[p++];
+	if (msg < 0x80){
+		// use running status
+		if (device->running_status < 0){
+			WARN(f_warn, user, stats, BM_WARN_MESSAGE, "Invalid message %02X", msg);
+			return p; // consume the bad data
+		}
+		else{
+			msg = device->running_status;
+			p--;
+		}
+	}
+
+	// interpret msg
+	if (msg >= 0x80 && msg < 0x90){ // Note-Off
+		if (p + 1 >= data_size){
+			WARN(f_warn, user, stats, BM_WARN_MESSAGE, "Bad Note-Off message (out of data)");
+			return data_size;
+		}
+		device->running_status = msg;
+		int note = data[p++];
+		int vel = data[p++];
+		if (note >= 0x80){
+			WARN(f_warn, user, stats, BM_WARN_MESSAGE, "Bad Note-Off message (invalid note %02X)",
+				note);
+			note ^= 0x80;
+		}
+		if (vel >= 0x80){
+			WARN(f_warn, user, stats, BM_WARN_MESSAGE,
+				"Bad Note-Off message (invalid velocity %02X)", vel);
+			vel ^= 0x80;
+		}
+		*event_out = bm_ev_noteoff(msg & 0x0F, note);
+		return p;
+	}
+	else if (msg >= 0x90 && msg < 0xA0){ // Note On
+		if (p + 1 >= data_size){
+			WARN(f_warn, user, stats, BM_WARN_MESSAGE, "Bad Note-On message (out of data)");
+			return data_size;
+		}
+		device->running_status = msg;
+		int note = data[p++];
+		int vel = data[p++];
+		if (note >= 0x80){
+			WARN(f_warn, user, stats, BM_WARN_MESSAGE, "Bad Note-On message (invalid note %02X)",
+				note);
+			note ^= 0x80;
+		}
+		if (vel >= 0x80){
+			WARN(f_warn, user, stats, BM_WARN_MESSAGE,
+				"Bad Note-On message (invalid velocity %02X)", vel);
+			vel ^= 0x80;
+		}
+		if (vel == 0){
+			*event_out = bm_ev_noteoff(msg & 0x0F, note);
+			return p;
+		}
+		*event_out = bm_ev_noteon(msg & 0x0F, note, vel);
+		return p;
+	}
+	else if (msg >= 0xA0 && msg < 0xB0){ // Note Pressure
+		if (p + 1 >= data_size){
+			WARN(f_warn, user, stats, BM_WARN_MESSAGE, "Bad Note Pressure message (out of data)");
+			return data_size;
+		}
+		device->running_status = msg;
+		int note = data[p++];
+		int pressure = data[p++];
+		if (note >= 0x80){
+			WARN(f_warn, user, stats, BM_WARN_MESSAGE,
+				"Bad Note Pressure message (invalid note %02X)", note);
+			note ^= 0x80;
+		}
+		if (pressure >= 0x80){
+			WARN(f_warn, user, stats, BM_WARN_MESSAGE,
+				"Bad Note Pressure message (invalid pressure %02X)", pressure);
+			pressure ^= 0x80;
+		}
+		return p;
+	}
+	else if (msg >= 0xB0 && msg < 0xC0){ // Control Change
+		if (p + 1 >= data_size){
+			WARN(f_warn, user, stats, BM_WARN_MESSAGE, "Bad Control Change message (out of data)");
+			return data_size;
+		}
+		device->running_status = msg;
+		int ctrl = data[p++];
+		int val = data[p++];
+		if (ctrl >= 0x80){
+			WARN(f_warn, user, stats, BM_WARN_MESSAGE,
+				"Bad Control Change message (invalid control %02X)", ctrl);
+			ctrl ^= 0x80;
+		}
+		if (val >= 0x80){
+			WARN(f_warn, user, stats, BM_WARN_MESSAGE,
+				"Bad Control Change message (invalid value %02X)", val);
+			val ^= 0x80;
+		}
+
+		int chan = msg & 0xF;
+		if (ctrl == 0x00) // Bank Select MSB
+			device->ctrls[chan].bank = 0x100000 | (val << 8);
+		else if (ctrl == 0x20) // Bank Select LSB
+			device->ctrls[chan].bank = (device->ctrls[chan].bank & 0xF0FF00) | 0x010000 | val;
+		else if (ctrl == 0x07 || ctrl == 0x27){ // Channel Volume
+			if (ctrl == 0x07) // MSB
+				device->ctrls[chan].vol = val << 7;
+			else // LSB
+				device->ctrls[chan].vol = (device->ctrls[chan].vol & 0x3F80) | val;
+			*event_out = bm_ev_chanvol(chan, device->ctrls[chan].vol);
+		}
+		else if (ctrl == 0x0A || ctrl == 0x2A){ // Channel Pan
+			if (ctrl == 0x0A) // MSB
+				device->ctrls[chan].pan = val << 7;
+			else // LSB
+				device->ctrls[chan].pan = (device->ctrls[chan].pan & 0x3F80) | val;
+			*event_out = bm_ev_chanpan(chan, device->ctrls[chan].pan - 0x2000);
+		}
+		else if (ctrl >= 0x40 && ctrl <= 0x45){ // Pedals, in the same order as BM_PEDAL_*
+			*event_out = val >= 0x40 ? bm_ev_pedalon(chan, ctrl - 0x40) :
+				bm_ev_pedaloff(chan, ctrl - 0x40);
+		}
+		return p;
+	}
+	else if (msg >= 0xC0 && msg < 0xD0){ // Program Change
+		if (p >= data_size){
+			WARN(f_warn, user, stats, BM_WARN_MESSAGE, "Bad Program Change message (out of data)");
+			return data_size;
+		}
+		device->running_status = msg;
+		int patch = data[p++];
+		if (patch >= 0x80){
+			WARN(f_warn, user, stats, BM_WARN_MESSAGE,
+				"Bad Program Change message (invalid patch %02X)", patch);
+			patch ^= 0x80;
+		}
+		int chan = msg & 0xF;
+		int bank = device->ctrls[chan].bank;
+		bool incomplete = (bank & 0x110000) != 0x110000;
+		bank &= 0xFFFF; // remove MSB/LSB flags
+		bool melody = (bank & 0xFF00) == 0x7900;
+		bool percussion = (bank & 0xFF00) == 0x7800;
+
+		if (bank == 0){
+			if (chan == 9){
+				WARN(f_warn, user, stats, BM_WARN_PATCH, "%s bank; assuming GM percussion",
+					incomplete ? "Incomplete" : "Empty");
+				percussion = true;
+			}
+			else{
+				WARN(f_warn, user, stats, BM_WARN_PATCH, "%s bank; assuming GM melody",
+					incomplete ? "Incomplete" : "Empty");
+				melody = true;
+			}
+			incomplete = false; // already warned, don't warn twice
+		}
+
+		if (melody || percussion){
+			if (incomplete)
+				WARN(f_warn, user, stats, BM_WARN_PATCH, "Incomplete bank");
+
+			// calculate patch based on format of patch_midi
+			patch = (patch << 8) | (bank & 0xFF);
+			int start = melody ? 0 : 256;
+			int end = melody ? 256 : 265;
+			for (int i = start; i < end; i++){
+				if (patch_midi[i] == patch){
+					*event_out = bm_ev_patch(chan, i);
+					return p;
+				}
+			}
+			patch >>= 8; // restore patch to old value
+
+			// unknown patch
+			if (percussion){
+				if (chan != 9){
+					// unknown percussion patch on melody channel, so use standard kit
+					*event_out = bm_ev_patch(chan, BM_PATCH_PERSND_STAN);
+					WARN(f_warn, user, stats, BM_WARN_PATCH,
+						"Unknown percussion patch %02X for bank %04X; "
+						"defaulting to standard kit", patch, bank);
+				}
+				else{
+					// unknown percussion patch on percussion channel, so ignore
+					WARN(f_warn, user, stats, BM_WARN_PATCH,
+						"Unknown percussion patch %02X for bank %04X; ignoring",
+						patch, bank);
+				}
+			}
+			else{
+				if (chan == 9){
+					// unknown melody patch on percussion channel, so use piano
+					*event_out = bm_ev_patch(chan, BM_PATCH_PIANO_ACGR);
+					WARN(f_warn, user, stats, BM_WARN_PATCH,
+						"Unknown melody patch %02X for bank %04X; "
+						"defaulting to acoustic piano", patch, bank);
+				}
+				else{
+					// unknown melody patch on melody channel, so ignore
+					WARN(f_warn, user, stats, BM_WARN_PATCH,
+						"Unknown melody patch %02X for bank %04X; ignoring",
+						patch, bank);
+				}
+			}
+		}
+		else{
+			WARN(f_warn, user, stats, BM_WARN_PATCH, "Unknown %sbank %04X for patch %02X",
+				incomplete ? "incomplete " : "", bank, patch);
+		}
+		return p;
+	}
+	else if (msg >= 0xD0 && msg < 0xE0){ // Channel Pressure
+		if (p >= data_size){
+			WARN(f_warn, user, stats, BM_WARN_MESSAGE,
+				"Bad Channel Pressure message (out of data)");
+			return data_size;
+		}
+		device->running_status = msg;
+		int pressure = data[p++];
+		if (pressure >= 0x80)
+			WARN(f_warn, user, stats, BM_WARN_MESSAGE,
+				"Bad Channel Pressure message (invalid pressure %02X)", pressure);
+		return p;
+	}
+	else if (msg >= 0xE0 && msg < 0xF0){ // Pitch Bend
+		if (p + 1 >= data_size){
+			WARN(f_warn, user, stats, BM_WARN_MESSAGE, "Bad Pitch Bend message (out of data)");
+			return data_size;
+		}
+		device->running_status = msg;
+		int p1 = data[p++];
+		int p2 = data[p++];
+		if (p1 >= 0x80){
+			WARN(f_warn, user, stats, BM_WARN_MESSAGE,
+				"Bad Pitch Bend message (invalid lower bits %02X)", p1);
+			p1 ^= 0x80;
+		}
+		if (p2 >= 0x80){
+			WARN(f_warn, user, stats, BM_WARN_MESSAGE,
+				"Bad Pitch Bend message (invalid higher bits %02X)", p2);
+			p2 ^= 0x80;
+		}
+		int chan = msg & 0xF;
+		int bend = p1 | (p2 << 7);
+		*event_out = bm_ev_bend(chan, bend - 0x2000);
+		return p;
+	}
+	else if (msg == 0xF0 || msg == 0xF7){ // SysEx Event
+		device->running_status = -1; // TODO: validate we should clear this
+		int dl = 0;
+		int res = data_length(data, &p, data_size, &dl);
+		if (res == 0){
+			WARN(f_warn, user, stats, BM_WARN_SYSEX, "Bad SysEx Event (out of data)");
+			return data_size;
+		}
+		else if (res < 0){
+			WARN(f_warn, user, stats, BM_WARN_SYSEX, "Bad SysEx Event (invalid data length)");
+			return 1; // consume the message
+		}
+		if (p + dl > data_size){
+			WARN(f_warn, user, stats, BM_WARN_SYSEX, "Bad SysEx Event (data length too large)");
+			return data_size;
+		}
+		if (dl == 7 &&
+			data[p + 0] == 0x7F &&
+			data[p + 2] == 0x04 &&
+			data[p + 6] == 0xF7){ // SysEx Real Time Device Control
+			if (data[p + 3] == 0x01){ // Master Volume
+				int v = (((int)(data[p + 5] & 0x7F)) << 7) | (data[p + 4] & 0x7F);
+				*event_out = bm_ev_mastvol(v);
+				return p + dl;
+			}
+			else if (data[p + 3] == 0x02){ // Master Balance
+				int v = (((int)(data[p + 5] & 0x7F)) << 7) | (data[p + 4] & 0x7F);
+				*event_out = bm_ev_mastpan(v - 0x2000);
+				return p + dl;
+			}
+		}
+		if (device->slices & BM_SLICE_SYSEX){
+			event_out->type = BM_EV_SYSEX;
+			event_out->u.slice = 0; // the caller adds where the message starts
+		}
+		return p + dl;
+	}
+	else if (msg == 0xFF){ // Meta Event
+		device->running_status = -1; // TODO: validate we should clear this
+		if (p + 1 >= data_size){
+			WARN(f_warn, user, stats, BM_WARN_META, "Bad Meta Event (out of data)");
+			return data_size;
+		}
+		int type = data[p++];
+		int len = 0;
+		int res = data_length(data, &p, data_size, &len);
+		if (res == 0){
+			WARN(f_warn, user, stats, BM_WARN_META, "Bad Meta Event (out of data)");
+			return data_size;
+		}
+		else if (res < 0){
+			WARN(f_warn, user, stats, BM_WARN_META, "Bad Meta Event (invalid data length)");
+			return 1; // consume the message
+		}
+		if (p + len > data_size){
+			WARN(f_warn, user, stats, BM_WARN_META, "Bad Meta Event (data length too large)");
+			return data_size;
+		}
+		if (type == 0x2F){ // 00  End of Track
+			if (len != 0)
+				WARN(f_warn, user, stats, BM_WARN_META,
+					"Expecting zero-length data for End of Track message");
+			if (p < data_size){
+				uint64_t pd = data_size - p;
+				WARN(f_warn, user, stats, BM_WARN_TRACK, "Extra data at end of track: %llu byte%s",
+					pd, ss(pd));
+			}
+			if (end_of_track)
+				*end_of_track = true;
+			return data_size;
+		}
+		else if (type == 0x51){ // 03 TT TT TT  Set Tempo
+			if (len < 3)
+				WARN(f_warn, user, stats, BM_WARN_META, "Missing data for Set Tempo event");
+			else{
+				if (len > 3)
+					WARN(f_warn, user, stats, BM_WARN_META, "Extra %d byte%s for Set Tempo event",
+						len - 3, ss(len - 3));
+				int tempo = ((int)data[p + 0] << 16) | ((int)data[p + 1] << 8) | data[p + 2];
+				if (tempo == 0)
+					WARN(f_warn, user, stats, BM_WARN_META, "Invalid tempo (0)");
+				else{
+					*event_out = bm_ev_tempo(tempo);
+				}
+			}
+		}
+		else if (device->slices & meta_slice(type)){
+			event_out->type = BM_EV_META;
+			event_out->u.slice = 0; // the caller adds where the message starts
+		}
+		return p + len;
+	}
+
+	device->running_status = -1;
+	WARN(f_warn, user, stats, BM_WARN_MESSAGE, "Unknown message type %02X", msg);
+	return 1; // consume the message
+}
+
+static inline bm_msg_type msg_type(int status){
+	if (status >= 0x80 && status < 0xF0)
+		return (bm_msg_type)((status >> 4) - 8);
+	else if (status == 0xF0 || status == 0xF7)
+		return BM_MSG_SYSEX;
+	else if (status == 0xFF)
+		return BM_MSG_META;
+	return BM_MSG_INVALID;
+}
+
+// wraps midi_single to count messages; event_out->type must be set to 99 beforehand
+DECODE_FN int midi_counted(const uint8_t *data, int data_size, bm_device_st *device,
+	bm_warn_f f_warn, void *user, bm_stats_st *stats, bm_ev_st *event_out, bool *end_of_track){
+	if (!STATS(stats))
+		return DECODE(midi_single)(data, data_size, device, f_warn, user, NULL, event_out,
+			end_of_track);
+	bm_msg_type type = msg_type(data[0] < 0x80 ? device->running_status : data[0]);
+	uint64_t c0 = stats->count_cycles ? stats_cycles() : 0;
+	int res = DECODE(midi_single)(data, data_size, device, f_warn, user, stats, event_out,
+		end_of_track);
+	if (stats->count_cycles)
+		stats->cycles[BM_PHASE_DECODE] += stats_cycles() - c0;
+	stats->messages[type]++;
+	if ((int)event_out->type == 99)
+		stats->dropped[type]++;
+	else
+		stats->events[event_out->type]++;
+	return res;
+}
+
+// midi_single places slices at the start of the message it was given, so this moves them to where
+// the message starts in the caller's data
+static inline void slice_at(bm_ev_st *ev, int offset){
+	if (ev->type == BM_EV_META || ev->type == BM_EV_SYSEX)
+		ev->u.slice += offset;
+}
+
+#ifdef __cplusplus
+typedef bm_reader_st::bm_reader_chunk_struct chunk_st; // nested in C++
+#else
+typedef struct bm_reader_chunk_struct chunk_st;
+#endif
+
+DECODE_FN bool read_dt(chunk_st *chunk, const uint8_t *data, int track_i, bm_warn_f f_warn,
+	void *user, bm_stats_st *stats){
+	if (chunk->start >= chunk->end)
+		return false;
+	// read delta as variable int
+	int dt = 0;
+	int len = 0;
+	while (true){
+		len++;
+		if (len >= 5){
+			WARN(f_warn, user, stats, BM_WARN_TRACK, "Invalid timestamp in track %d", track_i);
+			return false;
+		}
+		int t = data[chunk->start++];
+		if (t & 0x80){
+			if (chunk->start >= chunk->end){
+				WARN(f_warn, user, stats, BM_WARN_TRACK, "Invalid timestamp in track %d", track_i);
+				return false;
+			}
+			dt = (dt << 7) | (t & 0x7F);
+		}
+		else{
+			dt = (dt << 7) | t;
+			break;
+		}
+	}
+	chunk->dt = dt;
+	return true;
+}
+
+// decodes the next event from the open tracks of a reader that isn't following a file, returning
+// false once they've all finished; bm_reader_next moves on to the next header or pattern after that
+DECODE_FN bool reader_merge(bm_reader_st *rd, bm_delta_ev_st *event_out){
+	bm_warn_f f_warn = rd->f_warn;
+	void *user = rd->user;
+	bm_stats_st *stats = STATS(rd->stats);
+	bool count_cycles = STATS(stats) && stats->count_cycles;
+	uint64_t c0 = 0;
+
+	// loop around, grabbing the next event from all of the open tracks
+	// messages that don't produce an event still take up time, so their deltas accumulate in
+	// pending_dt until the next event is emitted
+	chunk_st *chunks = &rd->chunks[rd->track_base];
+	int track_count = rd->track_count;
+	if (rd->dt_track >= 0){
+		// the previous call returned this track's event, so read the dt that follows it
+		int i = rd->dt_track;
+		rd->dt_track = -1;
+		if (!DECODE(read_dt)(&chunks[i], rd->data, i, f_warn, user, stats)){
+			// failed to read dt, so disable track
+			chunks[i].type = -1;
+			rd->tracks_left--;
+		}
+	}
+	while (rd->tracks_left > 0){
+		if (count_cycles)
+			c0 = stats_cycles();
+		// search for the lowest dt
+		int best_i = 0;
+		int best_dt = -1;
+		for (int i = 0; i < track_count; i++){
+			if (chunks[i].type < 0) // skip chunks that have finished
+				continue;
+			if (best_dt < 0 || chunks[i].dt < best_dt){
+				best_dt = chunks[i].dt;
+				best_i = i;
+			}
+		}
+
+		// subtract the best_dt from every track
+		if (best_dt > 0){
+			for (int i = 0; i < track_count; i++){
+				if (chunks[i].type < 0) // skip chunks that have finished
+					continue;
+				chunks[i].dt -= best_dt;
+			}
+		}
+
+		if (count_cycles)
+			stats->cycles[BM_PHASE_MERGE] += stats_cycles() - c0;
+
+		// read the event from the track
+		chunk_st *best = &chunks[best_i];
+		int chk_size = best->end - best->start;
+		rd->pending_dt += best_dt; // kept even if the track turns out to be empty
+		if (chk_size <= 0){
+			// track is empty, so disable it
+			WARN(f_warn, user, stats, BM_WARN_TRACK, "Missing message from track %d", best_i);
+			best->type = -1;
+			rd->tracks_left--;
+			continue;
+		}
+
+		// create an event with an invalid type, in order to detect if midi_single writes out an
+		// event
+		bm_delta_ev_st dev;
+		dev.delta = rd->pending_dt;
+		dev.ev.type = (bm_ev_type)99;
+		bool end_of_track = false;
+		int byte_size = DECODE(midi_counted)(&rd->data[best->start], chk_size, &best->device,
+			f_warn, user, stats, &dev.ev, &end_of_track);
+		slice_at(&dev.ev, best->start);
+
+		// advance this track
+		best->start += byte_size;
+		chk_size -= byte_size;
+		bool finished = end_of_track || chk_size <= 0;
+		if (finished){
+			// track finished, so disable it
+			best->type = -1;
+			rd->tracks_left--;
+		}
+
+		if ((int)dev.ev.type != 99){
+			// the next dt is read on the next call, so any warning follows this event
+			if (!finished)
+				rd->dt_track = best_i;
+			rd->pending_dt = 0;
+			*event_out = dev;
+			return true;
+		}
+
+		// track hasn't finished, so read in the next dt for it
+		if (!finished && !DECODE(read_dt)(best, rd->data, best_i, f_warn, user, stats)){
+			// failed to read dt, so disable track
+			best->type = -1;
+			rd->tracks_left--;
+		}
+	}
+	return false;
+}
+
+#ifdef __cplusplus
+} // namespace detail
+} // namespace bm
+#	undef DECODE_FN
+#	undef DECODE
+#	undef STATS
+#	undef WARN
+#endif
+
+#endif // BASICMIDI_DECODE__H
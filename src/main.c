@@ -2,8 +2,16 @@
 // MIT License
 // Project Home: https://github.com/voidqk/basicmidi
 
+#define _POSIX_C_SOURCE 200809L
 #include <stdio.h>
 #include <string.h>
+#include <dirent.h>
+#include <errno.h>
+#include <glob.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
 #include "basicmidi.h"
 
 static enum {
@@ -12,64 +20,1428 @@ static enum {
 	MODE_EV
 } mode = MODE_ALL;
 
+static enum {
+	FORMAT_TEXT,
+	FORMAT_CSV,
+	FORMAT_JSONL,
+	FORMAT_BIN
+} format = FORMAT_TEXT;
+
+static bool fingerprints = false; // batch reports include each file's fingerprint
+static int slices = 0;            // BM_SLICE_* flags for the meta events and SysEx to print
+static const uint8_t *slice_data = NULL; // data the slices were decoded from
+
+//
+// output buffer
+//
+// Formatting dominates the cost of dumping large files when done through printf, so all event
+// output goes through one large buffer, with integers formatted by hand.
+//
+
+static struct {
+	FILE *fp;
+	int size;
+	bool failed;
+	char buf[1 << 20];
+} out = { .fp = NULL, .size = 0, .failed = false };
+
+static void out_flush(){
+	if (out.size > 0 && fwrite(out.buf, 1, out.size, out.fp ? out.fp : stdout) != (size_t)out.size)
+		out.failed = true;
+	out.size = 0;
+	fflush(out.fp ? out.fp : stdout);
+}
+
+static inline char *out_reserve(int size){
+	if (out.size + size > (int)sizeof(out.buf))
+		out_flush();
+	return &out.buf[out.size];
+}
+
+static inline void out_raw(const void *data, int size){
+	if (size > (int)sizeof(out.buf)){
+		out_flush();
+		if (fwrite(data, 1, size, out.fp ? out.fp : stdout) != (size_t)size)
+			out.failed = true;
+		return;
+	}
+	memcpy(out_reserve(size), data, size);
+	out.size += size;
+}
+
+static inline void out_str(const char *str){
+	out_raw(str, strlen(str));
+}
+
+static inline void out_chr(char c){
+	*out_reserve(1) = c;
+	out.size++;
+}
+
+static const char digit_pairs[201] =
+	"00010203040506070809101112131415161718192021222324252627282930313233343536373839"
+	"40414243444546474849505152535455565758596061626364656667686970717273747576777879"
+	"8081828384858687888990919293949596979899";
+
+// writes `v` right-aligned in a field of `width` characters, like printf's %*d
+static inline void out_intw(int v, int width){
+	char tmp[12];
+	int n = sizeof(tmp);
+	uint32_t u = v < 0 ? -(uint32_t)v : (uint32_t)v;
+	while (u >= 100){
+		int d = (u % 100) * 2;
+		u /= 100;
+		tmp[--n] = digit_pairs[d + 1];
+		tmp[--n] = digit_pairs[d];
+	}
+	if (u >= 10){
+		tmp[--n] = digit_pairs[u * 2 + 1];
+		tmp[--n] = digit_pairs[u * 2];
+	}
+	else
+		tmp[--n] = '0' + u;
+	if (v < 0)
+		tmp[--n] = '-';
+	int len = sizeof(tmp) - n;
+	int pad = width > len ? width - len : 0;
+	char *dst = out_reserve(pad + len);
+	for (int i = 0; i < pad; i++)
+		dst[i] = ' ';
+	memcpy(&dst[pad], &tmp[n], len);
+	out.size += pad + len;
+}
+
+static inline void out_int(int v){
+	out_intw(v, 0);
+}
+
+static void out_jsonstr(const char *str){
+	out_chr('"');
+	for (const unsigned char *c = (const unsigned char *)str; *c; c++){
+		if (*c == '"' || *c == '\\'){
+			out_chr('\\');
+			out_chr(*c);
+		}
+		else if (*c < 0x20){
+			out_str("\\u00");
+			out_chr("0123456789ABCDEF"[*c >> 4]);
+			out_chr("0123456789ABCDEF"[*c & 0xF]);
+		}
+		else
+			out_chr(*c);
+	}
+	out_chr('"');
+}
+
+// like out_jsonstr, for text from a file, which has no set encoding, so bytes outside of printable
+// ASCII are escaped as Latin-1
+static void out_jsontext(const uint8_t *data, int size){
+	out_chr('"');
+	for (int i = 0; i < size; i++){
+		if (data[i] == '"' || data[i] == '\\'){
+			out_chr('\\');
+			out_chr(data[i]);
+		}
+		else if (data[i] < 0x20 || data[i] >= 0x7F){
+			out_str("\\u00");
+			out_chr("0123456789ABCDEF"[data[i] >> 4]);
+			out_chr("0123456789ABCDEF"[data[i] & 0xF]);
+		}
+		else
+			out_chr(data[i]);
+	}
+	out_chr('"');
+}
+
+//
+// event formatting
+//
+
+static const struct {
+	const char *text;   // padded name for the text format
+	const char *name;   // name for CSV and JSON
+	const char *fields[2];
+} evinfo[BM_EV_TYPES] = {
+	{ "RESET    ", "RESET"   , { "divisor" , NULL       } },
+	{ "TEMPO    ", "TEMPO"   , { "tempo"   , NULL       } },
+	{ "MASTVOL  ", "MASTVOL" , { "vol"     , NULL       } },
+	{ "MASTPAN  ", "MASTPAN" , { "pan"     , NULL       } },
+	{ "NOTEON   ", "NOTEON"  , { "note"    , "velocity" } },
+	{ "NOTEOFF  ", "NOTEOFF" , { "note"    , NULL       } },
+	{ "PEDALON  ", "PEDALON" , { "pedal"   , NULL       } },
+	{ "PEDALOFF ", "PEDALOFF", { "pedal"   , NULL       } },
+	{ "CHANVOL  ", "CHANVOL" , { "vol"     , NULL       } },
+	{ "CHANPAN  ", "CHANPAN" , { "pan"     , NULL       } },
+	{ "PATCH    ", "PATCH"   , { "patch"   , NULL       } },
+	{ "BEND     ", "BEND"    , { "bend"    , NULL       } },
+	{ "MOD      ", "MOD"     , { "mod"     , NULL       } },
+	{ "META     ", "META"    , { "kind"    , "size"     } },
+	{ "SYSEX    ", "SYSEX"   , { "kind"    , "size"     } }
+};
+
+// flattens an event into its channel (-1 for none) and up to two values, returning the count
+static int evvalues(const bm_ev_st *ev, int *channel, int values[2]){
+	*channel = -1;
+	switch (ev->type){
+		case BM_EV_RESET  : values[0] = ev->u.reset;   return 1;
+		case BM_EV_TEMPO  : values[0] = ev->u.tempo;   return 1;
+		case BM_EV_MASTVOL: values[0] = ev->u.mastvol; return 1;
+		case BM_EV_MASTPAN: values[0] = ev->u.mastpan; return 1;
+		case BM_EV_NOTEON:
+			*channel = ev->u.noteon.channel;
+			values[0] = ev->u.noteon.note;
+			values[1] = ev->u.noteon.velocity;
+			return 2;
+		case BM_EV_NOTEOFF:
+			*channel = ev->u.noteoff.channel;
+			values[0] = ev->u.noteoff.note;
+			return 1;
+		case BM_EV_PEDALON:
+			*channel = ev->u.pedalon.channel;
+			values[0] = ev->u.pedalon.pedal;
+			return 1;
+		case BM_EV_PEDALOFF:
+			*channel = ev->u.pedaloff.channel;
+			values[0] = ev->u.pedaloff.pedal;
+			return 1;
+		case BM_EV_CHANVOL:
+			*channel = ev->u.chanvol.channel;
+			values[0] = ev->u.chanvol.vol;
+			return 1;
+		case BM_EV_CHANPAN:
+			*channel = ev->u.chanpan.channel;
+			values[0] = ev->u.chanpan.pan;
+			return 1;
+		case BM_EV_PATCH:
+			*channel = ev->u.patch.channel;
+			values[0] = ev->u.patch.patch;
+			return 1;
+		case BM_EV_BEND:
+			*channel = ev->u.bend.channel;
+			values[0] = ev->u.bend.bend;
+			return 1;
+		case BM_EV_MOD:
+			*channel = ev->u.mod.channel;
+			values[0] = ev->u.mod.mod;
+			return 1;
+		case BM_EV_META:
+		case BM_EV_SYSEX: {
+			if (slice_data == NULL)
+				return -1; // the data is gone, so there's nothing to show
+			bm_slice_st sl = bm_slice(slice_data, *ev);
+			values[0] = sl.kind;
+			values[1] = sl.size;
+			return 2;
+		}
+	}
+	return -1;
+}
+
 static void onevent(bm_delta_ev_st event, void *user){
 	if (mode != MODE_ALL && mode != MODE_EV)
 		return;
-	switch (event.ev.type){
-		case BM_EV_RESET:
-			printf("[%4d] {*} RESET    %d\n", event.delta, event.ev.u.reset);
-			break;
-		case BM_EV_TEMPO:
-			printf("[%4d] {*} TEMPO    %d\n", event.delta, event.ev.u.tempo);
+	if (format == FORMAT_BIN){
+		bm_packed_ev_st pk = bm_pack(event);
+		out_raw(&pk, sizeof(pk));
+		return;
+	}
+	int channel;
+	int values[2];
+	int nv = evvalues(&event.ev, &channel, values);
+	if (nv < 0)
+		return;
+	switch (format){
+		case FORMAT_TEXT:
+			// [delta] {channel} NAME     values
+			out_chr('[');
+			out_intw(event.delta, 4);
+			out_str("] {");
+			out_chr(channel < 0 ? '*' : "0123456789ABCDEF"[channel]);
+			out_str("} ");
+			out_str(evinfo[event.ev.type].text);
+			for (int i = 0; i < nv; i++){
+				if (i > 0)
+					out_chr(' ');
+				out_int(values[i]);
+			}
+			if (event.ev.type == BM_EV_PATCH){
+				out_str(" # ");
+				out_str(bm_patchstr(event.ev.u.patch.patch));
+			}
+			else if (event.ev.type == BM_EV_META && values[0] >= 0x01 && values[0] <= 0x0F){
+				bm_slice_st sl = bm_slice(slice_data, event.ev);
+				out_str(" # ");
+				out_jsontext(sl.data, sl.size);
+			}
+			out_chr('\n');
 			break;
-		case BM_EV_MASTVOL:
-			printf("[%4d] {*} MASTVOL  %d\n", event.delta, event.ev.u.mastvol);
+		case FORMAT_CSV:
+			// delta,type,channel,value1,value2
+			out_int(event.delta);
+			out_chr(',');
+			out_str(evinfo[event.ev.type].name);
+			out_chr(',');
+			if (channel >= 0)
+				out_int(channel);
+			for (int i = 0; i < 2; i++){
+				out_chr(',');
+				if (i < nv)
+					out_int(values[i]);
+			}
+			out_chr('\n');
 			break;
-		case BM_EV_MASTPAN:
-			printf("[%4d] {*} MASTPAN  %d\n", event.delta, event.ev.u.mastpan);
+		case FORMAT_JSONL:
+			out_str("{\"delta\":");
+			out_int(event.delta);
+			out_str(",\"type\":\"");
+			out_str(evinfo[event.ev.type].name);
+			out_chr('"');
+			if (channel >= 0){
+				out_str(",\"channel\":");
+				out_int(channel);
+			}
+			for (int i = 0; i < nv; i++){
+				out_str(",\"");
+				out_str(evinfo[event.ev.type].fields[i]);
+				out_str("\":");
+				out_int(values[i]);
+			}
+			if (event.ev.type == BM_EV_META && values[0] >= 0x01 && values[0] <= 0x0F){
+				bm_slice_st sl = bm_slice(slice_data, event.ev);
+				out_str(",\"text\":");
+				out_jsontext(sl.data, sl.size);
+			}
+			out_str("}\n");
 			break;
-		case BM_EV_NOTEON:
-			printf("[%4d] {%X} NOTEON   %d %d\n", event.delta, event.ev.u.noteon.channel,
-				event.ev.u.noteon.note, event.ev.u.noteon.velocity);
+		case FORMAT_BIN:
 			break;
-		case BM_EV_NOTEOFF:
-			printf("[%4d] {%X} NOTEOFF  %d\n", event.delta, event.ev.u.noteoff.channel,
-				event.ev.u.noteoff.note);
+	}
+}
+
+static void onwarn(const char *msg, void *user){
+	if (mode != MODE_ALL && mode != MODE_WARN)
+		return;
+	switch (format){
+		case FORMAT_TEXT:
+			out_str("WARNING: ");
+			out_str(msg);
+			out_chr('\n');
 			break;
-		case BM_EV_PEDALON:
-			printf("[%4d] {%X} PEDALON  %d\n", event.delta, event.ev.u.pedalon.channel,
-				event.ev.u.pedalon.pedal);
+		case FORMAT_JSONL:
+			out_str("{\"warning\":");
+			out_jsonstr(msg);
+			out_str("}\n");
 			break;
-		case BM_EV_PEDALOFF:
-			printf("[%4d] {%X} PEDALOFF %d\n", event.delta, event.ev.u.pedaloff.channel,
-				event.ev.u.pedaloff.pedal);
+		case FORMAT_CSV:
+		case FORMAT_BIN:
+			// keep the output machine-readable by sending warnings to stderr
+			out_flush();
+			fprintf(stderr, "WARNING: %s\n", msg);
 			break;
-		case BM_EV_CHANVOL:
-			printf("[%4d] {%X} CHANVOL  %d\n", event.delta, event.ev.u.chanvol.channel,
-				event.ev.u.chanvol.vol);
+	}
+}
+
+static void printcoalesced(const bm_coalesce_st *co){
+	uint64_t total = 0;
+	fprintf(stderr, "Coalesced:\n");
+	for (int i = 0; i < BM_EV_TYPES; i++){
+		total += co->removed[i];
+		if (co->removed[i] > 0){
+			fprintf(stderr, "  %-16s %10llu removed\n", evinfo[i].name,
+				(unsigned long long)co->removed[i]);
+		}
+	}
+	fprintf(stderr, "  %-16s %10llu removed\n", "total", (unsigned long long)total);
+}
+
+// passes events through to the output while measuring them
+typedef struct {
+	bm_analyze_st an;
+	bm_event_f f_event;
+	void *user;
+} analyze_tee_st;
+
+static void onanalyze(bm_delta_ev_st event, void *user){
+	analyze_tee_st *tee = user;
+	bm_analyze_event(event, &tee->an);
+	tee->f_event(event, tee->user);
+}
+
+// the player sends events to the wire sink, and then on to the output
+typedef struct {
+	bm_player_st pl;
+	bm_wiresink_st ws;
+	bm_event_f f_event;
+	void *user;
+} play_st;
+
+static void onplay(bm_delta_ev_st event, void *user){
+	play_st *play = user;
+	bm_wiresink_event(event, &play->ws);
+	play->f_event(event, play->user);
+}
+
+static void printlatency(const char *title, const bm_histogram_st *h){
+	static const double percentiles[] = { 50, 90, 99, 99.9 };
+	FILE *fp = stderr;
+	fprintf(fp, "%s:\n", title);
+	fprintf(fp, "  %-16s %10llu\n", "events", (unsigned long long)h->count);
+	if (h->count == 0)
+		return;
+	fprintf(fp, "  %-16s %10.1f us\n", "min", h->min / 1000.0);
+	fprintf(fp, "  %-16s %10.1f us\n", "mean", (double)h->sum / h->count / 1000.0);
+	for (int i = 0; i < (int)(sizeof(percentiles) / sizeof(percentiles[0])); i++){
+		char name[16];
+		snprintf(name, sizeof(name), "p%g", percentiles[i]);
+		fprintf(fp, "  %-16s %10.1f us\n", name,
+			bm_histogram_percentile(h, percentiles[i]) / 1000.0);
+	}
+	fprintf(fp, "  %-16s %10.1f us\n", "max", h->max / 1000.0);
+}
+
+static void printfeatures(const bm_features_st *f){
+	static const char *class_names[12] = {
+		"C", "C#", "D", "D#", "E", "F", "F#", "G", "G#", "A", "A#", "B"
+	};
+	FILE *fp = stderr;
+	fprintf(fp, "Features:\n");
+	fprintf(fp, "  %-16s %10u\n", "notes", f->notes);
+	fprintf(fp, "  %-16s %10.2f\n", "beats", (double)f->length / BM_ANALYZE_BEAT);
+	fprintf(fp, "  %-16s %10.2f\n", "seconds", f->usecs / 1000000.0);
+	fprintf(fp, "  %-16s %10.2f\n", "min bpm", 60000000.0 / f->tempo_max);
+	fprintf(fp, "  %-16s %10.2f\n", "max bpm", 60000000.0 / f->tempo_min);
+	if (f->length > 0 && f->usecs > 0){
+		fprintf(fp, "  %-16s %10.2f\n", "average bpm",
+			60000000.0 * f->length / ((double)f->usecs * BM_ANALYZE_BEAT));
+	}
+	fprintf(fp, "  %-16s %10u\n", "tempo changes", f->tempo_changes);
+	fprintf(fp, "Pitch classes:\n");
+	for (int i = 0; i < 12; i++)
+		fprintf(fp, "  %-16s %10u\n", class_names[i], f->pitch_classes[i]);
+	fprintf(fp, "Velocities:\n");
+	for (int i = 0; i < 16; i++){
+		if (f->velocities[i] > 0)
+			fprintf(fp, "  %3d-%-12d %10u\n", i * 8, i * 8 + 7, f->velocities[i]);
+	}
+	fprintf(fp, "Notes per beat:\n");
+	for (int i = 0; i < BM_ANALYZE_DENSITY; i++){
+		if (f->density[i] > 0){
+			fprintf(fp, "  %2d%-14s %10u beats\n", i, i == BM_ANALYZE_DENSITY - 1 ? "+" : "",
+				f->density[i]);
+		}
+	}
+	fprintf(fp, "Polyphony:\n");
+	for (int i = 0; i < BM_ANALYZE_POLYPHONY; i++){
+		if (f->polyphony[i] > 0){
+			fprintf(fp, "  %2d%-14s %10.2f beats\n", i, i == BM_ANALYZE_POLYPHONY - 1 ? "+" : "",
+				(double)f->polyphony[i] / BM_ANALYZE_BEAT);
+		}
+	}
+	fprintf(fp, "Channels:\n");
+	for (int i = 0; i < 16; i++){
+		if (f->channels[i].notes > 0){
+			fprintf(fp, "  %-16d %10u notes, keys %d-%d, %.2f beats active\n", i,
+				f->channels[i].notes, f->channels[i].low, f->channels[i].high,
+				(double)f->channels[i].active / BM_ANALYZE_BEAT);
+		}
+	}
+}
+
+static void printstats(const bm_stats_st *stats){
+	static const char *msg_names[BM_MSG_TYPES] = {
+		"Note-Off", "Note-On", "Note Pressure", "Control Change", "Program Change",
+		"Channel Pressure", "Pitch Bend", "SysEx", "Meta", "Invalid"
+	};
+	static const char *warn_names[BM_WARN_CATEGORIES] = {
+		"header", "chunk", "track", "message", "patch", "sysex", "meta"
+	};
+	static const char *phase_names[BM_PHASES] = { "scan", "merge", "decode", "callback" };
+	FILE *fp = stderr;
+	fprintf(fp, "Messages:\n");
+	for (int i = 0; i < BM_MSG_TYPES; i++){
+		if (stats->messages[i] > 0){
+			fprintf(fp, "  %-16s %10llu (%llu dropped)\n", msg_names[i],
+				(unsigned long long)stats->messages[i], (unsigned long long)stats->dropped[i]);
+		}
+	}
+	fprintf(fp, "Events:\n");
+	for (int i = 0; i < BM_EV_TYPES; i++){
+		if (stats->events[i] > 0){
+			fprintf(fp, "  %-16s %10llu\n", evinfo[i].name,
+				(unsigned long long)stats->events[i]);
+		}
+	}
+	fprintf(fp, "Warnings:\n");
+	for (int i = 0; i < BM_WARN_CATEGORIES; i++){
+		if (stats->warnings[i] > 0){
+			fprintf(fp, "  %-16s %10llu\n", warn_names[i],
+				(unsigned long long)stats->warnings[i]);
+		}
+	}
+	fprintf(fp, "Resyncs:           %10llu (%llu bytes skipped)\n",
+		(unsigned long long)stats->resyncs, (unsigned long long)stats->resync_bytes);
+	fprintf(fp, "Max open tracks:   %10d\n", stats->max_open_tracks);
+	fprintf(fp, "Tracks:            %10d\n", stats->tracks);
+	for (int i = 0; i < stats->tracks && i < 300; i++)
+		fprintf(fp, "  %-16d %10u bytes\n", i, stats->track_bytes[i]);
+	if (stats->count_cycles){
+		fprintf(fp, "Cycles:\n");
+		for (int i = 0; i < BM_PHASES; i++){
+			fprintf(fp, "  %-16s %10llu\n", phase_names[i],
+				(unsigned long long)stats->cycles[i]);
+		}
+	}
+}
+
+typedef struct {
+	bm_delta_ev_st *events;
+	int size;
+	int count;
+	bool oom;
+} evlist_st;
+
+static void oncollect(bm_delta_ev_st event, void *user){
+	evlist_st *list = user;
+	if (list->oom)
+		return;
+	if (list->size >= list->count){
+		int count = list->count < 1024 ? 1024 : list->count * 2;
+		bm_delta_ev_st *events = realloc(list->events, sizeof(bm_delta_ev_st) * count);
+		if (events == NULL){
+			list->oom = true;
+			return;
+		}
+		list->events = events;
+		list->count = count;
+	}
+	list->events[list->size++] = event;
+}
+
+// reads a whole file into memory from `alloc`, or from malloc if it's NULL, returning NULL on
+// failure with an error message in err
+static uint8_t *readfile(const char *file, const bm_allocator_st *alloc, int *size_out,
+	const char **err){
+	FILE *fp = fopen(file, "rb");
+	if (fp == NULL){
+		*err = "Failed to open file";
+		return NULL;
+	}
+	fseek(fp, 0L, SEEK_END);
+	long size = ftell(fp);
+	fseek(fp, 0L, SEEK_SET);
+	if (size < 0 || size > 0x7FFFFFFF){
+		*err = "File too large";
+		fclose(fp);
+		return NULL;
+	}
+	// always allocate at least one byte, so empty files are not mistaken for out of memory
+	size_t alloc_size = sizeof(uint8_t) * (size > 0 ? size : 1);
+	uint8_t *data = alloc ? alloc->f_alloc(alloc_size, alloc->user) : malloc(alloc_size);
+	if (data == NULL){
+		*err = "Out of memory";
+		fclose(fp);
+		return NULL;
+	}
+	if (fread(data, 1, size, fp) != (size_t)size){
+		*err = "Failed to read all of file";
+		fclose(fp);
+		if (alloc)
+			alloc->f_free(data, alloc_size, alloc->user);
+		else
+			free(data);
+		return NULL;
+	}
+	fclose(fp);
+	*size_out = (int)size;
+	return data;
+}
+
+//
+// batch mode
+//
+
+typedef struct {
+	char **paths;
+	int size;
+	int count;
+} pathlist_st;
+
+static bool pathlist_add(pathlist_st *list, const char *path){
+	if (list->size >= list->count){
+		int count = list->count < 64 ? 64 : list->count * 2;
+		char **paths = realloc(list->paths, sizeof(char *) * count);
+		if (paths == NULL)
+			return false;
+		list->paths = paths;
+		list->count = count;
+	}
+	char *p = strdup(path);
+	if (p == NULL)
+		return false;
+	list->paths[list->size++] = p;
+	return true;
+}
+
+static int strptrcmp(const void *a, const void *b){
+	return strcmp(*(char *const *)a, *(char *const *)b);
+}
+
+static bool addinput(pathlist_st *list, const char *path);
+
+static bool adddir(pathlist_st *list, const char *dir){
+	DIR *d = opendir(dir);
+	if (d == NULL){
+		fprintf(stderr, "Failed to open directory: %s\n", dir);
+		return true; // keep going; the rest of the corpus is still worth validating
+	}
+	pathlist_st names = { .paths = NULL, .size = 0, .count = 0 };
+	struct dirent *ent;
+	bool ok = true;
+	while (ok && (ent = readdir(d)) != NULL){
+		if (strcmp(ent->d_name, ".") == 0 || strcmp(ent->d_name, "..") == 0)
+			continue;
+		ok = pathlist_add(&names, ent->d_name);
+	}
+	closedir(d);
+
+	// sort entries so reports are stable across runs
+	if (names.size > 1)
+		qsort(names.paths, names.size, sizeof(char *), strptrcmp);
+	size_t dir_len = strlen(dir);
+	for (int i = 0; i < names.size; i++){
+		if (ok){
+			size_t len = dir_len + strlen(names.paths[i]) + 2;
+			char *full = malloc(len);
+			if (full == NULL)
+				ok = false;
+			else{
+				snprintf(full, len, "%s%s%s", dir,
+					dir_len > 0 && dir[dir_len - 1] == '/' ? "" : "/", names.paths[i]);
+				// symlinked directories aren't followed, since a link back up the tree would
+				// recurse forever; symlinked files are fine
+				struct stat st;
+				if (lstat(full, &st) == 0 && S_ISLNK(st.st_mode) &&
+					stat(full, &st) == 0 && S_ISDIR(st.st_mode))
+					fprintf(stderr, "Skipping symlinked directory: %s\n", full);
+				else
+					ok = addinput(list, full);
+				free(full);
+			}
+		}
+		free(names.paths[i]);
+	}
+	free(names.paths);
+	return ok;
+}
+
+static bool addlistfile(pathlist_st *list, const char *file){
+	FILE *fp = strcmp(file, "-") == 0 ? stdin : fopen(file, "r");
+	if (fp == NULL){
+		fprintf(stderr, "Failed to open file list: %s\n", file);
+		return true;
+	}
+	char *line = NULL;
+	size_t line_size = 0;
+	ssize_t len;
+	bool ok = true;
+	while (ok && (len = getline(&line, &line_size, fp)) >= 0){
+		while (len > 0 && (line[len - 1] == '\n' || line[len - 1] == '\r'))
+			line[--len] = 0;
+		if (len > 0)
+			ok = addinput(list, line);
+	}
+	free(line);
+	if (fp != stdin)
+		fclose(fp);
+	return ok;
+}
+
+// inputs can be files, directories (searched recursively), globs, or @list files containing one
+// input per line (@- reads the list from stdin)
+static bool addinput(pathlist_st *list, const char *path){
+	if (path[0] == '@')
+		return addlistfile(list, &path[1]);
+	if (strpbrk(path, "*?[") != NULL){
+		glob_t g;
+		int res = glob(path, 0, NULL, &g);
+		if (res == GLOB_NOMATCH){
+			fprintf(stderr, "No files match: %s\n", path);
+			return true;
+		}
+		if (res != 0)
+			return false;
+		bool ok = true;
+		for (size_t i = 0; ok && i < g.gl_pathc; i++)
+			ok = addinput(list, g.gl_pathv[i]);
+		globfree(&g);
+		return ok;
+	}
+	struct stat st;
+	if (stat(path, &st) == 0 && S_ISDIR(st.st_mode))
+		return adddir(list, path);
+	// anything else is treated as a file, so missing files show up as failures in the report
+	return pathlist_add(list, path);
+}
+
+typedef struct {
+	int bytes;
+	int events;
+	int warnings;
+	const char *error; // NULL if the file decoded
+	uint64_t exact;
+	uint32_t minhash[BM_FINGERPRINT_SIZE];
+	int ngrams;
+} result_st;
+
+typedef struct {
+	result_st *res;
+	bm_fingerprint_st fp;
+	bool header;
+} batchfile_st;
+
+static void onbatchevent(bm_delta_ev_st event, void *user){
+	batchfile_st *bf = user;
+	bf->res->events++;
+	if (event.ev.type == BM_EV_RESET)
+		bf->header = true;
+	if (fingerprints)
+		bm_fingerprint_event(event, &bf->fp);
+}
+
+static void onbatchwarn(const char *msg, void *user){
+	batchfile_st *bf = user;
+	bf->res->warnings++;
+}
+
+// every worker owns a contiguous range of file indices; it takes work from the end of its own
+// range, and when that runs dry, steals the first half of another worker's range
+typedef struct {
+	pthread_mutex_t lock;
+	int head;
+	int tail;
+} deque_st;
+
+typedef struct {
+	const pathlist_st *files;
+	result_st *results;
+	deque_st *deques;
+	int workers;
+} pool_st;
+
+typedef struct {
+	pool_st *pool;
+	int id;
+} worker_st;
+
+// each file is read into the worker's arena, which is reset for the next file, so once the arena
+// has grown to fit the largest file, reading files doesn't allocate
+static void processfile(const char *file, result_st *res, bm_arena_st *arena){
+	const char *err = NULL;
+	int size = 0;
+	bm_arena_reset(arena);
+	bm_allocator_st alloc = bm_arena_allocator(arena);
+	uint8_t *data = readfile(file, &alloc, &size, &err);
+	if (data == NULL){
+		res->error = err;
+		return;
+	}
+	res->bytes = size;
+	batchfile_st bf = { .res = res };
+	if (fingerprints)
+		bm_fingerprint_init(&bf.fp);
+	bm_readmidi(data, size, onbatchevent, onbatchwarn, &bf);
+	if (fingerprints){
+		bm_fingerprint_finish(&bf.fp);
+		res->exact = bf.fp.exact;
+		memcpy(res->minhash, bf.fp.minhash, sizeof(res->minhash));
+		res->ngrams = bf.fp.ngrams;
+	}
+	// every header the reader decodes starts its tracks with a RESET, so without one the file never
+	// had a usable header
+	if (!bf.header)
+		res->error = "Invalid header";
+}
+
+static bool steal(pool_st *pool, int id){
+	deque_st *own = &pool->deques[id];
+	for (int i = 1; i < pool->workers; i++){
+		deque_st *victim = &pool->deques[(id + i) % pool->workers];
+		pthread_mutex_lock(&victim->lock);
+		int n = victim->tail - victim->head;
+		if (n <= 0){
+			pthread_mutex_unlock(&victim->lock);
+			continue;
+		}
+		int take = (n + 1) / 2;
+		int head = victim->head;
+		victim->head += take;
+		pthread_mutex_unlock(&victim->lock);
+		pthread_mutex_lock(&own->lock);
+		own->head = head;
+		own->tail = head + take;
+		pthread_mutex_unlock(&own->lock);
+		return true;
+	}
+	return false;
+}
+
+static void *worker(void *user){
+	worker_st *w = user;
+	pool_st *pool = w->pool;
+	deque_st *own = &pool->deques[w->id];
+	bm_arena_st arena;
+	bm_arena_init(&arena, 1 << 20);
+	while (true){
+		pthread_mutex_lock(&own->lock);
+		int i = own->head < own->tail ? --own->tail : -1;
+		pthread_mutex_unlock(&own->lock);
+		if (i >= 0)
+			processfile(pool->files->paths[i], &pool->results[i], &arena);
+		else if (!steal(pool, w->id))
+			break; // nothing left anywhere
+	}
+	bm_arena_free(&arena);
+	return NULL;
+}
+
+static void jsonstr(FILE *fp, const char *str){
+	fputc('"', fp);
+	for (const unsigned char *c = (const unsigned char *)str; *c; c++){
+		if (*c == '"' || *c == '\\')
+			fprintf(fp, "\\%c", *c);
+		else if (*c < 0x20)
+			fprintf(fp, "\\u%04X", *c);
+		else
+			fputc(*c, fp);
+	}
+	fputc('"', fp);
+}
+
+static int batch(const pathlist_st *files, int workers, FILE *report){
+	result_st *results = calloc(files->size > 0 ? files->size : 1, sizeof(result_st));
+	deque_st *deques = malloc(sizeof(deque_st) * workers);
+	pthread_t *threads = malloc(sizeof(pthread_t) * workers);
+	worker_st *ws = malloc(sizeof(worker_st) * workers);
+	if (results == NULL || deques == NULL || threads == NULL || ws == NULL){
+		fprintf(stderr, "Out of memory\n");
+		free(results);
+		free(deques);
+		free(threads);
+		free(ws);
+		return 1;
+	}
+
+	pool_st pool = { .files = files, .results = results, .deques = deques, .workers = workers };
+	for (int i = 0; i < workers; i++){
+		pthread_mutex_init(&deques[i].lock, NULL);
+		deques[i].head = (int)((int64_t)files->size * i / workers);
+		deques[i].tail = (int)((int64_t)files->size * (i + 1) / workers);
+	}
+	int started = 0;
+	for (int i = 0; i < workers; i++){
+		ws[i] = (worker_st){ .pool = &pool, .id = i };
+		if (pthread_create(&threads[i], NULL, worker, &ws[i]) != 0)
 			break;
-		case BM_EV_CHANPAN:
-			printf("[%4d] {%X} CHANPAN  %d\n", event.delta, event.ev.u.chanpan.channel,
-				event.ev.u.chanpan.pan);
+		started++;
+	}
+	if (started == 0)
+		worker(&ws[0]); // no threads available, so do it all on this one
+	for (int i = 0; i < started; i++)
+		pthread_join(threads[i], NULL);
+
+	// report in input order
+	int failed = 0;
+	int64_t events = 0;
+	int64_t warnings = 0;
+	int64_t bytes = 0;
+	for (int i = 0; i < files->size; i++){
+		result_st *res = &results[i];
+		fputs("{\"file\":", report);
+		jsonstr(report, files->paths[i]);
+		fprintf(report, ",\"bytes\":%d,\"events\":%d,\"warnings\":%d,\"status\":",
+			res->bytes, res->events, res->warnings);
+		if (res->error){
+			fputs("\"failed\",\"error\":", report);
+			jsonstr(report, res->error);
+			failed++;
+		}
+		else
+			fputs("\"ok\"", report);
+		if (fingerprints && !res->error){
+			fprintf(report, ",\"exact\":\"%016llx\",\"ngrams\":%d,\"minhash\":\"",
+				(unsigned long long)res->exact, res->ngrams);
+			for (int k = 0; k < BM_FINGERPRINT_SIZE; k++)
+				fprintf(report, "%08x", res->minhash[k]);
+			fputc('"', report);
+		}
+		fputs("}\n", report);
+		events += res->events;
+		warnings += res->warnings;
+		bytes += res->bytes;
+	}
+	fprintf(report, "{\"summary\":true,\"files\":%d,\"failed\":%d,\"bytes\":%lld,"
+		"\"events\":%lld,\"warnings\":%lld,\"workers\":%d}\n", files->size, failed,
+		(long long)bytes, (long long)events, (long long)warnings, workers);
+
+	for (int i = 0; i < workers; i++)
+		pthread_mutex_destroy(&deques[i].lock);
+	free(results);
+	free(deques);
+	free(threads);
+	free(ws);
+	return 0;
+}
+
+//
+// sequences
+//
+// Every sequence in a file decodes independently, so --sequences decodes them on separate threads,
+// holding each one's events and warnings, and then prints them in order.
+//
+
+typedef struct {
+	int at;    // number of events that came before the warning
+	char *msg;
+} seqwarn_st;
+
+typedef struct {
+	const uint8_t *data;
+	int size;
+	bm_sequence_st seq;
+	evlist_st list;
+	seqwarn_st *warns;
+	int warns_size;
+	int warns_count;
+} seqjob_st;
+
+typedef struct {
+	seqjob_st *jobs;
+	int jobs_size;
+	int stride;
+	int id;
+} seqworker_st;
+
+static void onseqwarn(const char *msg, void *user){
+	seqjob_st *job = user;
+	if (job->warns_size >= job->warns_count){
+		int count = job->warns_count < 16 ? 16 : job->warns_count * 2;
+		seqwarn_st *warns = realloc(job->warns, sizeof(seqwarn_st) * count);
+		if (warns == NULL)
+			return;
+		job->warns = warns;
+		job->warns_count = count;
+	}
+	char *m = strdup(msg);
+	if (m == NULL)
+		return;
+	job->warns[job->warns_size++] = (seqwarn_st){ .at = job->list.size, .msg = m };
+}
+
+static void *seqworker(void *user){
+	seqworker_st *w = user;
+	bm_reader_st *rd = malloc(sizeof(bm_reader_st));
+	if (rd == NULL)
+		return NULL;
+	for (int i = w->id; i < w->jobs_size; i += w->stride){
+		seqjob_st *job = &w->jobs[i];
+		bm_reader_init_sequence(rd, job->data, job->size, &job->seq, onseqwarn, job);
+		bm_delta_ev_st ev;
+		while (bm_reader_next(rd, &ev))
+			oncollect(ev, &job->list);
+	}
+	free(rd);
+	return NULL;
+}
+
+static int sequences(const uint8_t *data, int size, int workers){
+	int count = bm_sequences(data, size, NULL, 0, NULL, NULL);
+	bm_sequence_st *seqs = malloc(sizeof(bm_sequence_st) * (count > 0 ? count : 1));
+	seqjob_st *jobs = calloc(count > 0 ? count : 1, sizeof(seqjob_st));
+	if (workers > count)
+		workers = count > 0 ? count : 1;
+	pthread_t *threads = malloc(sizeof(pthread_t) * workers);
+	seqworker_st *ws = malloc(sizeof(seqworker_st) * workers);
+	if (seqs == NULL || jobs == NULL || threads == NULL || ws == NULL){
+		fprintf(stderr, "Out of memory\n");
+		free(seqs);
+		free(jobs);
+		free(threads);
+		free(ws);
+		return 1;
+	}
+	// chunk warnings are only sent while finding the sequences
+	bm_sequences(data, size, seqs, count, onwarn, NULL);
+	for (int i = 0; i < count; i++){
+		jobs[i] = (seqjob_st){ .data = data, .size = size, .seq = seqs[i],
+			.list = { .events = NULL, .size = 0, .count = 0, .oom = false } };
+	}
+	for (int i = 0; i < workers; i++)
+		ws[i] = (seqworker_st){ .jobs = jobs, .jobs_size = count, .stride = workers, .id = i };
+	int started = 0;
+	for (int i = 0; i < workers; i++){
+		if (pthread_create(&threads[i], NULL, seqworker, &ws[i]) != 0)
 			break;
-		case BM_EV_PATCH:
-			printf("[%4d] {%X} PATCH    %d # %s\n", event.delta, event.ev.u.patch.channel,
-				event.ev.u.patch.patch, bm_patchstr(event.ev.u.patch.patch));
+		started++;
+	}
+	// if threads ran out, do the jobs of the workers that never started on this one
+	for (int i = started; i < workers; i++)
+		seqworker(&ws[i]);
+	for (int i = 0; i < started; i++)
+		pthread_join(threads[i], NULL);
+
+	bool oom = false;
+	for (int i = 0; i < count; i++){
+		seqjob_st *job = &jobs[i];
+		int w = 0;
+		for (int e = 0; e <= job->list.size; e++){
+			while (w < job->warns_size && job->warns[w].at == e)
+				onwarn(job->warns[w++].msg, NULL);
+			if (e < job->list.size)
+				onevent(job->list.events[e], NULL);
+		}
+		if (job->list.oom)
+			oom = true;
+		for (w = 0; w < job->warns_size; w++)
+			free(job->warns[w].msg);
+		free(job->warns);
+		free(job->list.events);
+	}
+	out_flush();
+	free(seqs);
+	free(jobs);
+	free(threads);
+	free(ws);
+	if (oom){
+		fprintf(stderr, "Out of memory\n");
+		return 1;
+	}
+	return out.failed ? 1 : 0;
+}
+
+//
+// piano rolls
+//
+// -r writes a piano-roll pyramid with sixteenth-note columns at the most detailed level.
+//
+
+static bool writeroll(const uint8_t *data, int size, const char *roll_file){
+	bm_reader_st reader;
+	bm_delta_ev_st ev;
+	bm_reader_init(&reader, data, size, NULL, NULL);
+	int divisor = bm_reader_next(&reader, &ev) && ev.ev.type == BM_EV_RESET ? ev.ev.u.reset : 0;
+	uint32_t base_ticks = divisor >= 4 ? (uint32_t)divisor / 4 : 1;
+
+	int count = bm_readmidi_notes(data, size, NULL, 0, 0, NULL, NULL);
+	bm_note_st *notes = malloc(sizeof(bm_note_st) * (count > 0 ? count : 1));
+	if (notes == NULL){
+		fprintf(stderr, "Out of memory\n");
+		return false;
+	}
+	bm_readmidi_notes(data, size, notes, count, 0, NULL, NULL);
+	FILE *fp = fopen(roll_file, "wb");
+	if (fp == NULL){
+		fprintf(stderr, "Failed to open file: %s\n", roll_file);
+		free(notes);
+		return false;
+	}
+	bool ok = bm_writeroll(notes, count, base_ticks, NULL, (bm_dump_f)fwrite, fp);
+	if (fclose(fp) != 0)
+		ok = false;
+	free(notes);
+	if (!ok)
+		fprintf(stderr, "Failed to write piano roll: %s\n", roll_file);
+	return ok;
+}
+
+//
+// track splitting
+//
+// -t rewrites the song as a format 1 file with a track per channel, by sending every event to the
+// absolute-time writer with the tick it happens on.
+//
+
+static void onsplitwarn(const char *msg, void *user){
+	fprintf(stderr, "Warning: %s\n", msg);
+}
+
+static size_t onsplitdump(const void *restrict ptr, size_t size, size_t nitems,
+	void *restrict user){
+	return fwrite(ptr, size, nitems, user);
+}
+
+static bool splittracks(const uint8_t *data, int size, const char *tracks_file){
+	FILE *fp = fopen(tracks_file, "wb");
+	bm_abswriter_st *aw = malloc(sizeof(bm_abswriter_st));
+	if (fp == NULL || aw == NULL){
+		if (fp == NULL)
+			fprintf(stderr, "Failed to open file: %s\n", tracks_file);
+		else{
+			fprintf(stderr, "Out of memory\n");
+			fclose(fp);
+		}
+		free(aw);
+		return false;
+	}
+	bm_reader_st reader;
+	bm_delta_ev_st ev;
+	bm_reader_init(&reader, data, size, NULL, NULL);
+	// sequences are laid end to end, and the ticks of any with a different divisor are scaled to
+	// the first one's
+	uint64_t tick = 0, base_tick = 0, base_out = 0;
+	int divisor = 0, seq_divisor = 0;
+	bool started = false;
+	bool ok = true;
+	while (ok && bm_reader_next(&reader, &ev)){
+		tick += ev.delta;
+		uint64_t out = base_out + (tick - base_tick);
+		if (divisor > 0 && seq_divisor > 0)
+			out = base_out + (tick - base_tick) * divisor / seq_divisor;
+		if (ev.ev.type == BM_EV_RESET){
+			if (!started)
+				divisor = ev.ev.u.reset;
+			seq_divisor = ev.ev.u.reset;
+			base_tick = tick;
+			base_out = out;
+		}
+		if (!started){
+			ok = bm_abswriter_init(aw, divisor, 256, BM_ABSWRITER_CHANNEL, NULL, onsplitdump,
+				onsplitwarn, fp);
+			started = true;
+		}
+		bm_abswriter_event(aw, (uint32_t)out, ev.ev, 0);
+	}
+	if (!started)
+		ok = bm_abswriter_init(aw, 0, 1, BM_ABSWRITER_CHANNEL, NULL, onsplitdump, onsplitwarn, fp);
+	ok = bm_abswriter_finish(aw) && ok;
+	if (fclose(fp) != 0)
+		ok = false;
+	free(aw);
+	if (!ok)
+		fprintf(stderr, "Failed to write tracks: %s\n", tracks_file);
+	return ok;
+}
+
+//
+// live input
+//
+// -l decodes raw MIDI bytes from a file, FIFO, or device as they arrive, which makes it the other
+// end of -p, and traces how long each event takes to go from the input to the output.
+//
+
+static size_t onhgrmdump(const void *restrict ptr, size_t size, size_t nitems,
+	void *restrict user){
+	return fwrite(ptr, size, nitems, user);
+}
+
+static int livein(const char *file, const char *hgrm_file){
+	static const char *stage_names[BM_STAGES] = {
+		"Latency (queue)", "Latency (decode)", "Latency (update)", "Latency (consumer)"
+	};
+	FILE *fp = fopen(file, "rb");
+	if (fp == NULL){
+		fprintf(stderr, "Failed to open file: %s\n", file);
+		return 1;
+	}
+	bm_trace_st *tr = malloc(sizeof(bm_trace_st));
+	bm_state_st *state = malloc(sizeof(bm_state_st));
+	if (tr == NULL || state == NULL){
+		fprintf(stderr, "Out of memory\n");
+		free(tr);
+		free(state);
+		fclose(fp);
+		return 1;
+	}
+	bm_trace_init(tr);
+	bm_init(state);
+	bm_device_st device;
+	bm_deviceinit(&device);
+
+	// every message is at least a byte, so a buffer never decodes to more events than its size
+	uint8_t buf[256];
+	bm_ev_st events[256];
+	bm_stamp_st stamps[256];
+	int fd = fileno(fp);
+	bool failed = false;
+	while (true){
+		ssize_t n = read(fd, buf, sizeof(buf));
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n < 0)
+			failed = true;
+		if (n <= 0)
 			break;
-		case BM_EV_BEND:
-			printf("[%4d] {%X} BEND     %d\n", event.delta, event.ev.u.bend.channel,
-				event.ev.u.bend.bend);
+		uint64_t arrival = bm_trace_now();
+		int size = bm_devicebytes_traced(&device, state, buf, (int)n, arrival, events, stamps,
+			(int)n, tr, onwarn, NULL);
+		for (int i = 0; i < size; i++){
+			onevent((bm_delta_ev_st){ .delta = 0, .ev = events[i] }, NULL);
+			out_flush();
+			bm_trace_consumed(tr, &stamps[i]);
+		}
+		out_flush();
+	}
+	fclose(fp);
+	if (failed)
+		fprintf(stderr, "Failed to read file: %s\n", file);
+
+	for (int i = 0; i < BM_STAGES; i++)
+		printlatency(stage_names[i], &tr->stages[i]);
+	printlatency("Latency (total)", &tr->total);
+	if (hgrm_file){
+		FILE *hp = fopen(hgrm_file, "w");
+		if (hp == NULL || !bm_histogram_dump(&tr->total, 1000, onhgrmdump, hp) ||
+			fclose(hp) != 0){
+			fprintf(stderr, "Failed to write histogram: %s\n", hgrm_file);
+			failed = true;
+		}
+	}
+	free(tr);
+	free(state);
+	return failed || out.failed ? 1 : 0;
+}
+
+//
+// following
+//
+// --follow reads a file that's still being written, like tail -f, and prints the events as they're
+// added to it.
+//
+
+static int follow(const char *file){
+	FILE *fp = fopen(file, "rb");
+	if (fp == NULL){
+		fprintf(stderr, "Failed to open file: %s\n", file);
+		return 1;
+	}
+	bm_reader_st *rd = malloc(sizeof(bm_reader_st));
+	if (rd == NULL){
+		fprintf(stderr, "Out of memory\n");
+		fclose(fp);
+		return 1;
+	}
+	bm_reader_init_follow(rd, onwarn, NULL);
+	rd->slices = slices;
+	uint8_t *data = NULL;
+	int size = 0;
+	int count = 0;
+	bool failed = false;
+	bm_delta_ev_st ev;
+	while (!out.failed){
+		if (size >= count){
+			int next = count ? count * 2 : 0x10000;
+			uint8_t *d = next > count ? realloc(data, next) : NULL;
+			if (d == NULL){
+				fprintf(stderr, "Out of memory\n");
+				failed = true;
+				break;
+			}
+			data = d;
+			count = next;
+		}
+		size_t n = fread(&data[size], 1, count - size, fp);
+		if (n == 0){
+			if (ferror(fp)){
+				fprintf(stderr, "Failed to read file: %s\n", file);
+				failed = true;
+				break;
+			}
+			// wait for the file to grow
+			clearerr(fp);
+			struct timespec ts = { .tv_sec = 0, .tv_nsec = 100000000 };
+			nanosleep(&ts, NULL);
+			continue;
+		}
+		size += n;
+		bm_reader_follow(rd, data, size, false);
+		slice_data = data;
+		while (bm_reader_next(rd, &ev))
+			onevent(ev, NULL);
+		out_flush();
+	}
+	fclose(fp);
+	slice_data = NULL;
+	free(data);
+	free(rd);
+	return failed || out.failed ? 1 : 0;
+}
+
+//
+// slices
+//
+// --slices also prints meta events and SysEx messages, with the text of text events.  They're only
+// produced by a reader with `slices` set, so this replaces bm_readmidi and bm_readmidi_stats.
+//
+
+static bool readslices(const uint8_t *data, int size, bm_event_f f_event, void *user,
+	bm_stats_st *stats){
+	bm_reader_st *rd = malloc(sizeof(bm_reader_st));
+	if (rd == NULL){
+		fprintf(stderr, "Out of memory\n");
+		return false;
+	}
+	if (stats){
+		bool count_cycles = stats->count_cycles;
+		bm_stats_init(stats);
+		stats->count_cycles = count_cycles;
+		bm_reader_init_stats(rd, data, size, onwarn, user, stats);
+	}
+	else
+		bm_reader_init(rd, data, size, onwarn, user);
+	rd->slices = slices;
+	bm_delta_ev_st ev;
+	while (bm_reader_next(rd, &ev))
+		f_event(ev, user);
+	free(rd);
+	return true;
+}
+
+//
+// archives
+//
+// -a packs the inputs into an archive, one file at a time through an arena.  An archive used as
+// input is checked by decoding every entry, with the directory split into one contiguous range
+// per worker, and listed as JSON Lines; -x prints one entry's events instead.
+//
+
+static int archive(const pathlist_st *files, const char *archive_file){
+	FILE *fp = fopen(archive_file, "wb");
+	if (fp == NULL){
+		fprintf(stderr, "Failed to open file: %s\n", archive_file);
+		return 1;
+	}
+	bm_archive_writer_st *aw = malloc(sizeof(bm_archive_writer_st));
+	if (aw == NULL){
+		fprintf(stderr, "Out of memory\n");
+		fclose(fp);
+		return 1;
+	}
+	bm_archive_writer_init(aw, NULL, (bm_dump_f)fwrite, fp);
+	bm_arena_st arena;
+	bm_arena_init(&arena, 1 << 20);
+	int failed = 0;
+	int64_t bytes = 0;
+	for (int i = 0; i < files->size; i++){
+		const char *err = NULL;
+		int size = 0;
+		bm_arena_reset(&arena);
+		bm_allocator_st alloc = bm_arena_allocator(&arena);
+		uint8_t *data = readfile(files->paths[i], &alloc, &size, &err);
+		if (data == NULL){
+			fprintf(stderr, "%s: %s\n", err, files->paths[i]);
+			failed++;
+			continue;
+		}
+		bytes += size;
+		if (!bm_archive_add(aw, files->paths[i], data, size, NULL, NULL))
 			break;
-		case BM_EV_MOD:
-			printf("[%4d] {%X} MOD      %d\n", event.delta, event.ev.u.mod.channel, event.ev.u.mod.mod);
+	}
+	bm_arena_free(&arena);
+	bool ok = bm_archive_finish(aw);
+	free(aw);
+	long archive_bytes = ftell(fp);
+	if (fclose(fp) != 0)
+		ok = false;
+	if (!ok){
+		fprintf(stderr, "Failed to write archive: %s\n", archive_file);
+		return 1;
+	}
+	fprintf(stderr, "Archived %d files (%d failed), %lld bytes into %ld bytes\n",
+		files->size - failed, failed, (long long)bytes, archive_bytes);
+	return failed ? 1 : 0;
+}
+
+typedef struct {
+	const bm_archive_st *ar;
+	bool *damaged;
+	int head;
+	int tail;
+} archiveworker_st;
+
+static void *archiveworker(void *user){
+	archiveworker_st *w = user;
+	bm_archive_reader_st *rd = malloc(sizeof(bm_archive_reader_st));
+	if (rd == NULL)
+		return NULL;
+	for (int i = w->head; i < w->tail; i++){
+		bm_archive_reader_init(rd, w->ar, i);
+		bm_delta_ev_st ev;
+		while (bm_archive_reader_next(rd, &ev))
+			;
+		w->damaged[i] = !rd->ok;
+	}
+	free(rd);
+	return NULL;
+}
+
+static int listarchive(const bm_archive_st *ar, int workers){
+	int n = ar->entries_size;
+	bool *damaged = calloc(n > 0 ? n : 1, sizeof(bool));
+	pthread_t *threads = malloc(sizeof(pthread_t) * workers);
+	archiveworker_st *ws = malloc(sizeof(archiveworker_st) * workers);
+	if (damaged == NULL || threads == NULL || ws == NULL){
+		fprintf(stderr, "Out of memory\n");
+		free(damaged);
+		free(threads);
+		free(ws);
+		return 1;
+	}
+	for (int i = 0; i < workers; i++){
+		ws[i] = (archiveworker_st){ .ar = ar, .damaged = damaged,
+			.head = (int)((int64_t)n * i / workers), .tail = (int)((int64_t)n * (i + 1) / workers) };
+	}
+	int started = 0;
+	for (int i = 0; i < workers; i++){
+		if (pthread_create(&threads[i], NULL, archiveworker, &ws[i]) != 0)
 			break;
+		started++;
 	}
+	// if threads ran out, check the ranges of the workers that never started on this one
+	for (int i = started; i < workers; i++)
+		archiveworker(&ws[i]);
+	for (int i = 0; i < started; i++)
+		pthread_join(threads[i], NULL);
+
+	int failed = 0;
+	for (int i = 0; i < n; i++){
+		const bm_archive_entry_st *e = &ar->entries[i];
+		const char *name = bm_archive_name(ar, i);
+		printf("{\"index\":%d,\"name\":", i);
+		jsonstr(stdout, name ? name : "");
+		printf(",\"bytes\":%u,\"compressed\":%u,\"events\":%u,\"status\":\"%s\"}\n",
+			e->source_size, e->size, e->events_size, damaged[i] ? "damaged" : "ok");
+		if (damaged[i])
+			failed++;
+	}
+	free(damaged);
+	free(threads);
+	free(ws);
+	return failed ? 1 : 0;
 }
 
-static void onwarn(const char *msg, void *user){
-	if (mode != MODE_ALL && mode != MODE_WARN)
-		return;
-	printf("WARNING: %s\n", msg);
+// an entry is picked by name, or by index if no entry has that name
+static int printentry(const bm_archive_st *ar, const char *entry){
+	int index = -1;
+	for (int i = 0; i < ar->entries_size && index < 0; i++){
+		const char *name = bm_archive_name(ar, i);
+		if (name && strcmp(name, entry) == 0)
+			index = i;
+	}
+	if (index < 0){
+		char *end;
+		long i = strtol(entry, &end, 10);
+		if (*entry == 0 || *end != 0 || i < 0 || i >= ar->entries_size){
+			fprintf(stderr, "No such entry: %s\n", entry);
+			return 1;
+		}
+		index = (int)i;
+	}
+	bool ok = bm_archive_read(ar, index, onevent, NULL);
+	out_flush();
+	if (!ok){
+		fprintf(stderr, "Damaged archive entry: %s\n", entry);
+		return 1;
+	}
+	return out.failed ? 1 : 0;
 }
 
 static void printhelp(){
@@ -78,11 +1450,51 @@ static void printhelp(){
 		"Copyright (c) 2018 Sean Connelly (@voidqk), MIT License\n"
 		"https://github.com/voidqk/basicmidi  http://sean.cm\n\n"
 		"Usage:\n"
-		"  basicmidi [-w|-e] input.midi\n\n"
+		"  basicmidi [-w|-e] [-f format] [-c output.bmc] [-r output.bmr]\n"
+		"            [-t output.mid] [--stats|--cycles] [--coalesce] [--analyze]\n"
+		"            [--slices] [-p output] input.midi\n"
+		"  basicmidi --sequences [-j threads] [-f format] input.midi\n"
+		"  basicmidi --follow [-w|-e] [-f format] [--slices] input.midi\n"
+		"  basicmidi input.bmc\n"
+		"  basicmidi -l input [-o latency.hgrm]\n"
+		"  basicmidi -b [-j threads] [-o report.jsonl] [--fingerprint] inputs...\n"
+		"  basicmidi -a output.bma inputs...\n"
+		"  basicmidi [-j threads] [-x entry] input.bma\n\n"
 		"Where:\n"
 		"  -w   Only print warnings\n"
 		"  -e   Only print events\n"
-		"  --   Default, print both warnings and events\n");
+		"  --   Default, print both warnings and events\n"
+		"  -f   Output format: text (default), csv, jsonl, or bin (8-byte packed events)\n"
+		"  -c   Write the decoded events to an event cache file\n"
+		"  -r   Write a piano roll of the notes at every zoom level\n"
+		"  -t   Write the song as a format 1 file with one track per channel\n"
+		"  --stats   Print decode statistics to stderr\n"
+		"  --cycles  Like --stats, and also count timestamp cycles per decode phase\n"
+		"  --coalesce  Remove events that don't change the playback state\n"
+		"  --analyze   Print musical features of the song to stderr\n"
+		"  -p   Play the song in real time, writing MIDI bytes to a file, FIFO, or\n"
+		"       device, and print the timing latency to stderr\n"
+		"  -l   Decode live MIDI bytes from a file, FIFO, or device as they arrive, and\n"
+		"       print the latency of each stage to stderr\n"
+		"  --sequences  Decode each sequence of the file on its own thread\n"
+		"  --follow  Keep printing events as the file grows, like tail -f, until\n"
+		"            interrupted\n"
+		"  --slices  Also print meta events and SysEx messages, with the text of text\n"
+		"            events\n"
+		"  -b   Batch mode, decode every input and write a JSON Lines report\n"
+		"  -j   Number of worker threads for batch mode and --sequences\n"
+		"       (default: number of CPUs)\n"
+		"  -o   Write the batch report to a file instead of stdout, or with -l, the total\n"
+		"       latency in HdrHistogram's percentile format (in microseconds)\n"
+		"  --fingerprint  Add each file's exact hash and MinHash signature to the\n"
+		"                 batch report, for finding duplicates\n"
+		"  -a   Compress the events of every input into an archive\n"
+		"  -x   Print the events of one archive entry, by name or index, instead of\n"
+		"       checking and listing every entry\n\n"
+		"Event cache files (.bmc) and archives (.bma) are detected automatically when\n"
+		"used as input.\n"
+		"Batch and archive inputs can be files, directories (searched recursively), globs, or\n"
+		"@list files containing one input per line (@- reads the list from stdin).\n");
 }
 
 int main(int argc, char **argv){
@@ -91,45 +1503,313 @@ int main(int argc, char **argv){
 		return 0;
 	}
 
-	const char *file = argv[1];
-	if (strcmp(file, "-w") == 0 || strcmp(file, "-e") == 0 || strcmp(file, "--") == 0){
-		if (strcmp(file, "-w") == 0)
+	const char *file = NULL;
+	const char *cache_file = NULL;
+	const char *report_file = NULL;
+	const char *play_file = NULL;
+	const char *live_file = NULL;
+	const char *archive_file = NULL;
+	const char *roll_file = NULL;
+	const char *tracks_file = NULL;
+	const char *entry = NULL;
+	bool batch_mode = false;
+	bool show_stats = false;
+	bool count_cycles = false;
+	bool coalesce = false;
+	bool analyze = false;
+	bool seq_mode = false;
+	bool follow_mode = false;
+	int workers = 0;
+	int positional = 1;
+	pathlist_st inputs = { .paths = NULL, .size = 0, .count = 0 };
+	for (int i = 1; i < argc; i++){
+		if (strcmp(argv[i], "-w") == 0)
 			mode = MODE_WARN;
-		else if (strcmp(file, "-e") == 0)
+		else if (strcmp(argv[i], "-e") == 0)
 			mode = MODE_EV;
-		if (argc <= 2){
-			printhelp();
-			return 1;
+		else if (strcmp(argv[i], "--") == 0)
+			mode = MODE_ALL;
+		else if (strcmp(argv[i], "-b") == 0)
+			batch_mode = true;
+		else if (strcmp(argv[i], "--stats") == 0)
+			show_stats = true;
+		else if (strcmp(argv[i], "--cycles") == 0)
+			show_stats = count_cycles = true;
+		else if (strcmp(argv[i], "--coalesce") == 0)
+			coalesce = true;
+		else if (strcmp(argv[i], "--sequences") == 0)
+			seq_mode = true;
+		else if (strcmp(argv[i], "--follow") == 0)
+			follow_mode = true;
+		else if (strcmp(argv[i], "--analyze") == 0)
+			analyze = true;
+		else if (strcmp(argv[i], "--fingerprint") == 0)
+			fingerprints = true;
+		else if (strcmp(argv[i], "--slices") == 0)
+			slices = BM_SLICE_ALL;
+		else if (strcmp(argv[i], "-c") == 0 || strcmp(argv[i], "-o") == 0 ||
+			strcmp(argv[i], "-j") == 0 || strcmp(argv[i], "-f") == 0 ||
+			strcmp(argv[i], "-p") == 0 || strcmp(argv[i], "-a") == 0 ||
+			strcmp(argv[i], "-x") == 0 || strcmp(argv[i], "-r") == 0 ||
+			strcmp(argv[i], "-t") == 0 || strcmp(argv[i], "-l") == 0){
+			if (i + 1 >= argc){
+				printhelp();
+				return 1;
+			}
+			if (argv[i][1] == 'c')
+				cache_file = argv[++i];
+			else if (argv[i][1] == 'o')
+				report_file = argv[++i];
+			else if (argv[i][1] == 'p')
+				play_file = argv[++i];
+			else if (argv[i][1] == 'a')
+				archive_file = argv[++i];
+			else if (argv[i][1] == 'x')
+				entry = argv[++i];
+			else if (argv[i][1] == 'r')
+				roll_file = argv[++i];
+			else if (argv[i][1] == 't')
+				tracks_file = argv[++i];
+			else if (argv[i][1] == 'l')
+				live_file = argv[++i];
+			else if (argv[i][1] == 'f'){
+				const char *f = argv[++i];
+				if (strcmp(f, "text") == 0)
+					format = FORMAT_TEXT;
+				else if (strcmp(f, "csv") == 0)
+					format = FORMAT_CSV;
+				else if (strcmp(f, "jsonl") == 0)
+					format = FORMAT_JSONL;
+				else if (strcmp(f, "bin") == 0)
+					format = FORMAT_BIN;
+				else{
+					fprintf(stderr, "Unknown format: %s\n", f);
+					return 1;
+				}
+			}
+			else
+				workers = atoi(argv[++i]);
+		}
+		else{
+			// save positional arguments in place, since -b can come after them
+			argv[positional++] = argv[i];
 		}
-		file = argv[2];
 	}
 
-	// read entire file
-	FILE *fp = fopen(file, "rb");
-	if (fp == NULL){
-		fprintf(stderr, "Failed to open file: %s\n", file);
+	if (workers <= 0){
+		long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+		workers = cpus > 0 ? (int)cpus : 1;
+	}
+	if (batch_mode || archive_file){
+		for (int i = 1; i < positional; i++){
+			if (!addinput(&inputs, argv[i])){
+				fprintf(stderr, "Out of memory\n");
+				return 1;
+			}
+		}
+	}
+	if (live_file)
+		return livein(live_file, report_file);
+	if (archive_file){
+		int res = archive(&inputs, archive_file);
+		for (int i = 0; i < inputs.size; i++)
+			free(inputs.paths[i]);
+		free(inputs.paths);
+		return res;
+	}
+	if (batch_mode){
+		FILE *report = stdout;
+		if (report_file){
+			report = fopen(report_file, "w");
+			if (report == NULL){
+				fprintf(stderr, "Failed to open file: %s\n", report_file);
+				return 1;
+			}
+		}
+		int res = batch(&inputs, workers, report);
+		if (report != stdout && fclose(report) != 0){
+			fprintf(stderr, "Failed to write report: %s\n", report_file);
+			res = 1;
+		}
+		for (int i = 0; i < inputs.size; i++)
+			free(inputs.paths[i]);
+		free(inputs.paths);
+		return res;
+	}
+	if (positional != 2){
+		printhelp();
 		return 1;
 	}
-	fseek(fp, 0L, SEEK_END);
-	int size = ftell(fp);
-	fseek(fp, 0L, SEEK_SET);
-	uint8_t *data = malloc(sizeof(uint8_t) * size);
+	file = argv[1];
+	if (follow_mode)
+		return follow(file);
+
+	// read entire file
+	const char *err = NULL;
+	int size = 0;
+	uint8_t *data = readfile(file, NULL, &size, &err);
 	if (data == NULL){
-		fprintf(stderr, "Out of memory\n");
-		fclose(fp);
+		fprintf(stderr, "%s: %s\n", err, file);
 		return 1;
 	}
-	if (fread(data, 1, size, fp) != size){
-		fprintf(stderr, "Failed to read all of file\n");
-		fclose(fp);
+
+	// event caches are replayed directly, without decoding
+	bm_cache_st cache;
+	if (size >= 4 && memcmp(data, "BMEC", 4) == 0){
+		if (!bm_cacheopen(&cache, data, size)){
+			fprintf(stderr, "Invalid event cache: %s\n", file);
+			free(data);
+			return 1;
+		}
+		for (int i = 0; i < cache.events_size; i++)
+			onevent(bm_cacheevent(&cache, i), NULL);
 		free(data);
-		return 1;
+		out_flush();
+		return out.failed ? 1 : 0;
+	}
+
+	bm_archive_st ar;
+	if (size >= 4 && memcmp(data, "BMAR", 4) == 0){
+		if (!bm_archive_open(&ar, data, size)){
+			fprintf(stderr, "Invalid archive: %s\n", file);
+			free(data);
+			return 1;
+		}
+		int res = entry ? printentry(&ar, entry) : listarchive(&ar, workers);
+		free(data);
+		return res;
 	}
-	fclose(fp);
 
-	// process file
-	bm_readmidi(data, size, onevent, onwarn, NULL);
+	if (seq_mode){
+		int res = sequences(data, size, workers);
+		free(data);
+		return res;
+	}
 
+	// process file, collecting the events if they need to be written out to the cache
+	bm_stats_st stats = { .count_cycles = count_cycles };
+	evlist_st list = { .events = NULL, .size = 0, .count = 0, .oom = false };
+	bm_event_f f_event = cache_file ? oncollect : onevent;
+	void *user = cache_file ? &list : NULL;
+	FILE *play_fp = NULL;
+	play_st *play = NULL;
+	if (play_file){
+		play_fp = fopen(play_file, "wb");
+		if (play_fp == NULL){
+			fprintf(stderr, "Failed to open file: %s\n", play_file);
+			free(data);
+			return 1;
+		}
+		// bytes need to leave as soon as they're played
+		setvbuf(play_fp, NULL, _IONBF, 0);
+		play = malloc(sizeof(play_st));
+		if (play == NULL){
+			fprintf(stderr, "Out of memory\n");
+			fclose(play_fp);
+			free(data);
+			return 1;
+		}
+		bm_wiresink_init(&play->ws, (bm_dump_f)fwrite, play_fp);
+		play->f_event = f_event;
+		play->user = user;
+		bm_player_init(&play->pl, onplay, play);
+		f_event = bm_player_event;
+		user = &play->pl;
+	}
+	analyze_tee_st *tee = NULL;
+	if (analyze){
+		tee = malloc(sizeof(analyze_tee_st));
+		if (tee == NULL){
+			fprintf(stderr, "Out of memory\n");
+			free(play);
+			if (play_fp)
+				fclose(play_fp);
+			free(data);
+			return 1;
+		}
+		bm_analyze_init(&tee->an);
+		tee->f_event = f_event;
+		tee->user = user;
+		f_event = onanalyze;
+		user = tee;
+	}
+	bm_coalesce_st *co = NULL;
+	if (coalesce){
+		co = malloc(sizeof(bm_coalesce_st));
+		if (co == NULL){
+			fprintf(stderr, "Out of memory\n");
+			free(tee);
+			free(play);
+			if (play_fp)
+				fclose(play_fp);
+			free(data);
+			return 1;
+		}
+		bm_coalesce_init(co, f_event, user);
+		f_event = bm_coalesce_event;
+		user = co;
+	}
+	bool slices_failed = false;
+	if (slices){
+		slice_data = data;
+		slices_failed = !readslices(data, size, f_event, user, show_stats ? &stats : NULL);
+	}
+	else if (show_stats)
+		bm_readmidi_stats(data, size, f_event, onwarn, user, &stats);
+	else
+		bm_readmidi(data, size, f_event, onwarn, user);
+	if (co)
+		bm_coalesce_finish(co); // before the data is freed, since held events can be slices
+	bool roll_failed = roll_file && !writeroll(data, size, roll_file);
+	bool tracks_failed = tracks_file && !splittracks(data, size, tracks_file);
+	if (cache_file && !list.oom){
+		// printed while the slices can still be read
+		for (int i = 0; i < list.size; i++)
+			onevent(list.events[i], NULL);
+	}
+	slice_data = NULL;
 	free(data);
-	return 0;
+	out_flush();
+	if (show_stats)
+		printstats(&stats);
+	if (co)
+		printcoalesced(co);
+	if (tee){
+		bm_analyze_finish(&tee->an);
+		printfeatures(&tee->an.features);
+	}
+	bool play_failed = false;
+	if (play){
+		printlatency("Latency", &play->pl.latency);
+		if (fclose(play_fp) != 0 || !play->ws.ok){
+			fprintf(stderr, "Failed to write to: %s\n", play_file);
+			play_failed = true;
+		}
+	}
+	free(co);
+	free(tee);
+	free(play);
+	if (cache_file == NULL)
+		return out.failed || play_failed || roll_failed || tracks_failed || slices_failed ? 1 : 0;
+
+	if (list.oom){
+		fprintf(stderr, "Out of memory\n");
+		free(list.events);
+		return 1;
+	}
+	FILE *fp = fopen(cache_file, "wb");
+	if (fp == NULL){
+		fprintf(stderr, "Failed to open file: %s\n", cache_file);
+		free(list.events);
+		return 1;
+	}
+	bool ok = bm_writecache(list.events, list.size, (bm_dump_f)fwrite, fp);
+	if (fclose(fp) != 0)
+		ok = false;
+	free(list.events);
+	if (!ok){
+		fprintf(stderr, "Failed to write event cache: %s\n", cache_file);
+		return 1;
+	}
+	return out.failed || play_failed || roll_failed || tracks_failed || slices_failed ? 1 : 0;
 }
@@ -0,0 +1,96 @@
+// (c) Copyright 2018, Sean Connelly (@voidqk), http://sean.cm
+// MIT License
+// Project Home: https://github.com/voidqk/basicmidi
+
+// checks that the default coalescing config keeps controller changes that happen between notes in
+// the same tick, and pedal re-catches, while still collapsing plain bursts
+
+#include "../src/basicmidi.h"
+#include <stdio.h>
+#include <string.h>
+
+static int failures = 0;
+
+typedef struct {
+	int size;
+	bm_delta_ev_st events[32];
+} out_st;
+
+static void collect(bm_delta_ev_st ev, void *user){
+	out_st *out = user;
+	if (out->size < 32)
+		out->events[out->size++] = ev;
+}
+
+static bool same_ev(bm_delta_ev_st a, bm_delta_ev_st b){
+	bm_packed_ev_st pa = bm_pack(a);
+	bm_packed_ev_st pb = bm_pack(b);
+	return memcmp(&pa, &pb, sizeof(pa)) == 0;
+}
+
+static void check(const char *name, const bm_delta_ev_st *in, int in_size,
+	const bm_delta_ev_st *want, int want_size){
+	bm_coalesce_st co;
+	out_st out = { 0 };
+	bm_coalesce_init(&co, collect, &out);
+	for (int i = 0; i < in_size; i++)
+		bm_coalesce_event(in[i], &co);
+	bm_coalesce_finish(&co);
+	bool ok = out.size == want_size;
+	for (int i = 0; ok && i < want_size; i++)
+		ok = same_ev(out.events[i], want[i]);
+	if (!ok){
+		printf("FAIL %s: got %d events, expected %d\n", name, out.size, want_size);
+		failures++;
+	}
+}
+
+#define EV(dt, e) ((bm_delta_ev_st){ .delta = (dt), .ev = (e) })
+
+int main(){
+	// the patch change before note 60 has to survive, or the note plays on the wrong patch, and
+	// the change back to 0 is then a real change
+	{
+		bm_delta_ev_st in[] = {
+			EV(0, bm_ev_patch(0, 40)),
+			EV(0, bm_ev_noteon(0, 60, 100)),
+			EV(0, bm_ev_patch(0, 0)),
+			EV(0, bm_ev_noteon(0, 64, 100))
+		};
+		check("patch between notes", in, 4, in, 4);
+	}
+
+	// releasing and re-catching the sustain pedal in one tick releases the held notes
+	{
+		bm_delta_ev_st in[] = {
+			EV(0, bm_ev_pedalon(0, BM_PEDAL_DAMPER)),
+			EV(0, bm_ev_noteon(0, 60, 100)),
+			EV(0, bm_ev_noteoff(0, 60)),
+			EV(10, bm_ev_pedaloff(0, BM_PEDAL_DAMPER)),
+			EV(0, bm_ev_pedalon(0, BM_PEDAL_DAMPER))
+		};
+		check("pedal re-catch", in, 5, in, 5);
+	}
+
+	// repeated controller events with nothing between them still collapse to the last one, and
+	// pass their deltas on
+	{
+		bm_delta_ev_st in[] = {
+			EV(5, bm_ev_bend(0, 100)),
+			EV(0, bm_ev_pedalon(1, BM_PEDAL_SOFT)),
+			EV(0, bm_ev_bend(0, 200)),
+			EV(0, bm_ev_pedalon(1, BM_PEDAL_SOFT)),
+			EV(0, bm_ev_bend(0, 300)),
+			EV(0, bm_ev_noteon(0, 60, 100))
+		};
+		bm_delta_ev_st want[] = {
+			EV(5, bm_ev_pedalon(1, BM_PEDAL_SOFT)),
+			EV(0, bm_ev_bend(0, 300)),
+			EV(0, bm_ev_noteon(0, 60, 100))
+		};
+		check("burst", in, 6, want, 3);
+	}
+
+	printf("coalesce: %d failure%s\n", failures, failures == 1 ? "" : "s");
+	return failures ? 1 : 0;
+}
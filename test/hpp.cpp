@@ -0,0 +1,142 @@
+// (c) Copyright 2018, Sean Connelly (@voidqk), http://sean.cm
+// MIT License
+// Project Home: https://github.com/voidqk/basicmidi
+
+// checks that bm::read produces the same events and warnings as bm_readmidi, for every kind of
+// handler, on a file with one of most messages, and on damaged copies of it
+
+#include "../src/basicmidi.hpp"
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <vector>
+
+static int failures = 0;
+
+struct log_st {
+	std::vector<bm_packed_ev_st> events;
+	std::vector<std::string> warnings;
+};
+
+static void c_event(bm_delta_ev_st ev, void *user){
+	static_cast<log_st *>(user)->events.push_back(bm_pack(ev));
+}
+
+static void c_warn(const char *msg, void *user){
+	static_cast<log_st *>(user)->warnings.push_back(msg);
+}
+
+struct full_handler {
+	log_st log;
+	void on_event(const bm_delta_ev_st &ev){ log.events.push_back(bm_pack(ev)); }
+	void on_warn(const char *msg){ log.warnings.push_back(msg); }
+};
+
+struct event_handler {
+	log_st log;
+	void on_event(const bm_delta_ev_st &ev){ log.events.push_back(bm_pack(ev)); }
+};
+
+static bool same_events(const log_st &a, const log_st &b){
+	return a.events.size() == b.events.size() && (a.events.empty() ||
+		memcmp(a.events.data(), b.events.data(), a.events.size() * sizeof(bm_packed_ev_st)) == 0);
+}
+
+static void check(const char *name, const std::vector<uint8_t> &data, bool expect_warnings){
+	log_st want;
+	bm_readmidi(data.data(), static_cast<int>(data.size()), c_event, c_warn, &want);
+	if (want.events.empty() || expect_warnings != !want.warnings.empty()){
+		printf("FAIL %s: bad test data (%d events, %d warnings)\n", name,
+			static_cast<int>(want.events.size()), static_cast<int>(want.warnings.size()));
+		failures++;
+		return;
+	}
+
+	full_handler full;
+	bm::read(data, full);
+	if (!same_events(full.log, want) || full.log.warnings != want.warnings){
+		printf("FAIL %s: on_event/on_warn handler differs\n", name);
+		failures++;
+	}
+
+	event_handler events;
+	bm::read(data.data(), static_cast<int>(data.size()), events);
+	if (!same_events(events.log, want)){
+		printf("FAIL %s: on_event handler differs\n", name);
+		failures++;
+	}
+
+	log_st lambda;
+	bm::read(data, [&lambda](const bm_delta_ev_st &ev){ lambda.events.push_back(bm_pack(ev)); });
+	if (!same_events(lambda, want)){
+		printf("FAIL %s: callable handler differs\n", name);
+		failures++;
+	}
+}
+
+static void put32(std::vector<uint8_t> &out, size_t at, uint32_t v){
+	out[at + 0] = v >> 24;
+	out[at + 1] = (v >> 16) & 0xFF;
+	out[at + 2] = (v >> 8) & 0xFF;
+	out[at + 3] = v & 0xFF;
+}
+
+static void add_track(std::vector<uint8_t> &out, const std::vector<uint8_t> &trk){
+	size_t at = out.size();
+	out.insert(out.end(), { 'M', 'T', 'r', 'k', 0, 0, 0, 0 });
+	put32(out, at + 4, static_cast<uint32_t>(trk.size()));
+	out.insert(out.end(), trk.begin(), trk.end());
+}
+
+int main(){
+	std::vector<uint8_t> mid = { 'M', 'T', 'h', 'd', 0, 0, 0, 6, 0, 1, 0, 2, 0, 96 };
+	add_track(mid, {
+		0x00, 0xFF, 0x51, 0x03, 0x07, 0xA1, 0x20,             // tempo
+		0x00, 0xF0, 0x07, 0x7F, 0x7F, 0x04, 0x01, 0x00, 0x60, 0xF7, // master volume
+		0x00, 0xF0, 0x07, 0x7F, 0x7F, 0x04, 0x02, 0x00, 0x20, 0xF7, // master balance
+		0x00, 0xFF, 0x01, 0x04, 't', 'e', 'x', 't',           // ignored meta event
+		0x00, 0xFF, 0x2F, 0x00
+	});
+	size_t trk2 = mid.size() + 8;
+	add_track(mid, {
+		0x00, 0xC1, 0x05,                                     // patch
+		0x00, 0xB1, 0x07, 0x64, 0x00, 0x27, 0x10,             // volume, running status
+		0x00, 0xB1, 0x0A, 0x20,                               // pan
+		0x00, 0xB1, 0x40, 0x7F,                               // pedal on
+		0x00, 0x91, 0x3C, 0x64,                               // note on
+		0x81, 0x00, 0x3E, 0x50,                               // running status, 2-byte delta
+		0x20, 0xE1, 0x00, 0x50,                               // bend
+		0x00, 0xB1, 0x01, 0x30,                               // mod
+		0x83, 0x80, 0x00, 0x81, 0x3C, 0x00,                   // note off, 3-byte delta
+		0x00, 0x91, 0x3E, 0x00,                               // note on with 0 velocity
+		0x00, 0xB1, 0x40, 0x00,                               // pedal off
+		0x00, 0xFF, 0x2F, 0x00
+	});
+	check("clean", mid, false);
+
+	// the same tracks as format 2 patterns, which bm::read steps between through bm_reader_next
+	std::vector<uint8_t> f2 = mid;
+	f2[9] = 2;
+	check("format 2", f2, false);
+
+	// a bad status byte mid-track
+	std::vector<uint8_t> bad = mid;
+	bad[trk2 + 4] = 0xF4;
+	check("bad status", bad, true);
+
+	// cut off in the middle of the second track
+	std::vector<uint8_t> cut(mid.begin(), mid.end() - 20);
+	check("truncated", cut, true);
+
+	// a delta that doesn't end within 4 bytes
+	std::vector<uint8_t> dt = mid;
+	std::vector<uint8_t> trk = { 0x00, 0x91, 0x3C, 0x64, 0xFF, 0xFF, 0xFF, 0xFF, 0x7F, 0x3C, 0x00 };
+	dt.insert(dt.end(), { 'M', 'T', 'r', 'k', 0, 0, 0, 0 });
+	put32(dt, dt.size() - 4, static_cast<uint32_t>(trk.size()));
+	dt.insert(dt.end(), trk.begin(), trk.end());
+	dt[11] = 3;
+	check("long delta", dt, true);
+
+	printf("hpp: %d failure%s\n", failures, failures == 1 ? "" : "s");
+	return failures ? 1 : 0;
+}
@@ -0,0 +1,102 @@
+// (c) Copyright 2018, Sean Connelly (@voidqk), http://sean.cm
+// MIT License
+// Project Home: https://github.com/voidqk/basicmidi
+
+// checks bm_noteindex_range and bm_noteindex_at against a brute force scan over random notes, for
+// sizes around the tree's level boundaries, shared start ticks, zero-length notes, unsorted input,
+// channel filters, and results cut short by max_out
+
+#include "../src/basicmidi.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define MAX_NOTES 1100
+
+static int failures = 0;
+static uint64_t checks = 0;
+static uint32_t seed = 1;
+
+static uint32_t rnd(uint32_t n){
+	seed = seed * 1103515245 + 12345;
+	return (seed >> 8) % n;
+}
+
+// the reference: every note in the index's sorted array that overlaps [start, end), in order
+static int ref_range(const bm_noteindex_st *idx, uint32_t start, uint32_t end, uint16_t channels,
+	int *out){
+	int total = 0;
+	for (int i = 0; i < idx->size; i++){
+		const bm_note_st *note = &idx->notes[i];
+		uint32_t note_end = note->start + (note->duration > 0 ? note->duration : 1);
+		if (note->start < end && start < note_end && (channels & (1 << note->channel)))
+			out[total++] = i;
+	}
+	return total;
+}
+
+static void check(const char *name, const bm_noteindex_st *idx, uint32_t start, uint32_t end,
+	uint16_t channels, int total, const int *out, int max_out){
+	static int want[MAX_NOTES];
+	int want_total = end > start ? ref_range(idx, start, end, channels, want) : 0;
+	int written = total < max_out ? total : max_out;
+	bool ok = total == want_total && memcmp(out, want, sizeof(int) * written) == 0;
+	checks++;
+	if (!ok){
+		printf("FAIL %s [%u, %u) channels %04X: got %d notes, expected %d\n", name, start, end,
+			channels, total, want_total);
+		failures++;
+	}
+}
+
+int main(){
+	static bm_note_st notes[MAX_NOTES];
+	static int out[MAX_NOTES];
+	for (int trial = 0; trial < 300; trial++){
+		// small sizes cover the linear scan at the bottom of the tree, and the rest cross a few
+		// levels, with start ticks spread thin or packed together
+		int size = trial < 40 ? trial : (int)rnd(MAX_NOTES + 1);
+		uint32_t spread = 1 + rnd(trial % 3 == 0 ? 50 : 5000);
+		uint32_t tick = 0;
+		for (int i = 0; i < size; i++){
+			tick += rnd(spread) / 8;
+			notes[i] = (bm_note_st){
+				.start = tick,
+				.duration = rnd(4) == 0 ? 0 : rnd(spread * 2),
+				.channel = rnd(16),
+				.note = rnd(128),
+				.velocity = 1 + rnd(127)
+			};
+		}
+		// some inputs are out of order, so the index has to sort them
+		if (size > 1 && trial % 4 == 1){
+			for (int i = 0; i < size; i++){
+				int j = rnd(size);
+				bm_note_st t = notes[i];
+				notes[i] = notes[j];
+				notes[j] = t;
+			}
+		}
+
+		bm_noteindex_st idx;
+		if (!bm_noteindex_build(&idx, notes, size, NULL)){
+			printf("FAIL build: out of memory for %d notes\n", size);
+			return 1;
+		}
+		for (int q = 0; q < 200; q++){
+			uint32_t start = rnd(tick + 2 * spread + 2);
+			uint32_t end = start + rnd(q % 5 == 0 ? 3 : spread * 4);
+			uint16_t channels = q % 3 == 0 ? 0xFFFF : (uint16_t)rnd(0x10000);
+			int max_out = q % 7 == 0 ? (int)rnd(8) : MAX_NOTES;
+			int total = bm_noteindex_range(&idx, start, end, channels, out, max_out);
+			check("range", &idx, start, end, channels, total, out, max_out);
+			total = bm_noteindex_at(&idx, start, channels, out, max_out);
+			check("at", &idx, start, start + 1, channels, total, out, max_out);
+		}
+		bm_noteindex_free(&idx);
+	}
+
+	printf("noteindex: %llu checks, %d failure%s\n", (unsigned long long)checks, failures,
+		failures == 1 ? "" : "s");
+	return failures ? 1 : 0;
+}
@@ -0,0 +1,142 @@
+// (c) Copyright 2018, Sean Connelly (@voidqk), http://sean.cm
+// MIT License
+// Project Home: https://github.com/voidqk/basicmidi
+
+// differential test of read_dt and data_length against reference byte-by-byte decodes, so a
+// faster decode can't slip in with different results, for every 1 and 2 byte quantity, sampled 3
+// and 4 byte quantities, quantities that don't terminate within 4 bytes, and every position near
+// the end of the data
+
+#include "../src/basicmidi.c"
+
+static int failures = 0;
+static uint64_t checks = 0;
+
+// the reference for timestamps
+static bool ref_dt(chunk_st *chunk, const uint8_t *data){
+	if (chunk->start >= chunk->end)
+		return false;
+	int dt = 0;
+	int len = 0;
+	while (true){
+		len++;
+		if (len >= 5)
+			return false;
+		int t = data[chunk->start++];
+		if (t & 0x80){
+			if (chunk->start >= chunk->end)
+				return false;
+			dt = (dt << 7) | (t & 0x7F);
+		}
+		else{
+			dt = (dt << 7) | t;
+			break;
+		}
+	}
+	chunk->dt = dt;
+	return true;
+}
+
+// the reference for SysEx and meta event lengths
+static int ref_length(const uint8_t *data, int *p, int data_size, int *length){
+	int dl = 0;
+	int len = 0;
+	while (true){
+		if (*p >= data_size)
+			return 0;
+		len++;
+		if (len >= 5)
+			return -1;
+		int t = data[(*p)++];
+		dl = (dl << 7) | (t & 0x7F);
+		if ((t & 0x80) == 0)
+			break;
+	}
+	*length = dl;
+	return 1;
+}
+
+static void fail(const uint8_t *seq, int seq_size, int avail, const char *what){
+	if (failures++ < 20){
+		printf("FAIL %s: avail %d, bytes", what, avail);
+		for (int i = 0; i < seq_size; i++)
+			printf(" %02X", seq[i]);
+		printf("\n");
+	}
+}
+
+// checks `seq` followed by `pad` at the start of data, with the data ending after `avail` bytes;
+// the data is allocated to its exact size, so reading past the end is caught by sanitizers
+static void check(const uint8_t *seq, int seq_size, const uint8_t *pad, int avail){
+	uint8_t *data = malloc(avail > 0 ? avail : 1);
+	for (int i = 0; i < avail; i++)
+		data[i] = i < seq_size ? seq[i] : pad[i - seq_size];
+
+	chunk_st a = { .start = 0, .end = avail, .dt = -1 };
+	chunk_st b = a;
+	bool ra = read_dt(&a, data, 0, NULL, NULL, NULL);
+	bool rb = ref_dt(&b, data);
+	if (ra != rb || (ra && (a.start != b.start || a.dt != b.dt)))
+		fail(seq, seq_size, avail, "read_dt");
+
+	int pa = 0, pb = 0, la = -1, lb = -1;
+	int da = data_length(data, &pa, avail, &la);
+	int db = ref_length(data, &pb, avail, &lb);
+	if (da != db || (da > 0 && (pa != pb || la != lb)))
+		fail(seq, seq_size, avail, "data_length");
+
+	checks++;
+	free(data);
+}
+
+// every amount of data from none up to 4 bytes past the quantity
+static void check_ends(const uint8_t *seq, int seq_size){
+	static const uint8_t pads[2][4] = { { 0x00, 0x00, 0x00, 0x00 }, { 0xFF, 0x81, 0x80, 0x7F } };
+	for (int p = 0; p < 2; p++){
+		for (int avail = 0; avail <= seq_size + 4; avail++)
+			check(seq, seq_size, pads[p], avail);
+	}
+}
+
+static uint32_t rng = 1;
+static uint32_t rand32(){
+	rng ^= rng << 13;
+	rng ^= rng >> 17;
+	rng ^= rng << 5;
+	return rng;
+}
+
+int main(){
+	uint8_t seq[5];
+
+	// every 1 and 2 byte sequence, which covers every 1 byte quantity, every 2 byte quantity, and
+	// 2 byte prefixes of longer ones
+	for (int a = 0; a < 256; a++){
+		seq[0] = a;
+		check_ends(seq, 1);
+		for (int b = 0; b < 256; b++){
+			seq[1] = b;
+			check_ends(seq, 2);
+		}
+	}
+
+	// 3 and 4 byte quantities, including the largest, and ones that don't terminate in 4 bytes
+	for (int i = 0; i < 200000; i++){
+		uint32_t r = rand32();
+		int size = 3 + i % 3;
+		for (int j = 0; j < size - 1; j++)
+			seq[j] = 0x80 | ((r >> (j * 7)) & 0x7F);
+		seq[size - 1] = (i & 1) ? (r >> 24) & 0x7F : 0x80 | ((r >> 24) & 0x7F);
+		if (i == 0)
+			memset(seq, 0xFF, size); // 5 continuation bytes
+		else if (i == 1){
+			memset(seq, 0xFF, 3);
+			seq[3] = 0x7F; // 0x0FFFFFFF, the largest quantity
+		}
+		check_ends(seq, size);
+	}
+
+	printf("vlq: %llu checks, %d failure%s\n", (unsigned long long)checks, failures,
+		failures == 1 ? "" : "s");
+	return failures ? 1 : 0;
+}